@@ -10,6 +10,32 @@
 #include <algorithm>
 #include <iomanip>
 #include <memory>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <stdexcept>
+#include <sstream>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <set>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -52,284 +78,3874 @@ int getMonth(const string& dateStr) {
     return tm.tm_mon + 1;
 }
 
-// Random number generator
+// Calendar features for a single date
+struct CalendarRow {
+    int dayOfWeek;    // 0-6, Sunday=0
+    int month;        // 1-12
+    bool isWeekend;
+    bool isHoliday;
+    string eventName; // custom retail event, empty when none
+};
+
+// Precomputed calendar features for a contiguous date range, so forecasts
+// for many SKUs on the same date share one row instead of re-parsing dates
+class CalendarFeatureTable {
+public:
+    void build(const string& startDate, int days) {
+        rows.clear();
+        dates.clear();
+        dateIndex.clear();
+
+        tm start = {};
+        istringstream iss(startDate);
+        iss >> get_time(&start, "%Y-%m-%d");
+        start.tm_hour = 12; // stay clear of DST transitions
+        start.tm_isdst = -1;
+
+        for (int i = 0; i < days; ++i) {
+            tm day = start;
+            day.tm_mday += i;
+            mktime(&day);
+            char buf[11];
+            strftime(buf, sizeof(buf), "%Y-%m-%d", &day);
+
+            dateIndex[buf] = static_cast<int>(rows.size());
+            dates.push_back(buf);
+            rows.push_back(makeRow(day));
+        }
+    }
+
+    void addHoliday(const string& date) {
+        auto it = dateIndex.find(date);
+        if (it != dateIndex.end()) {
+            rows[it->second].isHoliday = true;
+        }
+    }
+
+    void addEvent(const string& date, const string& eventName) {
+        auto it = dateIndex.find(date);
+        if (it != dateIndex.end()) {
+            rows[it->second].eventName = eventName;
+        }
+    }
+
+    // Returns nullptr for dates outside the table
+    const CalendarRow* find(const string& date) const {
+        auto it = dateIndex.find(date);
+        return it == dateIndex.end() ? nullptr : &rows[it->second];
+    }
+
+    // Row for any date. Dates outside the built range are computed on first
+    // use and kept, so the reference stays valid for the table's lifetime.
+    const CalendarRow& lookup(const string& date) const {
+        if (const CalendarRow* row = find(date)) {
+            return *row;
+        }
+        lock_guard<mutex> lock(extraMutex);
+        auto it = extraIndex.find(date);
+        if (it != extraIndex.end()) {
+            return extraRows[it->second];
+        }
+        tm day = {};
+        istringstream iss(date);
+        iss >> get_time(&day, "%Y-%m-%d");
+        day.tm_hour = 12;
+        day.tm_isdst = -1;
+        mktime(&day);
+        extraIndex[date] = extraRows.size();
+        extraRows.push_back(makeRow(day));
+        return extraRows.back();
+    }
+
+    const string& dateAt(int index) const {
+        return dates[index];
+    }
+
+    int indexOf(const string& date) const {
+        auto it = dateIndex.find(date);
+        return it == dateIndex.end() ? -1 : it->second;
+    }
+
+    size_t size() const {
+        return rows.size();
+    }
+
+private:
+    vector<CalendarRow> rows;
+    vector<string> dates;
+    unordered_map<string, int> dateIndex;
+    mutable mutex extraMutex; // guards the rows for dates outside the range
+    mutable deque<CalendarRow> extraRows;
+    mutable unordered_map<string, size_t> extraIndex;
+
+    static CalendarRow makeRow(const tm& day) {
+        CalendarRow row;
+        row.dayOfWeek = day.tm_wday;
+        row.month = day.tm_mon + 1;
+        row.isWeekend = day.tm_wday == 0 || day.tm_wday == 6;
+        row.isHoliday = isFixedHoliday(day) || isThanksgiving(day);
+        if (day.tm_mon == 10 && day.tm_wday == 5 && day.tm_mday >= 23 && day.tm_mday <= 29) {
+            row.eventName = "black_friday";
+        }
+        return row;
+    }
+
+    static bool isFixedHoliday(const tm& day) {
+        int month = day.tm_mon + 1;
+        return (month == 1 && day.tm_mday == 1) ||
+               (month == 7 && day.tm_mday == 4) ||
+               (month == 12 && day.tm_mday == 25);
+    }
+
+    // Fourth Thursday of November
+    static bool isThanksgiving(const tm& day) {
+        return day.tm_mon == 10 && day.tm_wday == 4 && day.tm_mday >= 22 && day.tm_mday <= 28;
+    }
+};
+
+// Random number generator shared by the simulator. It starts from a
+// random_device seed; seedRandom makes a run reproducible.
+unsigned& randomSeed() {
+    static unsigned seed = random_device()();
+    return seed;
+}
+
+mt19937& randomEngine() {
+    static mt19937 gen(randomSeed());
+    return gen;
+}
+
+void seedRandom(unsigned seed) {
+    randomSeed() = seed;
+    randomEngine().seed(seed);
+}
+
 int randomInt(int min, int max) {
-    static random_device rd;
-    static mt19937 gen(rd());
     uniform_int_distribution<> dis(min, max);
-    return dis(gen);
+    return dis(randomEngine());
+}
+
+double randomDouble(double min, double max) {
+    uniform_real_distribution<> dis(min, max);
+    return dis(randomEngine());
 }
 
-double randomDouble(double min, double max) {
-    static random_device rd;
-    static mt19937 gen(rd());
-    uniform_real_distribution<> dis(min, max);
-    return dis(gen);
-}
+// Work-stealing pool for independent tasks. Each worker owns a deque: it
+// runs its own tasks in submission order and, when its deque is empty,
+// steals the newest task from another worker, so a largest-first
+// submission order is kept and thieves take the small tail. Tasks
+// submitted from a worker stay on that worker's deque; outside submissions
+// are spread round-robin.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t numThreads = max(1u, thread::hardware_concurrency())) {
+        for (size_t i = 0; i < numThreads; ++i) {
+            queues.push_back(make_unique<WorkQueue>());
+        }
+        for (size_t i = 0; i < numThreads; ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template <typename Task>
+    future<void> submit(Task&& task) {
+        auto packaged = make_shared<packaged_task<void()>>(forward<Task>(task));
+        future<void> result = packaged->get_future();
+        size_t target = currentPool == this ? currentWorker : nextQueue++ % queues.size();
+        // Count the task before it becomes visible so a worker that takes
+        // it can never decrement past zero
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            ++pending;
+        }
+        {
+            lock_guard<mutex> lock(queues[target]->lock);
+            queues[target]->tasks.push_back([packaged] { (*packaged)(); });
+        }
+        wake.notify_one();
+        return result;
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // True on this pool's workers, where blocking on the pool's own tasks
+    // could leave nobody to run them
+    bool onWorkerThread() const {
+        return currentPool == this;
+    }
+
+    // Wait for every task, then rethrow the first failure. Tasks capture the
+    // caller's locals by reference, so none may still be running when an
+    // exception unwinds that frame.
+    static void waitAll(vector<future<void>>& pending) {
+        exception_ptr failure;
+        for (auto& task : pending) {
+            try {
+                task.get();
+            } catch (...) {
+                if (!failure) {
+                    failure = current_exception();
+                }
+            }
+        }
+        pending.clear();
+        if (failure) {
+            rethrow_exception(failure);
+        }
+    }
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> nextQueue{0};
+    mutex sleepMutex;
+    condition_variable wake;
+    size_t pending = 0;
+    bool stopping = false;
+
+    inline static thread_local ThreadPool* currentPool = nullptr;
+    inline static thread_local size_t currentWorker = 0;
+
+    bool tryTake(size_t index, function<void()>& task) {
+        {
+            lock_guard<mutex> lock(queues[index]->lock);
+            if (!queues[index]->tasks.empty()) {
+                task = move(queues[index]->tasks.front());
+                queues[index]->tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t offset = 1; offset < queues.size(); ++offset) {
+            WorkQueue& victim = *queues[(index + offset) % queues.size()];
+            lock_guard<mutex> lock(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = move(victim.tasks.back());
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index) {
+        currentPool = this;
+        currentWorker = index;
+        while (true) {
+            function<void()> task;
+            if (tryTake(index, task)) {
+                {
+                    lock_guard<mutex> lock(sleepMutex);
+                    --pending;
+                }
+                task();
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) {
+                return;
+            }
+        }
+    }
+};
+
+// Flattened regression tree node; leaves have feature == -1.
+// Nodes of every tree live in one contiguous array so the same layout can be
+// written to disk and mapped straight back in.
+struct TreeNode {
+    int32_t feature;
+    float threshold; // go left when x[feature] <= threshold
+    int32_t left;
+    int32_t right;
+    float value;     // leaf prediction
+};
+
+// Per-feature metadata stored alongside the model
+struct FeatureMeta {
+    char name[16];
+    float minValue;
+    float maxValue;
+};
+
+// Read-only memory mapping of a file, unmapped on destruction
+class MappedFile {
+public:
+    ~MappedFile() {
+        if (data && data != MAP_FAILED) {
+            munmap(data, length);
+        }
+    }
+
+    static shared_ptr<MappedFile> open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        auto file = shared_ptr<MappedFile>(new MappedFile());
+        file->length = static_cast<size_t>(st.st_size);
+        file->data = mmap(nullptr, file->length, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (file->data == MAP_FAILED) {
+            return nullptr;
+        }
+        return file;
+    }
+
+    const char* bytes() const {
+        return static_cast<const char*>(data);
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+    MappedFile() = default;
+
+    void* data = nullptr;
+    size_t length = 0;
+};
+
+// On-disk model layout (little-endian, sections 64-byte aligned):
+//   ModelFileHeader | FeatureMeta[featureCount] | int32 roots[treeCount] | TreeNode[nodeCount]
+struct ModelFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t featureCount;
+    uint32_t treeCount;
+    uint32_t nodeCount;
+    uint64_t featuresOffset;
+    uint64_t rootsOffset;
+    uint64_t nodesOffset;
+    float calibrationScale;
+    float calibrationBias;
+    int32_t defaultPrediction;
+    uint32_t reserved;
+};
+
+const char kModelMagic[8] = {'D', 'F', 'M', 'O', 'D', 'E', 'L', '\0'};
+const uint32_t kModelVersion = 2; // 2: holiday and event features
+
+// Row-major feature matrix held in one allocation
+struct FeatureMatrix {
+    vector<double> values;
+    size_t width = 0;
+
+    explicit FeatureMatrix(size_t width = 0) : width(width) {}
+
+    size_t rows() const {
+        return width ? values.size() / width : 0;
+    }
+
+    const double* row(size_t i) const {
+        return values.data() + i * width;
+    }
+
+    double operator()(size_t i, size_t j) const {
+        return values[i * width + j];
+    }
+
+    // Appends a zeroed row and returns it for filling
+    double* addRow() {
+        values.resize(values.size() + width, 0.0);
+        return values.data() + values.size() - width;
+    }
+};
+
+// Random Forest Regression model: bagged CART trees stored as flat node arrays
+class RandomForestRegressor {
+public:
+    RandomForestRegressor(int numTrees = 20, int maxDepth = 6, int minSamplesLeaf = 5)
+        : numTrees(numTrees), maxDepth(maxDepth), minSamplesLeaf(minSamplesLeaf) {}
+
+    void fit(const FeatureMatrix& X, const vector<int>& y, ThreadPool* pool = nullptr) {
+        vector<size_t> rows(X.rows());
+        iota(rows.begin(), rows.end(), 0);
+        fit(X, y, rows, static_cast<unsigned>(randomInt(0, numeric_limits<int>::max())), pool);
+    }
+
+    // Train on a subset of rows of a shared feature matrix. Takes an explicit
+    // seed so several models can be trained concurrently. With a pool the
+    // trees are grown in parallel, unless this already runs on that pool.
+    void fit(const FeatureMatrix& X, const vector<int>& y, const vector<size_t>& rows, unsigned seed,
+             ThreadPool* pool = nullptr) {
+        mapped.reset();
+        ownedNodes.clear();
+        ownedRoots.clear();
+        calibrationScale = 1.0f;
+        calibrationBias = 0.0f;
+        if (rows.empty()) {
+            ownedFeatures.clear();
+            return;
+        }
+
+        size_t numFeatures = X.width;
+        ownedFeatures.assign(numFeatures, FeatureMeta{});
+        for (size_t j = 0; j < numFeatures; ++j) {
+            float lo = numeric_limits<float>::max();
+            float hi = numeric_limits<float>::lowest();
+            for (size_t row : rows) {
+                lo = min(lo, static_cast<float>(X(row, j)));
+                hi = max(hi, static_cast<float>(X(row, j)));
+            }
+            ownedFeatures[j].minValue = lo;
+            ownedFeatures[j].maxValue = hi;
+        }
+
+        // Rows are sorted by each feature once for the whole forest; a tree's
+        // per-feature orders follow from its bootstrap counts in linear time
+        vector<vector<uint32_t>> sortedRows(numFeatures, vector<uint32_t>(rows.size()));
+        for (size_t f = 0; f < numFeatures; ++f) {
+            auto& order = sortedRows[f];
+            iota(order.begin(), order.end(), 0);
+            stable_sort(order.begin(), order.end(),
+                [&X, &rows, f](uint32_t a, uint32_t b) { return X(rows[a], f) < X(rows[b], f); });
+        }
+
+        // Each tree draws its bootstrap from its own seed, so the forest is
+        // the same however the trees are scheduled
+        mt19937 gen(seed);
+        vector<unsigned> treeSeeds(numTrees);
+        for (auto& treeSeed : treeSeeds) {
+            treeSeed = gen();
+        }
+        vector<vector<TreeNode>> trees(numTrees);
+        auto growTree = [&](int t) {
+            mt19937 treeGen(treeSeeds[t]);
+            uniform_int_distribution<size_t> pick(0, rows.size() - 1);
+            vector<uint32_t> draws(rows.size(), 0);
+            for (size_t i = 0; i < rows.size(); ++i) {
+                ++draws[pick(treeGen)];
+            }
+            // Copies of a row sit next to each other in the sample
+            vector<uint32_t> firstCopy(rows.size());
+            vector<size_t> sample;
+            sample.reserve(rows.size());
+            for (size_t k = 0; k < rows.size(); ++k) {
+                firstCopy[k] = static_cast<uint32_t>(sample.size());
+                sample.insert(sample.end(), draws[k], rows[k]);
+            }
+            vector<vector<uint32_t>> order(numFeatures);
+            for (size_t f = 0; f < numFeatures; ++f) {
+                order[f].reserve(sample.size());
+                for (uint32_t k : sortedRows[f]) {
+                    for (uint32_t c = 0; c < draws[k]; ++c) {
+                        order[f].push_back(firstCopy[k] + c);
+                    }
+                }
+            }
+            trees[t] = buildTree(X, y, move(sample), move(order));
+        };
+        if (pool && !pool->onWorkerThread()) {
+            vector<future<void>> pending;
+            for (int t = 0; t < numTrees; ++t) {
+                pending.push_back(pool->submit([&growTree, t] { growTree(t); }));
+            }
+            ThreadPool::waitAll(pending);
+        } else {
+            for (int t = 0; t < numTrees; ++t) {
+                growTree(t);
+            }
+        }
+        for (const auto& tree : trees) {
+            int32_t offset = static_cast<int32_t>(ownedNodes.size());
+            ownedRoots.push_back(offset);
+            for (TreeNode node : tree) {
+                if (node.feature >= 0) {
+                    node.left += offset;
+                    node.right += offset;
+                }
+                ownedNodes.push_back(node);
+            }
+        }
+
+        // Linear calibration of the averaged tree output against the targets
+        double sx = 0, sy = 0, sxx = 0, sxy = 0;
+        for (size_t row : rows) {
+            double p = rawPredict(X.row(row));
+            sx += p;
+            sy += y[row];
+            sxx += p * p;
+            sxy += p * y[row];
+        }
+        double n = static_cast<double>(rows.size());
+        double denom = n * sxx - sx * sx;
+        if (abs(denom) > 1e-9) {
+            calibrationScale = static_cast<float>((n * sxy - sx * sy) / denom);
+            calibrationBias = static_cast<float>((sy - calibrationScale * sx) / n);
+        }
+    }
+
+    // Upper bound on the heap a fit over this many rows holds at once with
+    // trees grown one at a time: the per-feature row orders, one tree's
+    // bootstrap and scratch, and every tree at its depth limit, both as
+    // grown and as copied into the flat node array
+    size_t trainingBytes(size_t rows, size_t numFeatures) const {
+        size_t nodesPerTree = (size_t(2) << maxDepth) - 1;
+        size_t sortedOrders = numFeatures * rows * sizeof(uint32_t);
+        size_t perTree = rows * (sizeof(size_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t)) +
+                         numFeatures * rows * sizeof(uint32_t);
+        return sortedOrders + perTree + 2 * numTrees * nodesPerTree * sizeof(TreeNode);
+    }
+
+    int predict(const vector<double>& features) const {
+        if (treeCount() == 0) {
+            return defaultPrediction;
+        }
+        return calibrated(rawPredict(features.data()));
+    }
+
+    // Pointer-chasing traversal over row-major feature rows; writes the
+    // averaged tree output for each row
+    void predictRaw(const double* rows, size_t numRows, size_t stride, double* out) const {
+        for (size_t r = 0; r < numRows; ++r) {
+            out[r] = rawPredict(rows + r * stride);
+        }
+    }
+
+    // Turn an averaged tree output into the final demand prediction
+    int calibrated(double raw) const {
+        if (treeCount() == 0) {
+            return defaultPrediction;
+        }
+        return max(0, static_cast<int>(calibrationScale * raw + calibrationBias));
+    }
+
+    bool save(const string& path) const {
+        ModelFileHeader header = {};
+        memcpy(header.magic, kModelMagic, sizeof(kModelMagic));
+        header.version = kModelVersion;
+        header.featureCount = static_cast<uint32_t>(featureCount());
+        header.treeCount = static_cast<uint32_t>(treeCount());
+        header.nodeCount = static_cast<uint32_t>(nodeCount());
+        header.featuresOffset = alignSection(sizeof(ModelFileHeader));
+        header.rootsOffset = alignSection(header.featuresOffset + header.featureCount * sizeof(FeatureMeta));
+        header.nodesOffset = alignSection(header.rootsOffset + header.treeCount * sizeof(int32_t));
+        header.calibrationScale = calibrationScale;
+        header.calibrationBias = calibrationBias;
+        header.defaultPrediction = defaultPrediction;
+
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) {
+            cerr << "Can't write model file: " << path << endl;
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        writeSection(out, header.featuresOffset, features(), header.featureCount * sizeof(FeatureMeta));
+        writeSection(out, header.rootsOffset, roots(), header.treeCount * sizeof(int32_t));
+        writeSection(out, header.nodesOffset, nodes(), header.nodeCount * sizeof(TreeNode));
+        return static_cast<bool>(out);
+    }
+
+    // Map a saved model. The header and every root and child index are
+    // validated once; the node arrays are then used in place so every
+    // process shares the page-cached copy.
+    bool load(const string& path) {
+        auto file = MappedFile::open(path);
+        if (!file || file->size() < sizeof(ModelFileHeader)) {
+            cerr << "Can't open model file: " << path << endl;
+            return false;
+        }
+        const auto* header = reinterpret_cast<const ModelFileHeader*>(file->bytes());
+        if (memcmp(header->magic, kModelMagic, sizeof(kModelMagic)) != 0 || header->version != kModelVersion) {
+            cerr << "Unsupported model file: " << path << endl;
+            return false;
+        }
+        if (!sectionFits(header->featuresOffset, header->featureCount * sizeof(FeatureMeta), file->size()) ||
+            !sectionFits(header->rootsOffset, header->treeCount * sizeof(int32_t), file->size()) ||
+            !sectionFits(header->nodesOffset, uint64_t(header->nodeCount) * sizeof(TreeNode), file->size())) {
+            cerr << "Truncated model file: " << path << endl;
+            return false;
+        }
+        if (!validTrees(*header, file->bytes())) {
+            cerr << "Corrupt model file: " << path << endl;
+            return false;
+        }
+
+        mapped = file;
+        ownedNodes.clear();
+        ownedRoots.clear();
+        ownedFeatures.clear();
+        mappedHeader = header;
+        calibrationScale = header->calibrationScale;
+        calibrationBias = header->calibrationBias;
+        defaultPrediction = header->defaultPrediction;
+        return true;
+    }
+
+    const TreeNode* nodes() const {
+        return mapped ? reinterpret_cast<const TreeNode*>(mapped->bytes() + mappedHeader->nodesOffset)
+                      : ownedNodes.data();
+    }
+
+    const int32_t* roots() const {
+        return mapped ? reinterpret_cast<const int32_t*>(mapped->bytes() + mappedHeader->rootsOffset)
+                      : ownedRoots.data();
+    }
+
+    const FeatureMeta* features() const {
+        return mapped ? reinterpret_cast<const FeatureMeta*>(mapped->bytes() + mappedHeader->featuresOffset)
+                      : ownedFeatures.data();
+    }
+
+    size_t nodeCount() const {
+        return mapped ? mappedHeader->nodeCount : ownedNodes.size();
+    }
+
+    size_t treeCount() const {
+        return mapped ? mappedHeader->treeCount : ownedRoots.size();
+    }
+
+    size_t featureCount() const {
+        return mapped ? mappedHeader->featureCount : ownedFeatures.size();
+    }
+
+    void setFeatureName(size_t index, const string& name) {
+        if (index < ownedFeatures.size()) {
+            strncpy(ownedFeatures[index].name, name.c_str(), sizeof(ownedFeatures[index].name) - 1);
+        }
+    }
+
+private:
+    int numTrees;
+    int maxDepth;
+    int minSamplesLeaf;
+    float calibrationScale = 1.0f;
+    float calibrationBias = 0.0f;
+    int32_t defaultPrediction = 10; // Returned before the model is trained
+
+    vector<TreeNode> ownedNodes;
+    vector<int32_t> ownedRoots;
+    vector<FeatureMeta> ownedFeatures;
+    shared_ptr<MappedFile> mapped;
+    const ModelFileHeader* mappedHeader = nullptr;
+
+    double rawPredict(const double* features) const {
+        const TreeNode* base = nodes();
+        const int32_t* treeRoots = roots();
+        size_t trees = treeCount();
+        double sum = 0;
+        for (size_t t = 0; t < trees; ++t) {
+            const TreeNode* node = base + treeRoots[t];
+            while (node->feature >= 0) {
+                node = base + (features[node->feature] <= node->threshold ? node->left : node->right);
+            }
+            sum += node->value;
+        }
+        return sum / trees;
+    }
+
+    // Scratch state for growing one tree. Every feature's sample positions
+    // arrive sorted; a node owns the same range of each order, and a split
+    // stably partitions those ranges, so no node has to sort.
+    struct TreeBuilder {
+        const FeatureMatrix& X;
+        const vector<int>& y;
+        vector<size_t> sample;          // bootstrap rows of X
+        vector<vector<uint32_t>> order; // per feature, positions in sample by value
+        vector<uint8_t> goesLeft;       // per position, for the split being applied
+        vector<uint32_t> scratch;
+        vector<TreeNode> nodes;         // indices local to the tree
+    };
+
+    vector<TreeNode> buildTree(const FeatureMatrix& X, const vector<int>& y, vector<size_t> sample,
+                               vector<vector<uint32_t>> order) const {
+        size_t n = sample.size();
+        TreeBuilder builder{X, y, move(sample), move(order), {}, {}, {}};
+        builder.goesLeft.assign(n, 0);
+        builder.scratch.resize(n);
+        buildNode(builder, 0, n, 0);
+        return move(builder.nodes);
+    }
+
+    // Grow one CART node over positions [begin, end) of the orders and
+    // return its index
+    int32_t buildNode(TreeBuilder& b, size_t begin, size_t end, int depth) const {
+        int32_t index = static_cast<int32_t>(b.nodes.size());
+        b.nodes.push_back({-1, 0.0f, -1, -1, 0.0f});
+
+        size_t count = end - begin;
+        double total = 0;
+        for (size_t i = begin; i < end; ++i) {
+            total += b.y[b.sample[b.order[0][i]]];
+        }
+        b.nodes[index].value = static_cast<float>(total / count);
+        if (depth >= maxDepth || count < static_cast<size_t>(2 * minSamplesLeaf)) {
+            return index;
+        }
+
+        // Pick the split that maximizes variance reduction
+        double bestScore = total * total / count + 1e-9;
+        int bestFeature = -1;
+        double bestThreshold = 0;
+        for (size_t f = 0; f < b.X.width; ++f) {
+            const auto& order = b.order[f];
+            double leftSum = 0;
+            for (size_t i = begin; i + 1 < end; ++i) {
+                size_t row = b.sample[order[i]];
+                leftSum += b.y[row];
+                size_t leftCount = i + 1 - begin;
+                size_t rightCount = count - leftCount;
+                double here = b.X(row, f);
+                double next = b.X(b.sample[order[i + 1]], f);
+                if (here == next || leftCount < static_cast<size_t>(minSamplesLeaf) ||
+                    rightCount < static_cast<size_t>(minSamplesLeaf)) {
+                    continue;
+                }
+                double rightSum = total - leftSum;
+                double score = leftSum * leftSum / leftCount + rightSum * rightSum / rightCount;
+                if (score > bestScore) {
+                    bestScore = score;
+                    bestFeature = static_cast<int>(f);
+                    bestThreshold = (here + next) / 2;
+                }
+            }
+        }
+        if (bestFeature < 0) {
+            return index;
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            uint32_t position = b.order[bestFeature][i];
+            b.goesLeft[position] = b.X(b.sample[position], bestFeature) <= bestThreshold;
+        }
+        size_t split = begin;
+        for (auto& order : b.order) {
+            size_t left = begin, right = 0;
+            for (size_t i = begin; i < end; ++i) {
+                uint32_t position = order[i];
+                if (b.goesLeft[position]) {
+                    order[left++] = position;
+                } else {
+                    b.scratch[right++] = position;
+                }
+            }
+            copy(b.scratch.begin(), b.scratch.begin() + right, order.begin() + left);
+            split = left;
+        }
+        int32_t left = buildNode(b, begin, split, depth + 1);
+        int32_t right = buildNode(b, split, end, depth + 1);
+        b.nodes[index].feature = bestFeature;
+        b.nodes[index].threshold = static_cast<float>(bestThreshold);
+        b.nodes[index].left = left;
+        b.nodes[index].right = right;
+        return index;
+    }
+
+    static bool sectionFits(uint64_t offset, uint64_t bytes, uint64_t fileSize) {
+        return offset % 64 == 0 && offset <= fileSize && bytes <= fileSize - offset;
+    }
+
+    // Every root and child must index a node and every split a feature.
+    // Children are written after their parent, so requiring that also
+    // rules out cycles.
+    static bool validTrees(const ModelFileHeader& header, const char* bytes) {
+        const auto* treeRoots = reinterpret_cast<const int32_t*>(bytes + header.rootsOffset);
+        const auto* treeNodes = reinterpret_cast<const TreeNode*>(bytes + header.nodesOffset);
+        int64_t count = header.nodeCount;
+        for (uint32_t t = 0; t < header.treeCount; ++t) {
+            if (treeRoots[t] < 0 || treeRoots[t] >= count) {
+                return false;
+            }
+        }
+        for (int64_t i = 0; i < count; ++i) {
+            const TreeNode& node = treeNodes[i];
+            if (node.feature < 0) {
+                continue;
+            }
+            if (static_cast<uint32_t>(node.feature) >= header.featureCount ||
+                node.left <= i || node.left >= count || node.right <= i || node.right >= count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static uint64_t alignSection(uint64_t offset) {
+        return (offset + 63) & ~uint64_t(63);
+    }
+
+    static void writeSection(ofstream& out, uint64_t offset, const void* data, size_t bytes) {
+        static const char padding[64] = {};
+        uint64_t pos = static_cast<uint64_t>(out.tellp());
+        out.write(padding, static_cast<streamsize>(offset - pos));
+        out.write(static_cast<const char*>(data), static_cast<streamsize>(bytes));
+    }
+};
+
+enum class ForecastModelType {
+    RandomForest, PoissonGlm
+};
+
+// Per-SKU Poisson regression on the forecaster's features with a log link.
+// Each SKU's model is one row of kWidth coefficients (intercept first), so
+// prediction is a single dot product and an exp. Training runs IRLS for
+// every SKU independently, in SKU-range chunks on a thread pool.
+class PoissonDemandModel {
+public:
+    static constexpr size_t kFeatures = 7; // DemandForecastingAgent's feature row
+    static constexpr size_t kWidth = kFeatures + 1;
+
+    // X is row-major with kFeatures columns; rows of SKU s are
+    // [skuRowBegin[s], skuRowBegin[s + 1])
+    void fit(const vector<double>& X, const vector<double>& y, const vector<size_t>& skuRowBegin,
+             ThreadPool* pool = nullptr, int iterations = 8, double ridge = 1e-2) {
+        size_t numSkus = skuRowBegin.empty() ? 0 : skuRowBegin.size() - 1;
+        coefficients.assign(numSkus * kWidth, 0.0);
+        trained.assign(numSkus, 0);
+
+        auto fitRange = [&, iterations, ridge](size_t begin, size_t end) {
+            for (size_t sku = begin; sku < end; ++sku) {
+                trained[sku] = fitSku(X, y, skuRowBegin[sku], skuRowBegin[sku + 1], iterations, ridge,
+                                      coefficients.data() + sku * kWidth) ? 1 : 0;
+            }
+        };
+
+        if (!pool || numSkus < 1024) {
+            fitRange(0, numSkus);
+            return;
+        }
+        size_t chunk = max<size_t>(1024, numSkus / (pool->size() * 4));
+        vector<future<void>> pending;
+        for (size_t begin = 0; begin < numSkus; begin += chunk) {
+            size_t end = min(numSkus, begin + chunk);
+            pending.push_back(pool->submit([&fitRange, begin, end] { fitRange(begin, end); }));
+        }
+        ThreadPool::waitAll(pending);
+    }
+
+    bool hasModel(int sku) const {
+        return sku >= 0 && static_cast<size_t>(sku) < trained.size() && trained[sku];
+    }
+
+    double predict(int sku, const double* features) const {
+        const double* beta = coefficients.data() + sku * kWidth;
+        double eta = beta[0];
+        for (size_t j = 0; j < kFeatures; ++j) {
+            eta += beta[j + 1] * features[j];
+        }
+        return exp(min(eta, kMaxEta));
+    }
+
+    const double* skuCoefficients(int sku) const {
+        return coefficients.data() + sku * kWidth;
+    }
+
+    size_t skuCount() const {
+        return trained.size();
+    }
+
+private:
+    static constexpr double kMaxEta = 20.0;
+
+    vector<double> coefficients; // skuCount x kWidth
+    vector<uint8_t> trained;
+
+    // Newton/IRLS steps solving (X'WX + ridge) beta = X'W z for one SKU
+    static bool fitSku(const vector<double>& X, const vector<double>& y, size_t begin, size_t end,
+                       int iterations, double ridge, double* beta) {
+        if (begin == end) {
+            return false;
+        }
+        double meanY = 0;
+        for (size_t r = begin; r < end; ++r) {
+            meanY += y[r];
+        }
+        meanY /= (end - begin);
+        fill(beta, beta + kWidth, 0.0);
+        beta[0] = log(meanY + 1e-3);
+
+        for (int iter = 0; iter < iterations; ++iter) {
+            double hessian[kWidth][kWidth] = {};
+            double gradient[kWidth] = {};
+            for (size_t r = begin; r < end; ++r) {
+                double x[kWidth] = {1.0};
+                copy(X.begin() + r * kFeatures, X.begin() + (r + 1) * kFeatures, x + 1);
+                double eta = 0;
+                for (size_t j = 0; j < kWidth; ++j) {
+                    eta += beta[j] * x[j];
+                }
+                double mu = exp(min(eta, kMaxEta));
+                double residual = y[r] - mu;
+                for (size_t j = 0; j < kWidth; ++j) {
+                    gradient[j] += residual * x[j];
+                    for (size_t k = 0; k <= j; ++k) {
+                        hessian[j][k] += mu * x[j] * x[k];
+                    }
+                }
+            }
+            for (size_t j = 1; j < kWidth; ++j) {
+                hessian[j][j] += ridge;
+                gradient[j] -= ridge * beta[j];
+            }
+            hessian[0][0] += 1e-9;
+
+            double step[kWidth];
+            if (!solveCholesky(hessian, gradient, step)) {
+                return false;
+            }
+            double change = 0;
+            for (size_t j = 0; j < kWidth; ++j) {
+                beta[j] += step[j];
+                change = max(change, abs(step[j]));
+            }
+            if (change < 1e-6) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    // Solve A x = b for symmetric positive definite A given by its lower triangle
+    static bool solveCholesky(double a[kWidth][kWidth], const double* b, double* x) {
+        double l[kWidth][kWidth] = {};
+        for (size_t j = 0; j < kWidth; ++j) {
+            double diag = a[j][j];
+            for (size_t k = 0; k < j; ++k) {
+                diag -= l[j][k] * l[j][k];
+            }
+            if (diag <= 0) {
+                return false;
+            }
+            l[j][j] = sqrt(diag);
+            for (size_t i = j + 1; i < kWidth; ++i) {
+                double sum = a[i][j];
+                for (size_t k = 0; k < j; ++k) {
+                    sum -= l[i][k] * l[j][k];
+                }
+                l[i][j] = sum / l[j][j];
+            }
+        }
+        double z[kWidth];
+        for (size_t i = 0; i < kWidth; ++i) {
+            double sum = b[i];
+            for (size_t k = 0; k < i; ++k) {
+                sum -= l[i][k] * z[k];
+            }
+            z[i] = sum / l[i][i];
+        }
+        for (size_t i = kWidth; i-- > 0;) {
+            double sum = z[i];
+            for (size_t k = i + 1; k < kWidth; ++k) {
+                sum -= l[k][i] * x[k];
+            }
+            x[i] = sum / l[i][i];
+        }
+        return true;
+    }
+};
+
+// Daily sales history in column form: one row per (day, SKU), with the
+// model features of every row in one row-major matrix
+struct SalesHistory {
+    vector<int> days;       // day index into the history
+    vector<int> skus;       // inventory slot
+    vector<int> quantities;
+    FeatureMatrix features;
+
+    size_t size() const {
+        return days.size();
+    }
+
+    void reserve(size_t numRows) {
+        days.reserve(numRows);
+        skus.reserve(numRows);
+        quantities.reserve(numRows);
+        features.values.reserve(numRows * features.width);
+    }
+
+    // Appends a row and returns its feature slots for filling
+    double* addRow(int day, int sku, int quantity) {
+        days.push_back(day);
+        skus.push_back(sku);
+        quantities.push_back(quantity);
+        return features.addRow();
+    }
+};
+
+class DemandForecastingAgent {
+public:
+    DemandForecastingAgent() = default;
+
+    void trainModel(const SalesHistory& history) {
+        if (modelType == ForecastModelType::PoissonGlm) {
+            trainSkuModels(history);
+            return;
+        }
+        model.fit(history.features, history.quantities, pool);
+        finishTraining();
+    }
+
+    // Fit one Poisson model per SKU on rows regrouped by SKU slot
+    void trainSkuModels(const SalesHistory& history) {
+        size_t numSkus = 0;
+        for (int sku : history.skus) {
+            numSkus = max(numSkus, static_cast<size_t>(sku) + 1);
+        }
+        vector<size_t> skuRowBegin(numSkus + 1, 0);
+        for (int sku : history.skus) {
+            ++skuRowBegin[static_cast<size_t>(sku) + 1];
+        }
+        partial_sum(skuRowBegin.begin(), skuRowBegin.end(), skuRowBegin.begin());
+
+        size_t width = kFeatureNames.size();
+        vector<double> X(history.size() * width);
+        vector<double> y(history.size());
+        vector<size_t> next(skuRowBegin.begin(), skuRowBegin.end() - 1);
+        for (size_t i = 0; i < history.size(); ++i) {
+            size_t row = next[static_cast<size_t>(history.skus[i])]++;
+            copy(history.features.row(i), history.features.row(i) + width, X.begin() + row * width);
+            y[row] = history.quantities[i];
+        }
+        skuModels.fit(X, y, skuRowBegin, pool);
+    }
+
+    // Train on selected rows of a shared feature matrix
+    void trainModel(const FeatureMatrix& X, const vector<int>& y, const vector<size_t>& rows, unsigned seed) {
+        model.fit(X, y, rows, seed);
+        finishTraining();
+    }
+
+    static size_t featureCount() {
+        return kFeatureNames.size();
+    }
+
+    // Heap held while training the forest on this many rows
+    size_t trainingBytes(size_t rows) const {
+        return model.trainingBytes(rows, kFeatureNames.size());
+    }
+
+    // One feature row in kFeatureNames order
+    static void fillFeatures(const CalendarRow& day, double price, double promotion, double* row) {
+        row[0] = day.dayOfWeek;
+        row[1] = day.month;
+        row[2] = day.isWeekend ? 1.0 : 0.0;
+        row[3] = price;
+        row[4] = promotion;
+        row[5] = day.isHoliday ? 1.0 : 0.0;
+        row[6] = day.eventName.empty() ? 0.0 : 1.0;
+    }
+
+    // One forecast on the stack with no per-call vectors. Under the Poisson
+    // forecaster, sku selects the per-SKU model, as in predictDemandForSkus.
+    int predictDemand(const map<string, double>& productInfo, const string& futureDate, int sku = -1) const {
+        double row[kFeatureNames.size()];
+        fillFeatures(calendarRow(futureDate), productInfo.at("price"), productInfo.at("promotion"), row);
+        if (modelType == ForecastModelType::PoissonGlm) {
+            return predictSku(sku, row);
+        }
+        double raw = 0;
+        if (model.treeCount() > 0) {
+            model.predictRaw(row, 1, kFeatureNames.size(), &raw);
+        }
+        return model.calibrated(raw);
+    }
+
+    // Forecast every SKU for one date: the calendar row is looked up once and
+    // broadcast across all SKUs' price and promotion columns
+    vector<int> predictDemandForDate(const vector<double>& prices, const vector<double>& promotions,
+                                     const string& futureDate) const {
+        const CalendarRow& day = calendarRow(futureDate);
+        size_t numRows = prices.size();
+        vector<double> rows(numRows * kFeatureNames.size());
+        for (size_t i = 0; i < numRows; ++i) {
+            fillFeatures(day, prices[i], promotions[i], rows.data() + i * kFeatureNames.size());
+        }
+        return predictBatch(rows, numRows);
+    }
+
+    // Like predictDemandForDate, but SKUs with a per-SKU model use it when
+    // the Poisson forecaster is selected
+    vector<int> predictDemandForSkus(const vector<int>& skus, const vector<double>& prices,
+                                     const vector<double>& promotions, const string& futureDate) const {
+        if (modelType != ForecastModelType::PoissonGlm) {
+            return predictDemandForDate(prices, promotions, futureDate);
+        }
+        const CalendarRow& day = calendarRow(futureDate);
+        vector<int> predictions(skus.size());
+        for (size_t i = 0; i < skus.size(); ++i) {
+            double features[kFeatureNames.size()];
+            fillFeatures(day, prices[i], promotions[i], features);
+            predictions[i] = predictSku(skus[i], features);
+        }
+        return predictions;
+    }
+
+    void setCalendar(const CalendarFeatureTable* table) {
+        calendar = table;
+    }
+
+    void setModelType(ForecastModelType type) {
+        modelType = type;
+    }
+
+    // Pool used to grow forest trees and train per-SKU models in parallel
+    void setThreadPool(ThreadPool* workers) {
+        pool = workers;
+    }
+
+    // Predict demand for row-major feature rows laid out as in kFeatureNames
+    vector<int> predictBatch(const vector<double>& rows, size_t numRows) const {
+        vector<double> raw(numRows);
+        model.predictRaw(rows.data(), numRows, kFeatureNames.size(), raw.data());
+        vector<int> predictions(numRows);
+        for (size_t i = 0; i < numRows; ++i) {
+            predictions[i] = model.calibrated(raw[i]);
+        }
+        return predictions;
+    }
+
+    bool saveModel(const string& path) const {
+        return model.save(path);
+    }
+
+    // Load a model saved by saveModel instead of retraining
+    bool loadModel(const string& path) {
+        RandomForestRegressor loaded;
+        if (!loaded.load(path)) {
+            return false;
+        }
+        if (loaded.featureCount() != kFeatureNames.size()) {
+            cerr << "Model feature count mismatch: " << path << endl;
+            return false;
+        }
+        model = loaded;
+        return true;
+    }
+
+private:
+    static constexpr array<const char*, 7> kFeatureNames = {
+        "day_of_week", "month", "is_weekend", "price", "promotion", "is_holiday", "is_event"
+    };
+    static_assert(kFeatureNames.size() == PoissonDemandModel::kFeatures, "Poisson model width must match");
+
+    const CalendarRow& calendarRow(const string& date) const {
+        static const CalendarFeatureTable unbuilt; // computes and keeps rows on demand
+        return (calendar ? *calendar : unbuilt).lookup(date);
+    }
+
+    // Poisson mean for one SKU rounded to whole units; SKUs without a model
+    // get the untrained default
+    int predictSku(int sku, const double* features) const {
+        if (!skuModels.hasModel(sku)) {
+            return model.calibrated(0);
+        }
+        return static_cast<int>(lround(skuModels.predict(sku, features)));
+    }
+
+    void finishTraining() {
+        for (size_t i = 0; i < kFeatureNames.size(); ++i) {
+            model.setFeatureName(i, kFeatureNames[i]);
+        }
+    }
+
+    RandomForestRegressor model;
+    PoissonDemandModel skuModels;
+    ForecastModelType modelType = ForecastModelType::RandomForest;
+    const CalendarFeatureTable* calendar = nullptr;
+    ThreadPool* pool = nullptr;
+};
+
+// Backtest settings: folds start at initialTrainDays and advance by
+// stepDays; each fold trains on all earlier days and scores horizonDays
+struct BacktestConfig {
+    int initialTrainDays = 56;
+    int horizonDays = 7;
+    int stepDays = 7;
+    int skuPartitions = 4;
+};
+
+// Forecast error totals for one SKU across all folds
+struct SkuAccuracy {
+    double absError = 0;
+    double error = 0;    // forecast - actual
+    double actual = 0;
+    double apeSum = 0;   // absolute percentage errors, nonzero actuals only
+    int apeCount = 0;
+    int count = 0;
+
+    void add(double forecast, double actualValue) {
+        double e = forecast - actualValue;
+        error += e;
+        absError += abs(e);
+        actual += actualValue;
+        if (actualValue != 0) {
+            apeSum += abs(e) / actualValue;
+            ++apeCount;
+        }
+        ++count;
+    }
+
+    void merge(const SkuAccuracy& other) {
+        absError += other.absError;
+        error += other.error;
+        actual += other.actual;
+        apeSum += other.apeSum;
+        apeCount += other.apeCount;
+        count += other.count;
+    }
+
+    double mape() const { return apeCount ? apeSum / apeCount : 0; }
+    double wape() const { return actual ? absError / actual : 0; }
+    double bias() const { return actual ? error / actual : 0; } // > 0 means over-forecasting
+};
+
+// Rolling-origin backtest of DemandForecastingAgent. Every fold reads the
+// columnar sales history in place; folds train concurrently, then (fold,
+// SKU partition) pairs are scored concurrently on the same pool. The
+// history must outlive the engine.
+class BacktestEngine {
+public:
+    BacktestEngine(const SalesHistory& history, ThreadPool& pool) : pool(pool), history(history) {
+        for (size_t row = 0; row < history.size(); ++row) {
+            int day = history.days[row];
+            if (day >= static_cast<int>(dayRows.size())) {
+                dayRows.resize(day + 1);
+            }
+            dayRows[day].push_back(row);
+            numSkus = max(numSkus, history.skus[row] + 1);
+        }
+    }
+
+    // Every length must be positive: a zero step never advances the folds
+    // and zero partitions would divide by zero
+    static bool validConfig(const BacktestConfig& config) {
+        return config.initialTrainDays > 0 && config.horizonDays > 0 && config.stepDays > 0 &&
+               config.skuPartitions > 0;
+    }
+
+    // Per-SKU totals over all folds; empty for an invalid config
+    vector<SkuAccuracy> run(const BacktestConfig& config) const {
+        if (!validConfig(config)) {
+            cerr << "Backtest days, step and SKU partitions must all be positive" << endl;
+            return {};
+        }
+        vector<int> origins;
+        for (int origin = config.initialTrainDays; origin < static_cast<int>(dayRows.size()); origin += config.stepDays) {
+            origins.push_back(origin);
+        }
+
+        vector<DemandForecastingAgent> models(origins.size());
+        vector<future<void>> pending;
+        for (size_t f = 0; f < origins.size(); ++f) {
+            pending.push_back(pool.submit([this, &models, &origins, f] {
+                vector<size_t> trainRows;
+                for (int day = 0; day < origins[f]; ++day) {
+                    trainRows.insert(trainRows.end(), dayRows[day].begin(), dayRows[day].end());
+                }
+                models[f].trainModel(history.features, history.quantities, trainRows, static_cast<unsigned>(f + 1));
+            }));
+        }
+        ThreadPool::waitAll(pending);
+
+        // Partitions own disjoint SKUs, so each fold's row can be shared
+        vector<vector<SkuAccuracy>> foldAccuracy(origins.size(), vector<SkuAccuracy>(numSkus));
+        for (size_t f = 0; f < origins.size(); ++f) {
+            for (int part = 0; part < config.skuPartitions; ++part) {
+                pending.push_back(pool.submit([this, &models, &origins, &foldAccuracy, &config, f, part] {
+                    scorePartition(models[f], origins[f], config, part, foldAccuracy[f]);
+                }));
+            }
+        }
+        ThreadPool::waitAll(pending);
+
+        vector<SkuAccuracy> totals(numSkus);
+        for (const auto& fold : foldAccuracy) {
+            for (int sku = 0; sku < numSkus; ++sku) {
+                totals[sku].merge(fold[sku]);
+            }
+        }
+        return totals;
+    }
+
+private:
+    ThreadPool& pool;
+    const SalesHistory& history;
+    vector<vector<size_t>> dayRows;
+    int numSkus = 0;
+
+    void scorePartition(const DemandForecastingAgent& model, int origin, const BacktestConfig& config,
+                        int part, vector<SkuAccuracy>& accuracy) const {
+        vector<size_t> testRows;
+        int end = min(origin + config.horizonDays, static_cast<int>(dayRows.size()));
+        for (int day = origin; day < end; ++day) {
+            for (size_t row : dayRows[day]) {
+                if (history.skus[row] % config.skuPartitions == part) {
+                    testRows.push_back(row);
+                }
+            }
+        }
+        if (testRows.empty()) {
+            return;
+        }
+
+        size_t width = DemandForecastingAgent::featureCount();
+        vector<double> features(testRows.size() * width);
+        for (size_t i = 0; i < testRows.size(); ++i) {
+            const double* row = history.features.row(testRows[i]);
+            copy(row, row + width, features.begin() + i * width);
+        }
+        vector<int> forecasts = model.predictBatch(features, testRows.size());
+        for (size_t i = 0; i < testRows.size(); ++i) {
+            accuracy[history.skus[testRows[i]]].add(forecasts[i], history.quantities[testRows[i]]);
+        }
+    }
+};
+
+// Caps the bytes held by concurrently running jobs
+class MemoryBudget {
+public:
+    explicit MemoryBudget(size_t budgetBytes) : budget(budgetBytes) {}
+
+    // Blocks until the job fits; a job larger than the whole budget is
+    // admitted once nothing else is running. Only call it from the thread
+    // that dispatches the jobs: a pool worker waiting here could be the
+    // one that has to run the job whose release it waits for.
+    void acquire(size_t bytes) {
+        unique_lock<mutex> lock(budgetMutex);
+        released.wait(lock, [&] { return inUse == 0 || inUse + bytes <= budget; });
+        inUse += bytes;
+    }
+
+    void release(size_t bytes) {
+        {
+            lock_guard<mutex> lock(budgetMutex);
+            inUse -= bytes;
+        }
+        released.notify_all();
+    }
+
+    // Hands acquired bytes back when the job leaves scope, even by throwing
+    class Reservation {
+    public:
+        Reservation(MemoryBudget& budget, size_t bytes) : budget(budget), bytes(bytes) {}
+        ~Reservation() { budget.release(bytes); }
+        Reservation(const Reservation&) = delete;
+        Reservation& operator=(const Reservation&) = delete;
+
+    private:
+        MemoryBudget& budget;
+        size_t bytes;
+    };
+
+private:
+    size_t budget;
+    size_t inUse = 0;
+    mutex budgetMutex;
+    condition_variable released;
+};
+
+// One independent forecaster to train on a subset of a shared history
+struct TrainingJob {
+    string key; // e.g. "store/category"
+    vector<size_t> rows;
+};
+
+// Trains many independent forecasters on the shared pool. Jobs are
+// dispatched largest first to shorten the makespan, and each is admitted
+// only when its estimated training footprint fits the memory budget; the
+// dispatcher waits for memory so workers never block. run() must therefore
+// not be called from a worker of the same pool.
+class TrainingScheduler {
+public:
+    TrainingScheduler(ThreadPool& pool, size_t budgetBytes) : pool(pool), budget(budgetBytes) {}
+
+    map<string, unique_ptr<DemandForecastingAgent>> run(const FeatureMatrix& X, const vector<int>& y,
+                                                        const vector<TrainingJob>& jobs,
+                                                        const CalendarFeatureTable* calendar) {
+        vector<size_t> order(jobs.size());
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(),
+            [&jobs](size_t a, size_t b) { return jobs[a].rows.size() > jobs[b].rows.size(); });
+
+        if (pool.onWorkerThread()) {
+            throw logic_error("TrainingScheduler::run would wait for memory on a worker of its own pool");
+        }
+
+        vector<unique_ptr<DemandForecastingAgent>> models(jobs.size());
+        vector<future<void>> pending;
+        for (size_t index : order) {
+            models[index] = make_unique<DemandForecastingAgent>();
+            models[index]->setCalendar(calendar);
+            size_t bytes = models[index]->trainingBytes(jobs[index].rows.size());
+            budget.acquire(bytes);
+            pending.push_back(pool.submit([this, &X, &y, &jobs, &models, index, bytes] {
+                MemoryBudget::Reservation reservation(budget, bytes);
+                models[index]->trainModel(X, y, jobs[index].rows, static_cast<unsigned>(index + 1));
+            }));
+        }
+        ThreadPool::waitAll(pending);
+
+        map<string, unique_ptr<DemandForecastingAgent>> trained;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            trained[jobs[i].key] = move(models[i]);
+        }
+        return trained;
+    }
+
+private:
+    ThreadPool& pool;
+    MemoryBudget budget;
+};
+
+// A single stock mutation from a register event stream
+struct StockEvent {
+    int slot;
+    int delta;
+};
+
+// Live stock ledger: every SKU gets a dense slot backed by its own
+// cache-line-padded atomic counter, so registers can post mutations
+// concurrently without contending on neighbouring SKUs.
+// SKU registration must happen before concurrent ingestion starts.
+class InventoryLedger {
+public:
+    int registerSku(const string& productId) {
+        if ((skuIds.size() + 1) * 2 > slotIndex.size()) {
+            rehash(max<size_t>(16, slotIndex.size() * 2));
+        }
+        size_t bucket = findBucket(productId);
+        if (slotIndex[bucket] >= 0) {
+            return slotIndex[bucket];
+        }
+        int slot = static_cast<int>(skuIds.size());
+        skuIds.push_back(productId);
+        counters.emplace_back();
+        slotIndex[bucket] = slot;
+        return slot;
+    }
+
+    int slotOf(const string& productId) const {
+        if (slotIndex.empty()) {
+            return -1;
+        }
+        return slotIndex[findBucket(productId)];
+    }
+
+    const string& skuId(int slot) const {
+        return skuIds[slot];
+    }
+
+    void reserve(size_t numSkus) {
+        skuIds.reserve(numSkus);
+        size_t buckets = 16;
+        while (buckets < numSkus * 2) {
+            buckets *= 2;
+        }
+        if (buckets > slotIndex.size()) {
+            rehash(buckets);
+        }
+    }
+
+    size_t size() const {
+        return skuIds.size();
+    }
+
+    void apply(int slot, int delta) {
+        counters[slot].value.fetch_add(delta, memory_order_relaxed);
+    }
+
+    // Apply a register's event stream. Consecutive events for the same slot
+    // are coalesced so a burst of scans of one SKU costs one atomic add.
+    void applyBatch(const StockEvent* events, size_t count) {
+        size_t i = 0;
+        while (i < count) {
+            int slot = events[i].slot;
+            int delta = 0;
+            for (; i < count && events[i].slot == slot; ++i) {
+                delta += events[i].delta;
+            }
+            if (delta != 0) {
+                apply(slot, delta);
+            }
+        }
+    }
+
+    void applyBatch(const vector<StockEvent>& events) {
+        applyBatch(events.data(), events.size());
+    }
+
+    int get(int slot) const {
+        return counters[slot].value.load(memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) PaddedCounter {
+        atomic<int> value{0};
+    };
+
+    // Open-addressed slot numbers keyed by skuIds[slot], -1 when empty.
+    // Kept at most half full; a million SKUs register without a node
+    // allocation per id.
+    vector<int> slotIndex;
+    vector<string> skuIds;
+    deque<PaddedCounter> counters; // deque keeps counters in place as SKUs are added
+
+    // Bucket holding productId, or the empty bucket where it would go
+    size_t findBucket(const string& productId) const {
+        size_t mask = slotIndex.size() - 1;
+        size_t bucket = hash<string>()(productId) & mask;
+        while (slotIndex[bucket] >= 0 && skuIds[slotIndex[bucket]] != productId) {
+            bucket = (bucket + 1) & mask;
+        }
+        return bucket;
+    }
+
+    void rehash(size_t buckets) {
+        slotIndex.assign(buckets, -1);
+        for (size_t slot = 0; slot < skuIds.size(); ++slot) {
+            size_t bucket = hash<string>()(skuIds[slot]) & (buckets - 1);
+            while (slotIndex[bucket] >= 0) {
+                bucket = (bucket + 1) & (buckets - 1);
+            }
+            slotIndex[bucket] = static_cast<int>(slot);
+        }
+    }
+};
+
+// A receipt of stock still on hand
+struct StockLot {
+    int32_t receiptDay;
+    int32_t quantity;
+};
+
+// Lot-level stock per SKU: each SKU owns a fixed ring of kLotsPerSku lots,
+// one 64-byte aligned cache line per SKU, consumed oldest first. When the
+// ring is full the two oldest lots are folded together under the older
+// receipt day, so a new receipt always keeps its own day and expiry of the
+// merged units stays conservative.
+class LotStore {
+public:
+    static constexpr int kLotsPerSku = 8;
+
+    void reserve(size_t numSkus) {
+        lots.reserve(numSkus);
+        head.reserve(numSkus);
+        count.reserve(numSkus);
+        shelfLife.reserve(numSkus);
+    }
+
+    void resize(size_t numSkus) {
+        lots.resize(numSkus);
+        head.resize(numSkus, 0);
+        count.resize(numSkus, 0);
+        shelfLife.resize(numSkus, 0);
+    }
+
+    // 0 marks a non-perishable SKU
+    void setShelfLife(int slot, int days) {
+        shelfLife[slot] = days;
+    }
+
+    void receive(int slot, int day, int quantity) {
+        if (quantity <= 0) {
+            return;
+        }
+        StockLot* ring = lots[slot].lots;
+        if (count[slot] > 0) {
+            StockLot& newest = ring[(head[slot] + count[slot] - 1) % kLotsPerSku];
+            if (newest.receiptDay == day) {
+                newest.quantity += quantity;
+                return;
+            }
+        }
+        if (count[slot] == kLotsPerSku) {
+            const StockLot& oldest = ring[head[slot]];
+            StockLot& next = ring[(head[slot] + 1) % kLotsPerSku];
+            next = {oldest.receiptDay, oldest.quantity + next.quantity};
+            popOldest(slot);
+        }
+        ring[(head[slot] + count[slot]) % kLotsPerSku] = {day, quantity};
+        ++count[slot];
+    }
+
+    // Remove up to quantity units oldest first; returns the units removed
+    int consume(int slot, int quantity) {
+        StockLot* ring = lots[slot].lots;
+        int removed = 0;
+        while (quantity > 0 && count[slot] > 0) {
+            StockLot& oldest = ring[head[slot]];
+            int take = min(quantity, oldest.quantity);
+            oldest.quantity -= take;
+            quantity -= take;
+            removed += take;
+            if (oldest.quantity == 0) {
+                popOldest(slot);
+            }
+        }
+        return removed;
+    }
+
+    // Age in days of the oldest unit on hand, 0 when out of stock
+    int oldestAge(int slot, int today) const {
+        if (count[slot] == 0) {
+            return 0;
+        }
+        return today - lots[slot].lots[head[slot]].receiptDay;
+    }
+
+    // Units held across all lots of a SKU
+    int onHand(int slot) const {
+        int units = 0;
+        for (int i = 0; i < count[slot]; ++i) {
+            units += lots[slot].lots[(head[slot] + i) % kLotsPerSku].quantity;
+        }
+        return units;
+    }
+
+    // Drop every lot past its SKU's shelf life; returns (slot, units) writeoffs
+    vector<pair<int, int>> expire(int today) {
+        vector<pair<int, int>> writeoffs;
+        for (size_t slot = 0; slot < count.size(); ++slot) {
+            int life = shelfLife[slot];
+            if (life <= 0 || count[slot] == 0) {
+                continue;
+            }
+            const StockLot* ring = lots[slot].lots;
+            int expired = 0;
+            while (count[slot] > 0 && ring[head[slot]].receiptDay + life <= today) {
+                expired += ring[head[slot]].quantity;
+                popOldest(static_cast<int>(slot));
+            }
+            if (expired > 0) {
+                writeoffs.push_back({static_cast<int>(slot), expired});
+            }
+        }
+        return writeoffs;
+    }
+
+private:
+    struct alignas(64) LotRing {
+        StockLot lots[kLotsPerSku];
+    };
+    static_assert(sizeof(LotRing) == 64, "one lot ring per cache line");
+
+    vector<LotRing> lots; // aligned new keeps every ring on its own line
+    vector<uint8_t> head;
+    vector<uint8_t> count;
+    vector<int> shelfLife;
+
+    void popOldest(int slot) {
+        head[slot] = static_cast<uint8_t>((head[slot] + 1) % kLotsPerSku);
+        --count[slot];
+    }
+};
+
+class InventoryMonitoringAgent {
+public:
+    int registerProduct(const string& productId) {
+        int slot = ledger.registerSku(productId);
+        if (static_cast<size_t>(slot) >= minThresholds.size()) {
+            minThresholds.resize(slot + 1, 0);
+            maxThresholds.resize(slot + 1, numeric_limits<int>::max());
+            lots.resize(slot + 1);
+        }
+        return slot;
+    }
+
+    // Size the registry up front when loading a whole catalog
+    void reserve(size_t numSkus) {
+        ledger.reserve(numSkus);
+        lots.reserve(numSkus);
+        minThresholds.reserve(numSkus);
+        maxThresholds.reserve(numSkus);
+    }
+
+    // Lot-tracked stock movements. These are driven by the planning thread;
+    // concurrent register streams go through applyEvents and only move the
+    // ledger totals.
+    void receiveStock(const string& productId, int quantity, int day) {
+        receiveStock(registerProduct(productId), quantity, day);
+    }
+
+    void receiveStock(int slot, int quantity, int day) {
+        lots.receive(slot, day, quantity);
+        ledger.apply(slot, quantity);
+    }
+
+    int sellStock(int slot, int quantity) {
+        int sold = lots.consume(slot, quantity);
+        ledger.apply(slot, -sold);
+        return sold;
+    }
+
+    // Mirror register events already applied to the ledger into the lots
+    void recordLotEvents(const vector<StockEvent>& events, int day) {
+        for (const auto& event : events) {
+            if (event.delta > 0) {
+                lots.receive(event.slot, day, event.delta);
+            } else {
+                lots.consume(event.slot, -event.delta);
+            }
+        }
+    }
+
+    vector<pair<int, int>> expireLots(int today) {
+        auto writeoffs = lots.expire(today);
+        for (const auto& [slot, quantity] : writeoffs) {
+            ledger.apply(slot, -quantity);
+        }
+        return writeoffs;
+    }
+
+    void setShelfLife(const string& productId, int days) {
+        setShelfLife(registerProduct(productId), days);
+    }
+
+    void setShelfLife(int slot, int days) {
+        lots.setShelfLife(slot, days);
+    }
+
+    int stockAge(int slot, int today) const {
+        return lots.oldestAge(slot, today);
+    }
+
+    // Units tracked in lots; matches getStock for lot-tracked movements
+    int lotStock(int slot) const {
+        return lots.onHand(slot);
+    }
+
+    void updateInventory(const string& productId, int quantity) {
+        ledger.apply(registerProduct(productId), quantity);
+    }
+
+    // Safe to call from many register threads once products are registered
+    void applyEvents(const vector<StockEvent>& events) {
+        ledger.applyBatch(events);
+    }
+
+    void setThresholds(const string& productId, int minThreshold, int maxThreshold) {
+        setThresholds(registerProduct(productId), minThreshold, maxThreshold);
+    }
+
+    void setThresholds(int slot, int minThreshold, int maxThreshold) {
+        minThresholds[slot] = minThreshold;
+        maxThresholds[slot] = maxThreshold;
+    }
+
+    pair<string, int> checkInventory(const string& productId) const {
+        int slot = ledger.slotOf(productId);
+        if (slot < 0) {
+            throw out_of_range("Unknown product: " + productId);
+        }
+        return checkInventory(slot);
+    }
+
+    // -1 below min_threshold, 1 above max_threshold, 0 in between. The
+    // replan only reads stock through this band while a SKU is in range.
+    int thresholdBand(int slot) const {
+        int current = ledger.get(slot);
+        return current < minThresholds[slot] ? -1 : current > maxThresholds[slot] ? 1 : 0;
+    }
+
+    pair<string, int> checkInventory(int slot) const {
+        int current = ledger.get(slot);
+        int min_thresh = minThresholds[slot];
+        int max_thresh = maxThresholds[slot];
+        
+        if (current < min_thresh) {
+            return {"low", max_thresh - current};
+        } else if (current > max_thresh) {
+            return {"high", current - max_thresh};
+        }
+        return {"ok", 0};
+    }
+
+    // Scan every SKU against its thresholds; runs alongside ingestion and
+    // sees each counter at some point during the scan.
+    vector<pair<int, pair<string, int>>> scanThresholds() const {
+        vector<pair<int, pair<string, int>>> alerts;
+        for (size_t slot = 0; slot < ledger.size(); ++slot) {
+            auto check = checkInventory(static_cast<int>(slot));
+            if (check.first != "ok") {
+                alerts.push_back({static_cast<int>(slot), check});
+            }
+        }
+        return alerts;
+    }
+
+    int slotOf(const string& productId) const {
+        return ledger.slotOf(productId);
+    }
+
+    pair<int, int> getThresholds(int slot) const {
+        return {minThresholds[slot], maxThresholds[slot]};
+    }
+
+    // 0 for products that were never registered
+    int getStock(const string& productId) const {
+        int slot = ledger.slotOf(productId);
+        return slot < 0 ? 0 : ledger.get(slot);
+    }
+
+    int getStock(int slot) const {
+        return ledger.get(slot);
+    }
+
+    size_t productCount() const {
+        return ledger.size();
+    }
+
+    const string& productId(int slot) const {
+        return ledger.skuId(slot);
+    }
+
+private:
+    InventoryLedger ledger;
+    LotStore lots;
+    vector<int> minThresholds;
+    vector<int> maxThresholds;
+};
+
+class PricingOptimizationAgent {
+public:
+    // Prices are indexed by the inventory slot of the SKU
+    void setBasePrice(int slot, double basePrice) {
+        if (static_cast<size_t>(slot) >= basePrices.size()) {
+            basePrices.resize(slot + 1, 0.0);
+        }
+        basePrices[slot] = basePrice;
+    }
+
+    void reserve(size_t numProducts) {
+        basePrices.reserve(numProducts);
+    }
+
+    double calculateOptimalPrice(int slot, int demandForecast, int currentInventory, int daysInStock) const {
+        double basePrice = basePrices.at(slot);
+        
+        if (daysInStock > 60) { // Very slow-moving
+            return basePrice * 0.7; // 30% discount
+        } else if (daysInStock > 30) { // Slow-moving
+            return basePrice * 0.8; // 20% discount
+        } else if (currentInventory < demandForecast * 0.5) { // Potential stockout
+            return basePrice * 1.1; // 10% increase
+        }
+        return basePrice;
+    }
+
+private:
+    vector<double> basePrices;
+};
+
+class SupplierCoordinationAgent {
+public:
+    void registerSupplier(const string& supplierId, int leadTime, int minOrderQuantity) {
+        suppliers[supplierId] = {leadTime, minOrderQuantity};
+    }
+
+    pair<bool, string> placeOrder(const string& productId, int quantity) {
+        if (suppliers.empty()) {
+            return {false, "No suppliers registered"};
+        }
+        
+        // For simplicity, use the first supplier
+        auto& [leadTime, minOrderQty] = suppliers.begin()->second;
+        return {true, "Order placed with " + suppliers.begin()->first + 
+                      ". Expected delivery in " + to_string(leadTime) + " days."};
+    }
+
+    // Lead time of the supplier placeOrder uses, or 0 without suppliers
+    int leadTime() const {
+        return suppliers.empty() ? 0 : suppliers.begin()->second.first;
+    }
+
+private:
+    map<string, pair<int, int>> suppliers; // supplierId -> (leadTime, minOrderQuantity)
+};
+
+// Merging t-digest with fixed storage. Values are buffered and folded into
+// the centroid list when the buffer fills, so adding never allocates and
+// memory stays constant however many values are seen. Digests merge by
+// feeding one's centroids into the other.
+class TDigest {
+public:
+    static constexpr int kCompression = 100;
+
+    void add(double value, double weight = 1.0) {
+        if (numBuffered == kBufferSize) {
+            flush();
+        }
+        buffer[numBuffered++] = {value, weight};
+        totalWeight += weight;
+        minValue = min(minValue, value);
+        maxValue = max(maxValue, value);
+    }
+
+    // Replays the other digest's centroids; its exact extremes are carried
+    // over separately since centroid means lie inside them
+    void merge(const TDigest& other) {
+        for (int i = 0; i < other.numCentroids; ++i) {
+            add(other.centroids[i].mean, other.centroids[i].weight);
+        }
+        for (int i = 0; i < other.numBuffered; ++i) {
+            add(other.buffer[i].mean, other.buffer[i].weight);
+        }
+        minValue = min(minValue, other.minValue);
+        maxValue = max(maxValue, other.maxValue);
+    }
+
+    // Const so concurrent readers are safe: a digest with buffered values is
+    // compressed into a local copy rather than in place. Call compress()
+    // first when reading the same digest many times.
+    double quantile(double q) const {
+        if (numBuffered == 0) {
+            return quantileOf(centroids.data(), numCentroids, q);
+        }
+        vector<Centroid> merged(numCentroids + numBuffered);
+        copy(centroids.begin(), centroids.begin() + numCentroids, merged.begin());
+        copy(buffer.begin(), buffer.begin() + numBuffered, merged.begin() + numCentroids);
+        int n = compressInto(merged.data(), static_cast<int>(merged.size()), merged.data());
+        return quantileOf(merged.data(), n, q);
+    }
+
+    void compress() {
+        flush();
+    }
+
+    double count() const {
+        return totalWeight;
+    }
+
+private:
+    static constexpr int kMaxCentroids = 2 * kCompression;
+    static constexpr int kBufferSize = 512;
+
+    struct Centroid {
+        double mean;
+        double weight;
+    };
+
+    array<Centroid, kMaxCentroids> centroids;
+    array<Centroid, kBufferSize> buffer;
+    array<Centroid, kMaxCentroids + kBufferSize> scratch;
+    int numCentroids = 0;
+    int numBuffered = 0;
+    double totalWeight = 0;
+    double minValue = numeric_limits<double>::max();
+    double maxValue = numeric_limits<double>::lowest();
+
+    void flush() {
+        if (numBuffered == 0) {
+            return;
+        }
+        int n = 0;
+        for (int i = 0; i < numCentroids; ++i) scratch[n++] = centroids[i];
+        for (int i = 0; i < numBuffered; ++i) scratch[n++] = buffer[i];
+        numBuffered = 0;
+        numCentroids = compressInto(scratch.data(), n, centroids.data());
+    }
+
+    // Sort input[0, n) and fold it into at most kMaxCentroids centroids.
+    // output may alias input since it never runs ahead of the read index.
+    static int compressInto(Centroid* input, int n, Centroid* output) {
+        sort(input, input + n, [](const Centroid& a, const Centroid& b) { return a.mean < b.mean; });
+
+        // A centroid may grow while it spans at most one unit of the k1 scale
+        // k(q) = delta / (2 pi) * asin(2q - 1), which keeps tails fine-grained
+        // and bounds the centroid count by the compression
+        double total = 0;
+        for (int i = 0; i < n; ++i) total += input[i].weight;
+        int count = 0;
+        Centroid current = input[0];
+        double weightBefore = 0;
+        for (int i = 1; i < n; ++i) {
+            double proposed = current.weight + input[i].weight;
+            double span = scale((weightBefore + proposed) / total) - scale(weightBefore / total);
+            if (span <= 1.0 || count == kMaxCentroids - 1) {
+                current.mean += (input[i].mean - current.mean) * input[i].weight / proposed;
+                current.weight = proposed;
+            } else {
+                weightBefore += current.weight;
+                output[count++] = current;
+                current = input[i];
+            }
+        }
+        output[count++] = current;
+        return count;
+    }
+
+    // Quantile estimate as in the reference merging digest: the extremes
+    // are exact, a unit-weight centroid is returned as the sample it holds
+    // rather than interpolated across, and the half-centroids at the ends
+    // interpolate toward the observed min and max
+    double quantileOf(const Centroid* c, int n, double q) const {
+        if (n == 0) {
+            return 0;
+        }
+        if (minValue == maxValue) {
+            return minValue;
+        }
+        double index = q * totalWeight;
+        if (index < 1) {
+            return minValue;
+        }
+        if (c[0].weight > 1 && index < c[0].weight / 2) {
+            return minValue + (index - 1) / (c[0].weight / 2 - 1) * (c[0].mean - minValue);
+        }
+        if (index > totalWeight - 1) {
+            return maxValue;
+        }
+        if (c[n - 1].weight > 1 && totalWeight - index <= c[n - 1].weight / 2) {
+            return maxValue - (totalWeight - index - 1) / (c[n - 1].weight / 2 - 1) * (maxValue - c[n - 1].mean);
+        }
+        double weightSoFar = c[0].weight / 2;
+        for (int i = 0; i + 1 < n; ++i) {
+            double gap = (c[i].weight + c[i + 1].weight) / 2;
+            if (weightSoFar + gap > index) {
+                double leftUnit = 0;
+                if (c[i].weight == 1) {
+                    if (index - weightSoFar < 0.5) {
+                        return c[i].mean;
+                    }
+                    leftUnit = 0.5;
+                }
+                double rightUnit = 0;
+                if (c[i + 1].weight == 1) {
+                    if (weightSoFar + gap - index <= 0.5) {
+                        return c[i + 1].mean;
+                    }
+                    rightUnit = 0.5;
+                }
+                double toLeft = index - weightSoFar - leftUnit;
+                double toRight = weightSoFar + gap - index - rightUnit;
+                return (c[i].mean * toRight + c[i + 1].mean * toLeft) / (toLeft + toRight);
+            }
+            weightSoFar += gap;
+        }
+        double toLast = index - (totalWeight - c[n - 1].weight / 2);
+        double toMax = c[n - 1].weight / 2 - toLast;
+        return (c[n - 1].mean * toMax + maxValue * toLast) / (toLast + toMax);
+    }
+
+    static double scale(double q) {
+        return kCompression / (2 * M_PI) * asin(2 * min(1.0, q) - 1);
+    }
+};
+
+// Count, sum, extremes and quantiles of one KPI
+class KpiAccumulator {
+public:
+    void add(double value) {
+        ++count;
+        sum += value;
+        minValue = min(minValue, value);
+        maxValue = max(maxValue, value);
+        digest.add(value);
+    }
+
+    void merge(const KpiAccumulator& other) {
+        count += other.count;
+        sum += other.sum;
+        minValue = min(minValue, other.minValue);
+        maxValue = max(maxValue, other.maxValue);
+        digest.merge(other.digest);
+    }
+
+    long long getCount() const { return count; }
+    double mean() const { return count ? sum / count : 0; }
+    double quantile(double q) const { return digest.quantile(q); }
+
+private:
+    long long count = 0;
+    double sum = 0;
+    double minValue = numeric_limits<double>::max();
+    double maxValue = numeric_limits<double>::lowest();
+    TDigest digest;
+};
+
+// Distributions collected while the simulator runs. Copies filled
+// separately, e.g. one per thread, can be merged.
+struct SimulationKpis {
+    KpiAccumulator daysOfCover;      // closing stock / mean daily demand
+    KpiAccumulator stockoutDuration; // length in days of each stockout run
+    KpiAccumulator price;
+
+    void merge(const SimulationKpis& other) {
+        daysOfCover.merge(other.daysOfCover);
+        stockoutDuration.merge(other.stockoutDuration);
+        price.merge(other.price);
+    }
+};
+
+// Streaming forecast-accuracy statistics per SKU, kept in flat arrays and
+// decayed exponentially so recent errors dominate. Each actual costs a few
+// multiply-adds; worstSkus finds the drifting SKUs with a size-k heap.
+class ForecastAccuracyMonitor {
+public:
+    explicit ForecastAccuracyMonitor(double decay = 0.95) : decay(decay) {}
+
+    void resize(size_t numSkus) {
+        weight.resize(numSkus, 0);
+        error.resize(numSkus, 0);
+        absError.resize(numSkus, 0);
+        sqError.resize(numSkus, 0);
+        actualSum.resize(numSkus, 0);
+    }
+
+    void recordActual(int slot, double forecast, double actual) {
+        double e = forecast - actual;
+        weight[slot] = decay * weight[slot] + 1;
+        error[slot] = decay * error[slot] + e;
+        absError[slot] = decay * absError[slot] + abs(e);
+        sqError[slot] = decay * sqError[slot] + e * e;
+        actualSum[slot] = decay * actualSum[slot] + actual;
+    }
+
+    void reset(int slot) {
+        weight[slot] = error[slot] = absError[slot] = sqError[slot] = actualSum[slot] = 0;
+    }
+
+    // Relative like SkuAccuracy::bias; > 0 means over-forecasting
+    double bias(int slot) const { return actualSum[slot] ? error[slot] / actualSum[slot] : 0; }
+    double mae(int slot) const { return weight[slot] ? absError[slot] / weight[slot] : 0; }
+    double rmse(int slot) const { return weight[slot] ? sqrt(sqError[slot] / weight[slot]) : 0; }
+    double wape(int slot) const { return actualSum[slot] ? absError[slot] / actualSum[slot] : 0; }
+
+    // The k SKUs with the highest decayed WAPE among those with at least
+    // minWeight of decayed observations, worst first
+    vector<pair<int, double>> worstSkus(size_t k, double minWeight = 3.0) const {
+        priority_queue<pair<double, int>, vector<pair<double, int>>, greater<pair<double, int>>> heap;
+        for (size_t slot = 0; slot < weight.size(); ++slot) {
+            if (weight[slot] < minWeight) {
+                continue;
+            }
+            double score = wape(static_cast<int>(slot));
+            if (heap.size() < k) {
+                heap.push({score, static_cast<int>(slot)});
+            } else if (k > 0 && score > heap.top().first) {
+                heap.pop();
+                heap.push({score, static_cast<int>(slot)});
+            }
+        }
+        vector<pair<int, double>> worst;
+        for (; !heap.empty(); heap.pop()) {
+            worst.push_back({heap.top().second, heap.top().first});
+        }
+        reverse(worst.begin(), worst.end());
+        return worst;
+    }
+
+private:
+    double decay;
+    vector<double> weight;
+    vector<double> error;
+    vector<double> absError;
+    vector<double> sqError;
+    vector<double> actualSum;
+};
+
+enum class SimEventType : uint8_t {
+    DEMAND, ORDER, DELIVERY, PRICE_CHANGE
+};
+
+// Fixed-width simulator event; quantity holds units and value holds prices
+struct SimEvent {
+    SimEventType type;
+    uint8_t reserved[3];
+    int32_t day;
+    int32_t slot;
+    int32_t quantity;
+    double value;
+};
+
+struct EventLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t seed;
+    uint32_t productCount;
+    char startDate[12];
+};
+
+const char kEventLogMagic[8] = {'S', 'I', 'M', 'L', 'O', 'G', '\0', '\0'};
+const uint32_t kEventLogVersion = 1;
+
+// Append-only binary log of simulator events, written through an in-memory
+// buffer so logging costs a copy per event
+class EventLogWriter {
+public:
+    static constexpr size_t kBufferEvents = 4096;
+
+    ~EventLogWriter() {
+        close();
+    }
+
+    bool open(const string& path, const EventLogHeader& header) {
+        out.open(path, ios::binary | ios::trunc);
+        if (!out) {
+            cerr << "Can't write event log: " << path << endl;
+            return false;
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer.reserve(kBufferEvents);
+        return true;
+    }
+
+    bool isOpen() const {
+        return out.is_open();
+    }
+
+    void append(SimEventType type, int day, int slot, int quantity, double value = 0) {
+        SimEvent event = {type, {0, 0, 0}, day, slot, quantity, value};
+        buffer.push_back(event);
+        if (buffer.size() == kBufferEvents) {
+            flush();
+        }
+    }
+
+    void flush() {
+        out.write(reinterpret_cast<const char*>(buffer.data()),
+                  static_cast<streamsize>(buffer.size() * sizeof(SimEvent)));
+        buffer.clear();
+    }
+
+    void close() {
+        if (out.is_open()) {
+            flush();
+            out.close();
+        }
+    }
+
+private:
+    ofstream out;
+    vector<SimEvent> buffer;
+};
+
+bool readEventLog(const string& path, EventLogHeader& header, vector<SimEvent>& events) {
+    ifstream in(path, ios::binary | ios::ate);
+    if (!in) {
+        cerr << "Can't open event log: " << path << endl;
+        return false;
+    }
+    streamsize size = in.tellg();
+    in.seekg(0);
+    if (size < static_cast<streamsize>(sizeof(header)) ||
+        !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        memcmp(header.magic, kEventLogMagic, sizeof(kEventLogMagic)) != 0 ||
+        header.version != kEventLogVersion) {
+        cerr << "Unsupported event log: " << path << endl;
+        return false;
+    }
+    events.resize((size - sizeof(header)) / sizeof(SimEvent));
+    in.read(reinterpret_cast<char*>(events.data()), static_cast<streamsize>(events.size() * sizeof(SimEvent)));
+    return static_cast<bool>(in);
+}
+
+// Tracks which SKUs need to go through forecast -> reorder -> pricing.
+// Inputs that change a SKU mark it dirty; SKUs whose plan depends on the
+// date (pending reorders, ongoing clearance) are re-marked on each rollover.
+// Sales only mark a SKU when they move it across a stock threshold: inside
+// the thresholds the plan does not read the stock level.
+class ReplanTracker {
+public:
+    enum Reason : uint8_t {
+        STOCK_CHANGED = 1,
+        PRICE_CHANGED = 2,
+        NEW_SALES = 4,
+        CALENDAR_ROLLOVER = 8
+    };
+
+    void resize(size_t numSkus) {
+        reasons.resize(numSkus, 0);
+        dateDependent.resize(numSkus, 0);
+    }
+
+    void markDirty(int slot, uint8_t reason) {
+        if (reasons[slot] == 0) {
+            dirty.push_back(slot);
+        }
+        reasons[slot] |= reason;
+    }
+
+    void markAll(uint8_t reason) {
+        for (size_t slot = 0; slot < reasons.size(); ++slot) {
+            markDirty(static_cast<int>(slot), reason);
+        }
+    }
+
+    void setDateDependent(int slot, bool dependent) {
+        if (dependent && !dateDependent[slot]) {
+            rolloverSlots.push_back(slot);
+        }
+        dateDependent[slot] = dependent ? 1 : 0;
+    }
+
+    // Advance to the next day, dirtying only the date-dependent SKUs
+    void rollover() {
+        size_t kept = 0;
+        for (int slot : rolloverSlots) {
+            if (dateDependent[slot]) {
+                markDirty(slot, CALENDAR_ROLLOVER);
+                rolloverSlots[kept++] = slot;
+            }
+        }
+        rolloverSlots.resize(kept);
+    }
+
+    // Hand out the dirty SKUs in slot order and reset them to clean
+    vector<int> takeDirty() {
+        vector<int> taken;
+        taken.swap(dirty);
+        sort(taken.begin(), taken.end());
+        for (int slot : taken) {
+            reasons[slot] = 0;
+        }
+        return taken;
+    }
+
+    size_t dirtyCount() const {
+        return dirty.size();
+    }
+
+private:
+    vector<uint8_t> reasons;
+    vector<uint8_t> dateDependent;
+    vector<int> dirty;
+    vector<int> rolloverSlots;
+};
+
+// Clearance horizon and markdown ladder for MarkdownPlanner. Levels must be
+// ascending discounts in [0, 1), at most 256 of them.
+struct MarkdownConfig {
+    int weeks = 8;
+    vector<double> discountLevels = {0.0, 0.1, 0.2, 0.3, 0.4, 0.5};
+    double priceElasticity = -1.5;
+    double salvageRate = 0.2; // share of base price recovered per unsold unit
+    int stockBuckets = 64;
+};
+
+struct MarkdownPlan {
+    string productId;
+    vector<double> weeklyDiscount;
+    double expectedRevenue = 0;
+    int expectedLeftover = 0;
+};
+
+// Chooses a non-decreasing discount per week that maximizes revenue plus
+// salvage for a SKU's excess stock. The excess sells alongside the regular
+// stock kept at the max threshold, so it only receives its pro-rata share of
+// each week's demand. The DP state is (week, stock bucket, current discount
+// level). For each (week, stock) the value of every candidate level is
+// computed in one pass over the ladder, and a suffix max then gives the best
+// allowed markdown from every current level.
+class MarkdownPlanner {
+public:
+    static bool validConfig(const MarkdownConfig& config) {
+        const vector<double>& levels = config.discountLevels;
+        return !levels.empty() && levels.size() <= 256 && levels.front() >= 0.0 && levels.back() < 1.0 &&
+               is_sorted(levels.begin(), levels.end());
+    }
+
+    // Units of the excess sold in a week with this much excess left
+    static double excessSold(double units, int regularStock, double demand) {
+        return units > 0 ? min(units, demand * units / (units + regularStock)) : 0.0;
+    }
+
+    // stock is the excess to clear; the plan is empty for an invalid config
+    MarkdownPlan plan(const string& productId, int stock, int regularStock, double basePrice,
+                      const vector<double>& weeklyDemand, const MarkdownConfig& config) const {
+        MarkdownPlan result;
+        result.productId = productId;
+        result.expectedLeftover = stock;
+        if (!validConfig(config)) {
+            return result;
+        }
+        size_t levels = config.discountLevels.size();
+        int weeks = min(config.weeks, static_cast<int>(weeklyDemand.size()));
+        int buckets = max(2, min(config.stockBuckets, stock + 1));
+        double unitsPerBucket = stock > 0 ? static_cast<double>(stock) / (buckets - 1) : 1.0;
+
+        vector<double> prices(levels), demandScale(levels);
+        for (size_t l = 0; l < levels; ++l) {
+            prices[l] = basePrice * (1.0 - config.discountLevels[l]);
+            demandScale[l] = pow(1.0 - config.discountLevels[l], config.priceElasticity);
+        }
+
+        // value[s * levels + l]: best revenue from this week on
+        vector<double> value(buckets * levels), next(buckets * levels);
+        vector<uint8_t> policy(static_cast<size_t>(weeks) * buckets * levels);
+        for (int s = 0; s < buckets; ++s) {
+            fill_n(next.begin() + s * levels, levels, config.salvageRate * basePrice * s * unitsPerBucket);
+        }
+
+        vector<double> total(levels);
+        for (int w = weeks - 1; w >= 0; --w) {
+            for (int s = 0; s < buckets; ++s) {
+                double units = s * unitsPerBucket;
+                for (size_t l = 0; l < levels; ++l) {
+                    double sold = excessSold(units, regularStock, weeklyDemand[w] * demandScale[l]);
+                    int remaining = static_cast<int>(lround((units - sold) / unitsPerBucket));
+                    total[l] = prices[l] * sold + next[remaining * levels + l];
+                }
+                // Markdowns never go back up: from level l choose the best l' >= l
+                uint8_t* choice = policy.data() + (static_cast<size_t>(w) * buckets + s) * levels;
+                double* best = value.data() + s * levels;
+                best[levels - 1] = total[levels - 1];
+                choice[levels - 1] = static_cast<uint8_t>(levels - 1);
+                for (size_t l = levels - 1; l-- > 0;) {
+                    bool stay = total[l] >= best[l + 1];
+                    best[l] = stay ? total[l] : best[l + 1];
+                    choice[l] = stay ? static_cast<uint8_t>(l) : choice[l + 1];
+                }
+            }
+            swap(value, next);
+        }
+
+        result.expectedRevenue = buckets > 0 ? next[(buckets - 1) * levels] : 0;
+        int s = buckets - 1;
+        size_t level = 0;
+        double units = stock;
+        for (int w = 0; w < weeks; ++w) {
+            level = policy[(static_cast<size_t>(w) * buckets + s) * levels + level];
+            result.weeklyDiscount.push_back(config.discountLevels[level]);
+            units -= excessSold(units, regularStock, weeklyDemand[w] * demandScale[level]);
+            s = static_cast<int>(lround(units / unitsPerBucket));
+        }
+        result.expectedLeftover = static_cast<int>(lround(units));
+        return result;
+    }
+};
+
+// Product master in column form; row i becomes inventory slot i
+struct ProductCatalog {
+    vector<string> ids;
+    vector<double> basePrices;
+    vector<int> baseDemand;
+    vector<int> initialStock;
+    vector<int> minThresholds;
+    vector<int> maxThresholds;
+    vector<int> shelfLifeDays; // 0 for non-perishable
+    vector<string> segments;   // "store/category"
+
+    size_t size() const {
+        return ids.size();
+    }
+
+    void append(const map<string, string>& product) {
+        ids.push_back(product.at("id"));
+        basePrices.push_back(stod(product.at("base_price")));
+        baseDemand.push_back(stoi(product.at("base_demand")));
+        initialStock.push_back(stoi(product.at("initial_stock")));
+        minThresholds.push_back(stoi(product.at("min_threshold")));
+        maxThresholds.push_back(stoi(product.at("max_threshold")));
+        shelfLifeDays.push_back(product.count("shelf_life_days") ? stoi(product.at("shelf_life_days")) : 0);
+        string store = product.count("store") ? product.at("store") : "default";
+        string category = product.count("category") ? product.at("category") : "default";
+        segments.push_back(store + "/" + category);
+    }
+
+    void append(ProductCatalog&& other) {
+        move(other.ids.begin(), other.ids.end(), back_inserter(ids));
+        basePrices.insert(basePrices.end(), other.basePrices.begin(), other.basePrices.end());
+        baseDemand.insert(baseDemand.end(), other.baseDemand.begin(), other.baseDemand.end());
+        initialStock.insert(initialStock.end(), other.initialStock.begin(), other.initialStock.end());
+        minThresholds.insert(minThresholds.end(), other.minThresholds.begin(), other.minThresholds.end());
+        maxThresholds.insert(maxThresholds.end(), other.maxThresholds.begin(), other.maxThresholds.end());
+        shelfLifeDays.insert(shelfLifeDays.end(), other.shelfLifeDays.begin(), other.shelfLifeDays.end());
+        move(other.segments.begin(), other.segments.end(), back_inserter(segments));
+    }
+
+    void reserve(size_t numProducts) {
+        ids.reserve(numProducts);
+        basePrices.reserve(numProducts);
+        baseDemand.reserve(numProducts);
+        initialStock.reserve(numProducts);
+        minThresholds.reserve(numProducts);
+        maxThresholds.reserve(numProducts);
+        shelfLifeDays.reserve(numProducts);
+        segments.reserve(numProducts);
+    }
+};
+
+// Loads a product master CSV with a header row naming the columns, e.g.
+//   id,name,base_price,base_demand,initial_stock,min_threshold,max_threshold[,shelf_life_days,store,category]
+// The file is mapped and split into line-aligned chunks parsed in parallel
+// with from_chars; chunks are concatenated in file order so slots follow
+// the file. Fields are unquoted; unknown columns are skipped, and a file
+// that repeats a product id is rejected.
+class CatalogLoader {
+public:
+    static bool loadCsv(const string& path, ProductCatalog& catalog, ThreadPool& pool) {
+        auto file = MappedFile::open(path);
+        if (!file) {
+            cerr << "Can't open catalog: " << path << endl;
+            return false;
+        }
+        const char* begin = file->bytes();
+        const char* end = begin + file->size();
+        const char* body = find(begin, end, '\n');
+        vector<int> columns;
+        if (!parseHeader(begin, body, columns)) {
+            cerr << "Catalog header is missing required columns: " << path << endl;
+            return false;
+        }
+        body = body == end ? end : body + 1;
+
+        // Line-aligned chunk boundaries, a few per worker to even out the load
+        size_t chunkCount = max<size_t>(1, min<size_t>(pool.size() * 4, (end - body) / kMinChunkBytes));
+        vector<const char*> bounds = {body};
+        for (size_t i = 1; i < chunkCount; ++i) {
+            const char* cut = max(bounds.back(), body + (end - body) * i / chunkCount);
+            cut = find(cut, end, '\n');
+            bounds.push_back(cut == end ? end : cut + 1);
+        }
+        bounds.push_back(end);
+
+        vector<ProductCatalog> parts(chunkCount);
+        vector<string> errors(chunkCount);
+        vector<future<void>> done;
+        for (size_t i = 0; i < chunkCount; ++i) {
+            done.push_back(pool.submit([&, i] {
+                parseChunk(bounds[i], bounds[i + 1], columns, parts[i], errors[i]);
+            }));
+        }
+        ThreadPool::waitAll(done);
+
+        size_t total = catalog.size();
+        for (size_t i = 0; i < chunkCount; ++i) {
+            if (!errors[i].empty()) {
+                cerr << "Bad catalog row in " << path << ": " << errors[i] << endl;
+                return false;
+            }
+            total += parts[i].size();
+        }
+        // Slots follow rows, so a repeated id would give one SKU two rows
+        unordered_set<string_view> seen(catalog.ids.begin(), catalog.ids.end());
+        seen.reserve(total);
+        for (const auto& part : parts) {
+            for (const string& id : part.ids) {
+                if (!seen.insert(id).second) {
+                    cerr << "Duplicate product id in " << path << ": " << id << endl;
+                    return false;
+                }
+            }
+        }
+        catalog.reserve(total);
+        for (auto& part : parts) {
+            catalog.append(move(part));
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t kMinChunkBytes = 1 << 16;
+
+    enum Column {
+        kId, kBasePrice, kBaseDemand, kInitialStock, kMinThreshold, kMaxThreshold,
+        kShelfLife, kStore, kCategory, kColumnCount, kSkip = -1
+    };
+
+    static bool parseHeader(const char* begin, const char* end, vector<int>& columns) {
+        static const char* const names[kColumnCount] = {
+            "id", "base_price", "base_demand", "initial_stock", "min_threshold", "max_threshold",
+            "shelf_life_days", "store", "category"
+        };
+        array<bool, kColumnCount> seen = {};
+        forEachField(begin, trimLine(begin, end), [&](const char* field, const char* fieldEnd) {
+            int column = kSkip;
+            for (int c = 0; c < kColumnCount; ++c) {
+                if (string(field, fieldEnd) == names[c]) {
+                    column = c;
+                    seen[c] = true;
+                }
+            }
+            columns.push_back(column);
+        });
+        return all_of(seen.begin(), seen.begin() + kShelfLife, [](bool s) { return s; });
+    }
+
+    // On failure error holds the offending line
+    static void parseChunk(const char* begin, const char* end, const vector<int>& columns,
+                           ProductCatalog& out, string& error) {
+        out.reserve((end - begin) / 48);
+        const char* line = begin;
+        while (line < end && error.empty()) {
+            const char* lineEnd = find(line, end, '\n');
+            const char* contentEnd = trimLine(line, lineEnd);
+            if (contentEnd > line) {
+                if (!parseRow(line, contentEnd, columns, out)) {
+                    error.assign(line, contentEnd);
+                }
+            }
+            line = lineEnd == end ? end : lineEnd + 1;
+        }
+    }
+
+    static bool parseRow(const char* begin, const char* end, const vector<int>& columns, ProductCatalog& out) {
+        string id;
+        string_view store = "default", category = "default";
+        double price = 0;
+        array<int, kColumnCount> ints = {};
+        array<bool, kColumnCount> seen = {};
+        size_t index = 0;
+        bool ok = true;
+        forEachField(begin, end, [&](const char* field, const char* fieldEnd) {
+            int column = index < columns.size() ? columns[index] : kSkip;
+            ++index;
+            if (column == kSkip) {
+                return;
+            }
+            seen[column] = true;
+            if (column == kId) {
+                id.assign(field, fieldEnd);
+            } else if (column == kStore) {
+                store = string_view(field, fieldEnd - field);
+            } else if (column == kCategory) {
+                category = string_view(field, fieldEnd - field);
+            } else if (column == kBasePrice) {
+                auto result = from_chars(field, fieldEnd, price);
+                ok = ok && result.ec == errc() && result.ptr == fieldEnd;
+            } else {
+                auto result = from_chars(field, fieldEnd, ints[column]);
+                ok = ok && result.ec == errc() && result.ptr == fieldEnd;
+            }
+        });
+        if (!ok || id.empty() || !all_of(seen.begin(), seen.begin() + kShelfLife, [](bool s) { return s; })) {
+            return false;
+        }
+        out.ids.push_back(move(id));
+        out.basePrices.push_back(price);
+        out.baseDemand.push_back(ints[kBaseDemand]);
+        out.initialStock.push_back(ints[kInitialStock]);
+        out.minThresholds.push_back(ints[kMinThreshold]);
+        out.maxThresholds.push_back(ints[kMaxThreshold]);
+        out.shelfLifeDays.push_back(ints[kShelfLife]);
+        string segment;
+        segment.reserve(store.size() + category.size() + 1);
+        segment.append(store).append("/").append(category);
+        out.segments.push_back(move(segment));
+        return true;
+    }
+
+    template <typename Visit>
+    static void forEachField(const char* begin, const char* end, Visit&& visit) {
+        while (true) {
+            const char* comma = find(begin, end, ',');
+            visit(begin, comma);
+            if (comma == end) {
+                break;
+            }
+            begin = comma + 1;
+        }
+    }
+
+    static const char* trimLine(const char* begin, const char* end) {
+        return end > begin && end[-1] == '\r' ? end - 1 : end;
+    }
+};
+
+// Parameter overrides for a single-SKU what-if projection; a negative
+// threshold keeps the SKU's current reorder point
+struct WhatIfScenario {
+    double priceMultiplier = 1.0; // 0.9 projects a 10% price drop
+    double priceElasticity = -1.5;
+    int minThreshold = -1;
+    int horizonDays = 30;
+};
+
+struct ProjectedDay {
+    int stock;    // closing stock
+    int demand;
+    int sold;
+    int received;
+    int ordered;
+};
+
+class RetailEnvironment {
+public:
+    static constexpr int kHistoryDays = 90;
+    static constexpr int kForecastDays = 400;
+
+    RetailEnvironment() {
+        // Cover training history plus the simulation and forecast horizon
+        calendar.build(addDaysToDate(currentDate(), -kHistoryDays), kHistoryDays + kForecastDays);
+        demandAgent.setCalendar(&calendar);
+        demandAgent.setThreadPool(&pool);
+    }
+
+    // Select the forecaster before initializeSystem trains it. Per-SKU
+    // models are indexed by position in the product list.
+    void setForecastModel(ForecastModelType type) {
+        demandAgent.setModelType(type);
+    }
+
+    RetailEnvironment(const RetailEnvironment&) = delete;
+    RetailEnvironment& operator=(const RetailEnvironment&) = delete;
+
+    void initializeSystem(const vector<map<string, string>>& products) {
+        ProductCatalog catalog;
+        catalog.reserve(products.size());
+        for (const auto& product : products) {
+            catalog.append(product);
+        }
+        initializeSystem(catalog);
+    }
+
+    void initializeSystem(const ProductCatalog& catalog) {
+        registerCatalog(catalog);
+        
+        // Generate synthetic sales data for demonstration
+        salesHistory = generateSalesData();
+        demandAgent.trainModel(salesHistory);
+        
+        // Register a sample supplier
+        supplierAgent.registerSupplier("SUP-001", 3, 10);
+    }
+
+    bool loadCatalog(const string& path, ProductCatalog& catalog) {
+        return CatalogLoader::loadCsv(path, catalog, pool);
+    }
+
+    // Set initial inventory levels, thresholds and prices by slot. Rows for
+    // ids that are already registered are skipped so stock isn't received
+    // twice.
+    void registerCatalog(const ProductCatalog& catalog) {
+        inventoryAgent.reserve(catalog.size());
+        pricingAgent.reserve(catalog.size());
+        for (size_t i = 0; i < catalog.size(); ++i) {
+            if (inventoryAgent.slotOf(catalog.ids[i]) >= 0) {
+                cerr << "Skipping duplicate product id: " << catalog.ids[i] << endl;
+                continue;
+            }
+            int slot = inventoryAgent.registerProduct(catalog.ids[i]);
+            inventoryAgent.receiveStock(slot, catalog.initialStock[i], simulationDay);
+            inventoryAgent.setThresholds(slot, catalog.minThresholds[i], catalog.maxThresholds[i]);
+            if (catalog.shelfLifeDays[i] > 0) {
+                inventoryAgent.setShelfLife(slot, catalog.shelfLifeDays[i]);
+            }
+            pricingAgent.setBasePrice(slot, catalog.basePrices[i]);
+            baseDemand.resize(inventoryAgent.productCount(), 0);
+            productSegment.resize(inventoryAgent.productCount());
+            baseDemand[slot] = catalog.baseDemand[i];
+            productSegment[slot] = catalog.segments[i];
+        }
+    }
+
+    const string& productId(int slot) const {
+        return inventoryAgent.productId(slot);
+    }
+
+    // Synthetic daily sales for every registered SKU at its base price
+    SalesHistory generateSalesData(int days = kHistoryDays) {
+        SalesHistory history;
+        history.features.width = DemandForecastingAgent::featureCount();
+        size_t numSkus = inventoryAgent.productCount();
+        history.reserve(static_cast<size_t>(days) * numSkus);
+        string startDate = currentDate();
+        
+        for (int day = 0; day < days; ++day) {
+            string date = addDaysToDate(startDate, -days + day);
+            const CalendarRow& calendarRow = calendar.lookup(date);
+            for (size_t slot = 0; slot < numSkus; ++slot) {
+                int sales = drawDemand(baseDemand[slot], calendarRow);
+                double price = pricingAgent.calculateOptimalPrice(static_cast<int>(slot), 0, 0, 0);
+                double* row = history.addRow(day, static_cast<int>(slot), sales);
+                DemandForecastingAgent::fillFeatures(calendarRow, price, randomInt(0, 1), row);
+            }
+        }
+        
+        return history;
+    }
+
+    vector<map<string, string>> runSimulation(int days = 30) {
+        return simulate(days, currentDate(), nullptr);
+    }
+
+    // Record every demand draw and decision of later runSimulation calls.
+    // Seed with seedRandom before initializeSystem to reproduce a run.
+    bool startEventLog(const string& path) {
+        EventLogHeader header = {};
+        memcpy(header.magic, kEventLogMagic, sizeof(kEventLogMagic));
+        header.version = kEventLogVersion;
+        header.seed = randomSeed();
+        header.productCount = static_cast<uint32_t>(inventoryAgent.productCount());
+        strncpy(header.startDate, currentDate().c_str(), sizeof(header.startDate) - 1);
+        return eventLog.open(path, header);
+    }
+
+    void stopEventLog() {
+        eventLog.close();
+    }
+
+    // Re-drive the simulator from a recorded log on an environment set up
+    // with the same products. Demand, deliveries and price changes come
+    // from the log, so no forecasts are computed.
+    vector<map<string, string>> replaySimulation(const string& path) {
+        EventLogHeader header;
+        vector<SimEvent> events;
+        if (!readEventLog(path, header, events)) {
+            return {};
+        }
+        if (header.productCount != inventoryAgent.productCount()) {
+            cerr << "Event log was recorded for " << header.productCount << " products" << endl;
+            return {};
+        }
+        int days = events.empty() ? 0 : events.back().day + 1;
+        return simulate(days, header.startDate, &events);
+    }
+
+private:
+    // Each day only SKUs marked dirty by ReplanTracker are re-checked,
+    // re-forecast and re-priced; the rest keep yesterday's plan
+    vector<map<string, string>> simulate(int days, const string& currentDateStr, const vector<SimEvent>* replay) {
+        vector<map<string, string>> results;
+        size_t productCount = inventoryAgent.productCount();
+        accuracy.resize(productCount);
+        size_t replayPos = 0;
+        vector<int> loggedDemand;
+        unordered_map<int, double> loggedPrices;
+        unordered_map<int, int> loggedDeliveries;
+        stockoutRun.resize(productCount, 0);
+        replan.resize(productCount);
+        replan.markAll(ReplanTracker::STOCK_CHANGED);
+        lastStatus.resize(productCount, "ok");
+        
+        // Forecasts made at the start of the run are what accuracy is scored
+        // against; later price changes must not move the baseline
+        vector<vector<int>> baseline;
+        if (!replay) {
+            string today = currentDate();
+            vector<int> slots(productCount);
+            iota(slots.begin(), slots.end(), 0);
+            fillBaselineForecasts(slots, days, today);
+            baseline.reserve(productCount);
+            for (int slot : slots) {
+                baseline.push_back(forecastCache[slot].days);
+            }
+        }
+        
+        for (int day = 0; day < days; ++day) {
+            string simDate = addDaysToDate(currentDateStr, day);
+            map<string, string> dayResults;
+            dayResults["date"] = simDate;
+            if (day > 0) {
+                replan.rollover();
+            }
+            if (replay) {
+                loggedDemand.assign(productCount, 0);
+                loggedPrices.clear();
+                loggedDeliveries.clear();
+                for (; replayPos < replay->size() && (*replay)[replayPos].day == day; ++replayPos) {
+                    const SimEvent& event = (*replay)[replayPos];
+                    if (event.type == SimEventType::DEMAND) {
+                        loggedDemand[event.slot] = event.quantity;
+                    } else if (event.type == SimEventType::PRICE_CHANGE) {
+                        loggedPrices[event.slot] = event.value;
+                    } else if (event.type == SimEventType::DELIVERY) {
+                        loggedDeliveries[event.slot] = event.quantity;
+                    }
+                }
+            }
+            
+            // Sell today's demand from the oldest lots, then write off expired lots
+            const CalendarRow& calendarRow = calendar.lookup(simDate);
+            vector<int> sold(productCount, 0), writtenOff(productCount, 0);
+            for (size_t slot = 0; slot < productCount; ++slot) {
+                int demand = replay ? loggedDemand[slot] : drawDemand(baseDemand[slot], calendarRow);
+                if (eventLog.isOpen()) {
+                    eventLog.append(SimEventType::DEMAND, day, static_cast<int>(slot), demand);
+                }
+                if (!replay) {
+                    // Compare today's cached forecast with what was actually demanded
+                    accuracy.recordActual(static_cast<int>(slot), baseline[slot][day], demand);
+                }
+                int band = inventoryAgent.thresholdBand(static_cast<int>(slot));
+                sold[slot] = inventoryAgent.sellStock(static_cast<int>(slot), demand);
+                if (inventoryAgent.thresholdBand(static_cast<int>(slot)) != band) {
+                    replan.markDirty(static_cast<int>(slot), ReplanTracker::NEW_SALES);
+                }
+            }
+            for (const auto& [slot, quantity] : inventoryAgent.expireLots(simulationDay)) {
+                writtenOff[slot] = quantity;
+                replan.markDirty(slot, ReplanTracker::STOCK_CHANGED);
+            }
+            
+            // Check inventory for the SKUs whose inputs changed
+            vector<int> lowSlots;
+            vector<double> lowPrices;
+            for (int slot : replan.takeDirty()) {
+                const string& productId = inventoryAgent.productId(slot);
+                auto [status, quantity] = inventoryAgent.checkInventory(slot);
+                lastStatus[slot] = status;
+                replan.setDateDependent(slot, status != "ok");
+                
+                if (status == "low") {
+                    lowSlots.push_back(slot);
+                    lowPrices.push_back(pricingAgent.calculateOptimalPrice(static_cast<int>(slot), 0, 0, 0));
+                } else if (status == "high") {
+                    if (replay) {
+                        auto logged = loggedPrices.find(slot);
+                        if (logged != loggedPrices.end()) {
+                            updatePrice(productId, logged->second);
+                        }
+                        continue;
+                    }
+                    // Adjust price to clear excess inventory, aged by the oldest lot
+                    int daysInStock = inventoryAgent.stockAge(slot, simulationDay);
+                    double newPrice = pricingAgent.calculateOptimalPrice(
+                        slot, 
+                        10, // Simplified forecast
+                        inventoryAgent.getStock(slot),
+                        daysInStock
+                    );
+                    
+                    // Update price strategy
+                    updatePrice(productId, newPrice);
+                    if (eventLog.isOpen()) {
+                        eventLog.append(SimEventType::PRICE_CHANGE, day, slot, 0, newPrice);
+                    }
+                }
+            }
+            
+            if (replay) {
+                for (int slot : lowSlots) {
+                    auto logged = loggedDeliveries.find(slot);
+                    if (logged != loggedDeliveries.end()) {
+                        inventoryAgent.receiveStock(inventoryAgent.productId(slot), logged->second, simulationDay);
+                        replan.markDirty(slot, ReplanTracker::STOCK_CHANGED);
+                    }
+                }
+                lowSlots.clear();
+                lowPrices.clear();
+            }
+            
+            // Get demand forecasts for next week in one batch
+            vector<int> forecasts = forecastSlots(lowSlots, lowPrices, addDaysToDate(simDate, 7));
+            for (size_t i = 0; i < lowSlots.size(); ++i) {
+                int slot = lowSlots[i];
+                const string& productId = inventoryAgent.productId(slot);
+                
+                // Calculate order quantity
+                int orderQty = max(static_cast<int>(forecasts[i] * 1.2) - inventoryAgent.getStock(slot), 3); // Simplified min order
+                
+                // Place order
+                auto [success, orderStatus] = supplierAgent.placeOrder(productId, orderQty);
+                if (success && eventLog.isOpen()) {
+                    eventLog.append(SimEventType::ORDER, day, slot, orderQty);
+                }
+                
+                // Update inventory (simulating delivery after lead time)
+                if (success && day > 3) { // Simplified lead time
+                    inventoryAgent.receiveStock(productId, orderQty, simulationDay);
+                    replan.markDirty(slot, ReplanTracker::STOCK_CHANGED);
+                    if (eventLog.isOpen()) {
+                        eventLog.append(SimEventType::DELIVERY, day, slot, orderQty);
+                    }
+                }
+            }
+            
+            // Record results
+            for (size_t slot = 0; slot < productCount; ++slot) {
+                const string& productId = inventoryAgent.productId(static_cast<int>(slot));
+                recordKpis(static_cast<int>(slot));
+                dayResults[productId + "_inventory"] = to_string(inventoryAgent.getStock(static_cast<int>(slot)));
+                dayResults[productId + "_status"] = lastStatus[slot];
+                dayResults[productId + "_price"] = to_string(pricingAgent.calculateOptimalPrice(static_cast<int>(slot), 0, 0, 0));
+                dayResults[productId + "_sold"] = to_string(sold[slot]);
+                dayResults[productId + "_writeoff"] = to_string(writtenOff[slot]);
+            }
+            
+            results.push_back(dayResults);
+            ++simulationDay;
+        }
+        
+        // Close stockouts still running at the end of the horizon
+        for (int& run : stockoutRun) {
+            if (run > 0) {
+                kpis->stockoutDuration.add(run);
+                run = 0;
+            }
+        }
+        if (eventLog.isOpen()) {
+            eventLog.flush();
+        }
+        return results;
+    }
+
+public:
+
+    // Project one SKU's stock trajectory under overridden parameters. Uses
+    // the SKU's cached baseline forecasts scaled by price elasticity and the
+    // same reorder rule as runSimulation, with one order outstanding at a
+    // time. Reads only this SKU's state.
+    vector<ProjectedDay> projectStock(const string& productId, const WhatIfScenario& scenario) {
+        int slot = inventoryAgent.slotOf(productId);
+        if (slot < 0) {
+            throw out_of_range("Unknown product: " + productId);
+        }
+        const vector<int>& forecasts = baselineForecasts(slot, scenario.horizonDays + kReorderForecastDays,
+                                                         currentDate());
+        int minThreshold = scenario.minThreshold >= 0 ? scenario.minThreshold
+                                                      : inventoryAgent.getThresholds(slot).first;
+        double demandScale = pow(scenario.priceMultiplier, scenario.priceElasticity);
+        int leadTime = supplierAgent.leadTime();
+
+        vector<ProjectedDay> trajectory;
+        int stock = inventoryAgent.getStock(slot);
+        int pendingQty = 0;
+        int arrivalDay = -1;
+        for (int day = 0; day < scenario.horizonDays; ++day) {
+            ProjectedDay projected = {0, 0, 0, 0, 0};
+            if (pendingQty > 0 && day >= arrivalDay) {
+                projected.received = pendingQty;
+                stock += pendingQty;
+                pendingQty = 0;
+            }
+            projected.demand = static_cast<int>(lround(forecasts[day] * demandScale));
+            projected.sold = min(stock, projected.demand);
+            stock -= projected.sold;
+
+            if (stock < minThreshold && pendingQty == 0) {
+                int forecast = static_cast<int>(lround(forecasts[day + kReorderForecastDays] * demandScale));
+                projected.ordered = max(static_cast<int>(forecast * 1.2) - stock, 3);
+                pendingQty = projected.ordered;
+                arrivalDay = day + leadTime;
+            }
+            projected.stock = stock;
+            trajectory.push_back(projected);
+        }
+        return trajectory;
+    }
+
+    // Plan clearance markdowns for every SKU above its max threshold. Weekly
+    // demand comes from the cached forecasts; the per-SKU DPs run on the pool.
+    vector<MarkdownPlan> planMarkdowns(const MarkdownConfig& config = MarkdownConfig()) {
+        if (!MarkdownPlanner::validConfig(config)) {
+            cerr << "Markdown ladder must hold 1-256 ascending discounts in [0, 1)" << endl;
+            return {};
+        }
+        struct Request {
+            int slot;
+            int excess;
+            int regularStock;
+            double basePrice;
+            vector<double> weeklyDemand;
+        };
+        vector<Request> requests;
+        string today = currentDate();
+        auto alerts = inventoryAgent.scanThresholds();
+        vector<int> highSlots;
+        for (const auto& [slot, check] : alerts) {
+            if (check.first == "high") {
+                highSlots.push_back(slot);
+            }
+        }
+        fillBaselineForecasts(highSlots, config.weeks * 7, today);
+        for (const auto& [slot, check] : alerts) {
+            if (check.first != "high") {
+                continue;
+            }
+            const vector<int>& daily = baselineForecasts(slot, config.weeks * 7, today);
+            vector<double> weekly(config.weeks, 0.0);
+            for (int day = 0; day < config.weeks * 7; ++day) {
+                weekly[day / 7] += daily[day];
+            }
+            double basePrice = pricingAgent.calculateOptimalPrice(slot, 0, 0, 0);
+            requests.push_back({slot, check.second, inventoryAgent.getThresholds(slot).second, basePrice, weekly});
+        }
+
+        vector<MarkdownPlan> plans(requests.size());
+        vector<future<void>> pending;
+        size_t chunk = max<size_t>(1, requests.size() / (pool.size() * 4));
+        for (size_t begin = 0; begin < requests.size(); begin += chunk) {
+            size_t end = min(requests.size(), begin + chunk);
+            pending.push_back(pool.submit([this, &requests, &plans, &config, begin, end] {
+                MarkdownPlanner planner;
+                for (size_t i = begin; i < end; ++i) {
+                    const Request& request = requests[i];
+                    plans[i] = planner.plan(inventoryAgent.productId(request.slot), request.excess,
+                                            request.regularStock, request.basePrice, request.weeklyDemand, config);
+                }
+            }));
+        }
+        ThreadPool::waitAll(pending);
+        return plans;
+    }
+
+    // Inputs arriving between planning rounds; each marks its SKUs dirty
+    void applyStockEvents(const vector<StockEvent>& events) {
+        inventoryAgent.applyEvents(events);
+        replan.resize(inventoryAgent.productCount());
+        for (const auto& event : events) {
+            replan.markDirty(event.slot, ReplanTracker::STOCK_CHANGED);
+        }
+        inventoryAgent.recordLotEvents(events, simulationDay);
+    }
+
+    void recordSales(const string& productId, int quantity) {
+        int slot = inventoryAgent.slotOf(productId);
+        if (slot < 0) {
+            return;
+        }
+        int band = inventoryAgent.thresholdBand(slot);
+        inventoryAgent.sellStock(slot, quantity);
+        replan.resize(inventoryAgent.productCount());
+        if (inventoryAgent.thresholdBand(slot) != band) {
+            replan.markDirty(slot, ReplanTracker::NEW_SALES);
+        }
+    }
 
-// Simplified Random Forest Regression model (placeholder)
-class RandomForestRegressor {
-public:
-    void fit(const vector<vector<double>>& X, const vector<int>& y) {
-        // In a real implementation, this would train a model
-        // For this example, we'll just store the data
-        this->X = X;
-        this->y = y;
+    // SKUs waiting to be re-planned
+    size_t pendingReplans() const {
+        return replan.dirtyCount();
     }
 
-    int predict(const vector<double>& features) const {
-        // Simplified prediction - average of similar historical records
-        double sum = 0;
-        int count = 0;
-        
-        for (size_t i = 0; i < X.size(); ++i) {
-            double similarity = 0;
-            for (size_t j = 0; j < features.size(); ++j) {
-                similarity += abs(X[i][j] - features[j]);
+    void updatePrice(const string& productId, double price) {
+        int slot = inventoryAgent.slotOf(productId);
+        if (slot < 0) {
+            return;
+        }
+        pricingAgent.setBasePrice(slot, price);
+        if (static_cast<size_t>(slot) < forecastCache.size()) {
+            forecastCache[slot].days.clear();
+        }
+        replan.resize(inventoryAgent.productCount());
+        replan.markDirty(slot, ReplanTracker::PRICE_CHANGED);
+    }
+
+    // Train one forecaster per store/category on the shared pool, keeping
+    // the estimated training memory in flight under budgetBytes. Forecasts
+    // then use the SKU's segment model instead of the global one. Returns
+    // the number of models trained.
+    size_t trainSegmentModels(size_t budgetBytes) {
+        map<string, TrainingJob> jobsByKey;
+        for (size_t row = 0; row < salesHistory.size(); ++row) {
+            const string& key = productSegment[salesHistory.skus[row]];
+            jobsByKey[key].key = key;
+            jobsByKey[key].rows.push_back(row);
+        }
+        vector<TrainingJob> jobs;
+        for (auto& [key, job] : jobsByKey) {
+            jobs.push_back(move(job));
+        }
+
+        TrainingScheduler scheduler(pool, budgetBytes);
+        segmentModels = scheduler.run(salesHistory.features, salesHistory.quantities, jobs, &calendar);
+        forecastCache.clear();
+        return segmentModels.size();
+    }
+
+    // Retrain only the store/category models that serve the k SKUs whose
+    // forecasts have drifted the most, leaving every other model in place
+    vector<pair<int, double>> retrainDriftingSkus(size_t k, size_t budgetBytes) {
+        auto worst = accuracy.worstSkus(k);
+        set<string> segments;
+        for (const auto& [slot, score] : worst) {
+            segments.insert(productSegment[slot]);
+        }
+
+        map<string, TrainingJob> jobsByKey;
+        for (size_t row = 0; row < salesHistory.size(); ++row) {
+            const string& key = productSegment[salesHistory.skus[row]];
+            if (segments.count(key)) {
+                jobsByKey[key].key = key;
+                jobsByKey[key].rows.push_back(row);
             }
-            if (similarity < 2.0) { // Arbitrary threshold
-                sum += y[i];
-                count++;
+        }
+        vector<TrainingJob> jobs;
+        for (auto& [key, job] : jobsByKey) {
+            jobs.push_back(move(job));
+        }
+
+        TrainingScheduler scheduler(pool, budgetBytes);
+        for (auto& [key, model] : scheduler.run(salesHistory.features, salesHistory.quantities, jobs, &calendar)) {
+            segmentModels[key] = move(model);
+        }
+        for (size_t slot = 0; slot < productSegment.size(); ++slot) {
+            if (segments.count(productSegment[slot])) {
+                accuracy.reset(static_cast<int>(slot));
+                if (slot < forecastCache.size()) {
+                    forecastCache[slot].days.clear();
+                }
             }
         }
-        
-        if (count > 0) {
-            return max(0, static_cast<int>(sum / count));
+        return worst;
+    }
+
+    const ForecastAccuracyMonitor& getForecastAccuracy() const {
+        return accuracy;
+    }
+
+    // KPI distributions accumulated over every runSimulation call
+    SimulationKpis& getKpis() {
+        return *kpis;
+    }
+
+    // Persist the trained global forecaster, or swap in one saved earlier
+    bool saveForecastModel(const string& path) const {
+        return demandAgent.saveModel(path);
+    }
+
+    bool loadForecastModel(const string& path) {
+        if (!demandAgent.loadModel(path)) {
+            return false;
         }
-        return 10; // Default prediction
+        forecastCache.clear();
+        return true;
+    }
+
+    const InventoryMonitoringAgent& getInventory() const {
+        return inventoryAgent;
+    }
+
+    const SalesHistory& getSalesHistory() const {
+        return salesHistory;
+    }
+
+    CalendarFeatureTable& getCalendar() {
+        return calendar;
+    }
+
+    // Score the forecaster on the sales history; results are indexed like
+    // the products passed to initializeSystem
+    vector<SkuAccuracy> backtestForecaster(const BacktestConfig& config = BacktestConfig()) {
+        BacktestEngine engine(salesHistory, pool);
+        return engine.run(config);
     }
 
 private:
-    vector<vector<double>> X;
-    vector<int> y;
-};
+    static constexpr int kReorderForecastDays = 7; // reorders size against next week's forecast
 
-class DemandForecastingAgent {
-public:
-    DemandForecastingAgent() = default;
+    // Daily demand forecasts for one SKU at its current price, starting today
+    struct ForecastCacheEntry {
+        string startDate;
+        vector<int> days;
+    };
 
-    void trainModel(const vector<map<string, double>>& salesData) {
-        vector<vector<double>> X;
-        vector<int> y;
-        
-        for (const auto& record : salesData) {
-            vector<double> features = {
-                record.at("day_of_week"),
-                record.at("month"),
-                record.at("is_weekend"),
-                record.at("price"),
-                record.at("promotion")
-            };
-            X.push_back(features);
-            y.push_back(static_cast<int>(record.at("quantity")));
+    ThreadPool pool;
+    EventLogWriter eventLog;
+    int simulationDay = 0; // days since initializeSystem, used to age lots
+    vector<int> baseDemand; // true mean daily demand per SKU slot
+    unique_ptr<SimulationKpis> kpis = make_unique<SimulationKpis>(); // fixed-size sketches
+    vector<int> stockoutRun;
+    ForecastAccuracyMonitor accuracy;
+    vector<string> productSegment; // "store/category" per SKU slot
+    map<string, unique_ptr<DemandForecastingAgent>> segmentModels;
+    ReplanTracker replan;
+    vector<string> lastStatus;
+    vector<ForecastCacheEntry> forecastCache;
+
+    void recordKpis(int slot) {
+        int stock = inventoryAgent.getStock(slot);
+        kpis->daysOfCover.add(static_cast<double>(stock) / max(1, baseDemand[slot]));
+        kpis->price.add(pricingAgent.calculateOptimalPrice(slot, 0, 0, 0));
+        if (stock == 0) {
+            ++stockoutRun[slot];
+        } else if (stockoutRun[slot] > 0) {
+            kpis->stockoutDuration.add(stockoutRun[slot]);
+            stockoutRun[slot] = 0;
         }
-        
-        model.fit(X, y);
     }
 
-    int predictDemand(const map<string, double>& productInfo, const string& futureDate) const {
-        vector<double> features = {
-            static_cast<double>(getDayOfWeek(futureDate)),
-            static_cast<double>(getMonth(futureDate)),
-            (getDayOfWeek(futureDate) == 0 || getDayOfWeek(futureDate) == 6) ? 1.0 : 0.0,
-            productInfo.at("price"),
-            productInfo.at("promotion")
-        };
-        return model.predict(features);
+    // Forecast SKU slots for one date with their segment models when
+    // trained, otherwise with the global forecaster. Slots sharing a model
+    // are predicted in one batch.
+    vector<int> forecastSlots(const vector<int>& slots, const vector<double>& prices, const string& date) const {
+        vector<double> promotions(slots.size(), 0);
+        if (segmentModels.empty()) {
+            return demandAgent.predictDemandForSkus(slots, prices, promotions, date);
+        }
+        map<const DemandForecastingAgent*, vector<size_t>> byModel;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            auto it = segmentModels.find(productSegment[slots[i]]);
+            byModel[it != segmentModels.end() ? it->second.get() : &demandAgent].push_back(i);
+        }
+        vector<int> forecasts(slots.size());
+        for (const auto& [model, members] : byModel) {
+            vector<int> groupSlots;
+            vector<double> groupPrices;
+            for (size_t i : members) {
+                groupSlots.push_back(slots[i]);
+                groupPrices.push_back(prices[i]);
+            }
+            vector<int> predicted = model->predictDemandForSkus(groupSlots, groupPrices,
+                                                                vector<double>(members.size(), 0), date);
+            for (size_t k = 0; k < members.size(); ++k) {
+                forecasts[members[k]] = predicted[k];
+            }
+        }
+        return forecasts;
     }
 
-private:
-    RandomForestRegressor model;
+    // Daily demand process shared by the history generator and the simulator
+    static int drawDemand(int baseSales, const CalendarRow& day) {
+        double dayFactor = day.isWeekend ? 1.5 : 1.0;
+        double monthFactor = (day.month == 11 || day.month == 12) ? 1.2 : 1.0;
+        double calendarFactor = !day.eventName.empty() ? 2.0 : day.isHoliday ? 0.6 : 1.0; // sale events vs closures
+        return static_cast<int>(baseSales * dayFactor * monthFactor * calendarFactor * randomDouble(0.8, 1.2));
+    }
+
+    const vector<int>& baselineForecasts(int slot, int days, const string& today) {
+        fillBaselineForecasts({slot}, days, today);
+        return forecastCache[slot].days;
+    }
+
+    // Bring the cached daily forecasts of these slots up to days from
+    // today. Stale slots are forecast together, one batch per date.
+    void fillBaselineForecasts(const vector<int>& slots, int days, const string& today) {
+        vector<int> stale;
+        vector<double> prices;
+        for (int slot : slots) {
+            if (static_cast<size_t>(slot) >= forecastCache.size()) {
+                forecastCache.resize(slot + 1);
+            }
+            ForecastCacheEntry& entry = forecastCache[slot];
+            if (entry.startDate == today && static_cast<int>(entry.days.size()) >= days) {
+                continue;
+            }
+            entry.startDate = today;
+            entry.days.clear();
+            entry.days.reserve(days);
+            stale.push_back(slot);
+            prices.push_back(pricingAgent.calculateOptimalPrice(slot, 0, 0, 0));
+        }
+        if (stale.empty()) {
+            return;
+        }
+
+        int first = calendar.indexOf(today);
+        for (int day = 0; day < days; ++day) {
+            string date = (first >= 0 && first + day < static_cast<int>(calendar.size()))
+                              ? calendar.dateAt(first + day)
+                              : addDaysToDate(today, day);
+            vector<int> forecasts = forecastSlots(stale, prices, date);
+            for (size_t i = 0; i < stale.size(); ++i) {
+                forecastCache[stale[i]].days.push_back(forecasts[i]);
+            }
+        }
+    }
+    SalesHistory salesHistory;
+    CalendarFeatureTable calendar;
+    DemandForecastingAgent demandAgent;
+    InventoryMonitoringAgent inventoryAgent;
+    PricingOptimizationAgent pricingAgent;
+    SupplierCoordinationAgent supplierAgent;
 };
 
-class InventoryMonitoringAgent {
-public:
-    void updateInventory(const string& productId, int quantity) {
-        inventory[productId] += quantity;
+// Behavioral checks of the core data structures against simple reference
+// computations. Run with --self-check; any failure makes the exit code 1.
+bool runSelfChecks() {
+    int failures = 0;
+    auto check = [&failures](bool ok, const string& name) {
+        cout << (ok ? "ok    " : "FAIL  ") << name << endl;
+        if (!ok) {
+            ++failures;
+        }
+    };
+
+    {
+        // Concurrent register streams must sum exactly per SKU
+        const int numSkus = 1000;
+        const int numStreams = 4;
+        InventoryMonitoringAgent agent;
+        for (int i = 0; i < numSkus; ++i) {
+            agent.registerProduct("SKU" + to_string(i));
+        }
+        vector<vector<StockEvent>> streams(numStreams);
+        vector<int> expected(numSkus, 0);
+        mt19937 gen(42);
+        for (auto& stream : streams) {
+            for (int i = 0; i < 20000; ++i) {
+                StockEvent event = {static_cast<int>(gen() % numSkus), static_cast<int>(gen() % 11) - 5};
+                expected[event.slot] += event.delta;
+                stream.push_back(event);
+            }
+        }
+        vector<thread> registers;
+        for (const auto& stream : streams) {
+            registers.emplace_back([&agent, &stream] { agent.applyEvents(stream); });
+        }
+        for (auto& worker : registers) {
+            worker.join();
+        }
+        bool exact = true;
+        for (int i = 0; i < numSkus; ++i) {
+            exact = exact && agent.getStock(i) == expected[i] && agent.getStock("SKU" + to_string(i)) == expected[i];
+        }
+        check(exact, "ledger: concurrent event streams sum exactly");
+        check(agent.getStock("missing") == 0 && agent.slotOf("missing") < 0, "ledger: unknown id reads as empty");
     }
 
-    void setThresholds(const string& productId, int minThreshold, int maxThreshold) {
-        thresholds[productId] = make_pair(minThreshold, maxThreshold);
+    {
+        // Lot-tracked receipts, sales and expiry keep the ledger equal to
+        // the lots, and nothing on hand outlives its shelf life
+        const int numSkus = 50;
+        const int shelfLife = 6;
+        InventoryMonitoringAgent agent;
+        for (int i = 0; i < numSkus; ++i) {
+            agent.registerProduct("SKU" + to_string(i));
+            agent.setShelfLife(i, i % 2 == 0 ? shelfLife : 0);
+        }
+        mt19937 gen(11);
+        bool consistent = true;
+        for (int day = 0; day < 40; ++day) {
+            for (int i = 0; i < numSkus; ++i) {
+                if (gen() % 3 != 0) {
+                    agent.receiveStock(i, static_cast<int>(gen() % 20), day);
+                }
+                agent.sellStock(i, static_cast<int>(gen() % 15));
+            }
+            agent.expireLots(day);
+            for (int i = 0; i < numSkus; ++i) {
+                consistent = consistent && agent.getStock(i) == agent.lotStock(i) && agent.getStock(i) >= 0;
+                consistent = consistent && (i % 2 != 0 || agent.stockAge(i, day) < shelfLife);
+            }
+        }
+        check(consistent, "lots: ledger matches lots and expiry holds");
+
+        // A receipt into a full ring keeps its own day
+        InventoryMonitoringAgent full;
+        int slot = full.registerProduct("SKU");
+        for (int day = 0; day <= LotStore::kLotsPerSku; ++day) {
+            full.receiveStock(slot, 1, day);
+        }
+        full.sellStock(slot, LotStore::kLotsPerSku);
+        check(full.getStock(slot) == 1 && full.stockAge(slot, LotStore::kLotsPerSku) == 0,
+              "lots: full ring keeps the newest receipt day");
     }
 
-    pair<string, int> checkInventory(const string& productId) const {
-        int current = inventory.at(productId);
-        auto [min_thresh, max_thresh] = thresholds.at(productId);
-        
-        if (current < min_thresh) {
-            return {"low", max_thresh - current};
-        } else if (current > max_thresh) {
-            return {"high", current - max_thresh};
+    {
+        // A saved forest maps back with identical predictions; corrupt
+        // child or root indices are rejected instead of read out of bounds
+        FeatureMatrix X(5);
+        vector<int> y;
+        mt19937 gen(7);
+        for (int i = 0; i < 2000; ++i) {
+            double price = 5 + gen() % 95;
+            double weekend = gen() % 2;
+            double* row = X.addRow();
+            row[0] = gen() % 7;
+            row[1] = 1 + gen() % 12;
+            row[2] = weekend;
+            row[3] = price;
+            row[4] = gen() % 2;
+            y.push_back(static_cast<int>(400 / price * (1 + 0.5 * weekend)));
         }
-        return {"ok", 0};
+        RandomForestRegressor forest(20, 6, 5);
+        forest.fit(X, y);
+        const string path = "self-check-model.bin";
+        RandomForestRegressor loaded;
+        bool same = forest.save(path) && loaded.load(path);
+        for (size_t i = 0; same && i < X.rows(); ++i) {
+            vector<double> row(X.row(i), X.row(i) + X.width);
+            same = forest.predict(row) == loaded.predict(row);
+        }
+        check(same, "model: save/load round trip predicts identically");
+
+        ifstream in(path, ios::binary);
+        string bytes((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        in.close();
+        ModelFileHeader header;
+        memcpy(&header, bytes.data(), sizeof(header));
+        auto rejects = [&](size_t offset, int32_t value) {
+            string corrupt = bytes;
+            memcpy(&corrupt[offset], &value, sizeof(value));
+            ofstream(path, ios::binary | ios::trunc).write(corrupt.data(), static_cast<streamsize>(corrupt.size()));
+            RandomForestRegressor victim;
+            return !victim.load(path);
+        };
+        check(rejects(header.rootsOffset, static_cast<int32_t>(header.nodeCount)) &&
+              rejects(header.nodesOffset + offsetof(TreeNode, left), 1 << 30) &&
+              rejects(header.nodesOffset + offsetof(TreeNode, right), 0) &&
+              rejects(header.nodesOffset + offsetof(TreeNode, feature), 99),
+              "model: corrupt indices are rejected on load");
+        remove(path.c_str());
+
+        // Trees grown on a pool are the ones a serial fit grows from the
+        // same seed
+        vector<size_t> allRows(X.rows());
+        iota(allRows.begin(), allRows.end(), 0);
+        RandomForestRegressor serial(20, 6, 5), parallel(20, 6, 5);
+        serial.fit(X, y, allRows, 11);
+        {
+            ThreadPool pool(2);
+            parallel.fit(X, y, allRows, 11, &pool);
+        }
+        bool identical = serial.nodeCount() == parallel.nodeCount() &&
+                         equal(serial.roots(), serial.roots() + serial.treeCount(), parallel.roots());
+        for (size_t i = 0; identical && i < serial.nodeCount(); ++i) {
+            const TreeNode& a = serial.nodes()[i];
+            const TreeNode& b = parallel.nodes()[i];
+            identical = a.feature == b.feature && a.threshold == b.threshold && a.left == b.left &&
+                        a.right == b.right && a.value == b.value;
+        }
+        check(identical, "model: pooled tree growth matches serial");
     }
 
-    map<string, int> inventory;
-    map<string, pair<int, int>> thresholds;
-};
+    {
+        // The markdown DP's ladder scores within 1% of the best of every
+        // non-decreasing ladder; an empty ladder yields no plan
+        MarkdownConfig config;
+        config.weeks = 5;
+        config.discountLevels = {0.0, 0.15, 0.3, 0.5};
+        vector<double> weekly = {9, 12, 8, 15, 10};
+        const int excess = 40, regular = 20;
+        const double basePrice = 30;
+        auto evaluate = [&](const vector<size_t>& ladder) {
+            double units = excess, revenue = 0;
+            for (int w = 0; w < config.weeks; ++w) {
+                double discount = config.discountLevels[ladder[w]];
+                double sold = MarkdownPlanner::excessSold(units, regular,
+                                                          weekly[w] * pow(1.0 - discount, config.priceElasticity));
+                revenue += basePrice * (1.0 - discount) * sold;
+                units -= sold;
+            }
+            return revenue + config.salvageRate * basePrice * units;
+        };
+        double best = 0;
+        vector<size_t> ladder(config.weeks, 0);
+        function<void(int, size_t)> enumerate = [&](int week, size_t minLevel) {
+            if (week == config.weeks) {
+                best = max(best, evaluate(ladder));
+                return;
+            }
+            for (size_t level = minLevel; level < config.discountLevels.size(); ++level) {
+                ladder[week] = level;
+                enumerate(week + 1, level);
+            }
+        };
+        enumerate(0, 0);
 
-class PricingOptimizationAgent {
-public:
-    void setBasePrice(const string& productId, double basePrice) {
-        priceStrategies[productId]["base_price"] = basePrice;
+        MarkdownPlan plan = MarkdownPlanner().plan("SKU", excess, regular, basePrice, weekly, config);
+        vector<size_t> chosen;
+        for (double discount : plan.weeklyDiscount) {
+            chosen.push_back(static_cast<size_t>(find(config.discountLevels.begin(), config.discountLevels.end(),
+                                                      discount) - config.discountLevels.begin()));
+        }
+        bool nearOptimal = chosen.size() == weekly.size() && evaluate(chosen) >= 0.99 * best;
+        config.discountLevels.clear();
+        MarkdownPlan rejected = MarkdownPlanner().plan("SKU", excess, regular, basePrice, weekly, config);
+        check(nearOptimal && rejected.weeklyDiscount.empty() && rejected.expectedLeftover == excess,
+              "markdown: DP ladder matches exhaustive search");
     }
 
-    double calculateOptimalPrice(const string& productId, int demandForecast, int currentInventory, int daysInStock) const {
-        double basePrice = priceStrategies.at(productId).at("base_price");
-        
-        if (daysInStock > 30) { // Slow-moving
-            return basePrice * 0.8; // 20% discount
-        } else if (daysInStock > 60) { // Very slow-moving
-            return basePrice * 0.7; // 30% discount
-        } else if (currentInventory < demandForecast * 0.5) { // Potential stockout
-            return basePrice * 1.1; // 10% increase
+    {
+        // Small two-valued samples only ever report values that occurred,
+        // and quantiles of a skewed sample stay within rank error bounds
+        // whether the digest is compressed or still buffering
+        TDigest prices;
+        for (double price : {20, 50, 50, 20, 50, 20, 50}) {
+            prices.add(price);
         }
-        return basePrice;
+        bool observed = true;
+        for (double q = 0; q <= 1; q += 0.05) {
+            double value = prices.quantile(q);
+            observed = observed && (value == 20 || value == 50);
+        }
+        check(observed && prices.quantile(0.5) == 50 && prices.quantile(0) == 20 && prices.quantile(1) == 50,
+              "t-digest: singleton centroids are not interpolated");
+
+        TDigest digest;
+        vector<double> values;
+        mt19937 gen(5);
+        lognormal_distribution<double> skewed(0, 1);
+        for (int i = 0; i < 100000; ++i) {
+            values.push_back(skewed(gen));
+            digest.add(values.back());
+        }
+        sort(values.begin(), values.end());
+        bool bounded = true;
+        for (double q : {0.001, 0.01, 0.1, 0.5, 0.9, 0.99, 0.999}) {
+            double buffered = digest.quantile(q);
+            double rank = (lower_bound(values.begin(), values.end(), buffered) - values.begin()) /
+                          static_cast<double>(values.size());
+            bounded = bounded && fabs(rank - q) <= 0.01 * min(q, 1 - q) + 0.001;
+            TDigest compressed = digest;
+            compressed.compress();
+            bounded = bounded && compressed.quantile(q) == buffered;
+        }
+        check(bounded, "t-digest: quantile rank error within bounds");
+
+        // Merging per-part accumulators keeps the combined stream's exact
+        // extremes and its quantiles within the same rank error
+        vector<KpiAccumulator> parts(4);
+        for (size_t i = 0; i < values.size(); ++i) {
+            parts[i % 4].add(values[(i * 7919) % values.size()]);
+        }
+        KpiAccumulator merged;
+        for (const auto& part : parts) {
+            merged.merge(part);
+        }
+        bool mergedBounded = merged.getCount() == static_cast<long long>(values.size()) &&
+                             merged.quantile(0) == values.front() && merged.quantile(1) == values.back();
+        for (double q : {0.001, 0.01, 0.1, 0.5, 0.9, 0.99, 0.999}) {
+            double rank = (lower_bound(values.begin(), values.end(), merged.quantile(q)) - values.begin()) /
+                          static_cast<double>(values.size());
+            mergedBounded = mergedBounded && fabs(rank - q) <= 0.01 * min(q, 1 - q) + 0.001;
+        }
+        check(mergedBounded, "t-digest: merged digests match the combined stream");
     }
 
-private:
-    map<string, map<string, double>> priceStrategies;
-};
+    {
+        // A catalog file that repeats an id is rejected; repeated rows handed
+        // to registerCatalog keep the first row and per-slot data by slot
+        const string path = "self-check-catalog.csv";
+        ofstream(path) << "id,base_price,base_demand,initial_stock,min_threshold,max_threshold\n"
+                       << "A,10,100,50,5,200\nA,10,100,50,5,200\nB,20,3,7,1,20\n";
+        ThreadPool pool(2);
+        ProductCatalog loaded;
+        bool rejected = !CatalogLoader::loadCsv(path, loaded, pool) && loaded.size() == 0;
+        remove(path.c_str());
 
-class SupplierCoordinationAgent {
-public:
-    void registerSupplier(const string& supplierId, int leadTime, int minOrderQuantity) {
-        suppliers[supplierId] = {leadTime, minOrderQuantity};
+        ProductCatalog catalog;
+        for (const char* id : {"A", "A", "B"}) {
+            bool isA = string(id) == "A";
+            catalog.append(map<string, string>{
+                {"id", id}, {"base_price", isA ? "10" : "20"}, {"base_demand", isA ? "100" : "3"},
+                {"initial_stock", isA ? "50" : "7"}, {"min_threshold", "1"}, {"max_threshold", "200"}});
+        }
+        RetailEnvironment env;
+        env.registerCatalog(catalog);
+        SalesHistory history = env.generateSalesData(30);
+        double bSales = 0;
+        for (size_t row = 0; row < history.size(); ++row) {
+            bSales += history.skus[row] == 1 ? history.quantities[row] : 0;
+        }
+        const InventoryMonitoringAgent& inventory = env.getInventory();
+        check(rejected && inventory.productCount() == 2 && inventory.getStock("A") == 50 &&
+              inventory.getStock("B") == 7 && history.size() == 60 && bSales / 30 < 10,
+              "catalog: duplicate ids are rejected or skipped");
     }
 
-    pair<bool, string> placeOrder(const string& productId, int quantity) {
-        if (suppliers.empty()) {
-            return {false, "No suppliers registered"};
+    {
+        // Without decay the streaming monitor reports the backtest's metrics
+        ForecastAccuracyMonitor monitor(1.0);
+        monitor.resize(1);
+        SkuAccuracy backtest;
+        mt19937 gen(3);
+        for (int i = 0; i < 200; ++i) {
+            double actual = 5 + gen() % 20;
+            double forecast = actual * 1.1 + static_cast<double>(gen() % 5) - 2;
+            monitor.recordActual(0, forecast, actual);
+            backtest.add(forecast, actual);
         }
-        
-        // For simplicity, use the first supplier
-        auto& [leadTime, minOrderQty] = suppliers.begin()->second;
-        return {true, "Order placed with " + suppliers.begin()->first + 
-                      ". Expected delivery in " + to_string(leadTime) + " days."};
+        check(fabs(monitor.bias(0) - backtest.bias()) < 1e-9 && fabs(monitor.wape(0) - backtest.wape()) < 1e-9,
+              "accuracy: monitor and backtest share bias and WAPE");
     }
 
-private:
-    map<string, pair<int, int>> suppliers; // supplierId -> (leadTime, minOrderQuantity)
-};
+    {
+        // A backtest config with a non-positive length is refused instead of
+        // looping forever or dividing by zero
+        ProductCatalog catalog;
+        catalog.append(map<string, string>{{"id", "A"}, {"base_price", "10"}, {"base_demand", "20"},
+                                           {"initial_stock", "50"}, {"min_threshold", "1"}, {"max_threshold", "200"}});
+        RetailEnvironment env;
+        env.registerCatalog(catalog);
+        SalesHistory history = env.generateSalesData(70);
+        ThreadPool pool(2);
+        BacktestEngine engine(history, pool);
+        bool refused = true;
+        for (int field = 0; field < 4; ++field) {
+            BacktestConfig config;
+            int* lengths[] = {&config.initialTrainDays, &config.horizonDays, &config.stepDays, &config.skuPartitions};
+            *lengths[field] = 0;
+            refused = refused && engine.run(config).empty();
+        }
+        check(refused && engine.run(BacktestConfig()).size() == 1, "backtest: non-positive lengths are refused");
+    }
 
-class RetailEnvironment {
-public:
-    RetailEnvironment() = default;
+    {
+        // Sales that leave every SKU between its thresholds replan nothing;
+        // one that drops a SKU below min_threshold replans just that SKU
+        ProductCatalog catalog;
+        for (int i = 0; i < 50; ++i) {
+            catalog.append(map<string, string>{{"id", "Q" + to_string(i)}, {"base_price", "10"}, {"base_demand", "5"},
+                                               {"initial_stock", "100"}, {"min_threshold", "10"},
+                                               {"max_threshold", "200"}});
+        }
+        RetailEnvironment env;
+        env.registerCatalog(catalog);
+        for (int i = 0; i < 50; ++i) {
+            env.recordSales("Q" + to_string(i), 5);
+        }
+        size_t quiet = env.pendingReplans();
+        env.recordSales("Q7", 90);
+        check(quiet == 0 && env.pendingReplans() == 1, "replan: quiet sales leave SKUs clean");
+    }
 
-    void initializeSystem(const vector<map<string, string>>& products) {
-        // Generate synthetic sales data for demonstration
-        auto salesData = generateSalesData(products);
-        demandAgent.trainModel(salesData);
-        
-        // Set initial inventory levels and thresholds
-        for (const auto& product : products) {
-            inventoryAgent.updateInventory(product.at("id"), stoi(product.at("initial_stock")));
-            inventoryAgent.setThresholds(product.at("id"), 
-                                      stoi(product.at("min_threshold")), 
-                                      stoi(product.at("max_threshold")));
-            pricingAgent.setBasePrice(product.at("id"), stod(product.at("base_price")));
+    {
+        // A Poisson mean of about 0.75 units rounds to 1 rather than
+        // truncating to 0, and the single-row path uses the same SKU model
+        SalesHistory history;
+        history.features = FeatureMatrix(DemandForecastingAgent::featureCount());
+        CalendarFeatureTable calendar;
+        for (int day = 0; day < 400; ++day) {
+            double* row = history.addRow(day, 0, day % 4 != 0);
+            DemandForecastingAgent::fillFeatures(calendar.lookup(addDaysToDate("2026-01-01", day)), 10.0, 0.0, row);
         }
-        
-        // Register a sample supplier
-        supplierAgent.registerSupplier("SUP-001", 3, 10);
+        DemandForecastingAgent agent;
+        agent.setModelType(ForecastModelType::PoissonGlm);
+        agent.trainModel(history);
+        const string date = "2027-03-10";
+        int batched = agent.predictDemandForSkus({0}, {10.0}, {0.0}, date)[0];
+        int single = agent.predictDemand({{"price", 10.0}, {"promotion", 0.0}}, date, 0);
+        check(batched == 1 && single == batched, "poisson: forecasts round and match the single-row path");
     }
 
-    vector<map<string, double>> generateSalesData(const vector<map<string, string>>& products, int days = 90) {
-        vector<map<string, double>> data;
-        string startDate = currentDate();
-        
-        for (int day = 0; day < days; ++day) {
-            string date = addDaysToDate(startDate, -days + day);
-            for (const auto& product : products) {
-                // Simulate sales with some seasonality
-                int baseSales = stoi(product.at("base_demand"));
-                double dayFactor = (getDayOfWeek(date) == 0 || getDayOfWeek(date) == 6) ? 1.5 : 1.0;
-                double monthFactor = (getMonth(date) == 11 || getMonth(date) == 12) ? 1.2 : 1.0;
-                
-                int sales = static_cast<int>(baseSales * dayFactor * monthFactor * randomDouble(0.8, 1.2));
-                
-                map<string, double> record = {
-                    {"date", 0}, // Placeholder, we'll use the date string separately
-                    {"product_id", 0}, // Placeholder
-                    {"quantity", static_cast<double>(sales)},
-                    {"price", stod(product.at("base_price"))},
-                    {"promotion", static_cast<double>(randomInt(0, 1))},
-                    {"day_of_week", static_cast<double>(getDayOfWeek(date))},
-                    {"month", static_cast<double>(getMonth(date))},
-                    {"is_weekend", (getDayOfWeek(date) == 0 || getDayOfWeek(date) == 6) ? 1.0 : 0.0}
-                };
-                data.push_back(record);
-            }
+    {
+        // A failing task must not unwind the caller while siblings still run
+        ThreadPool pool(2);
+        atomic<int> finished{0};
+        vector<future<void>> pending;
+        pending.push_back(pool.submit([] { throw runtime_error("task failed"); }));
+        for (int i = 0; i < 4; ++i) {
+            pending.push_back(pool.submit([&finished] {
+                this_thread::sleep_for(chrono::milliseconds(20));
+                ++finished;
+            }));
         }
-        
-        return data;
+        bool threw = false;
+        try {
+            ThreadPool::waitAll(pending);
+        } catch (const runtime_error&) {
+            threw = true;
+        }
+        check(threw && finished == 4, "pool: waitAll drains every task before rethrowing");
     }
 
-    vector<map<string, string>> runSimulation(int days = 30) {
-        vector<map<string, string>> results;
-        string currentDateStr = currentDate();
-        
-        for (int day = 0; day < days; ++day) {
-            string simDate = addDaysToDate(currentDateStr, day);
-            map<string, string> dayResults;
-            dayResults["date"] = simDate;
-            
-            // Check inventory for all products
-            for (const auto& [productId, _] : inventoryAgent.inventory) {
-                auto [status, quantity] = inventoryAgent.checkInventory(productId);
-                
-                if (status == "low") {
-                    // Get demand forecast for next week
-                    int forecast = demandAgent.predictDemand(
-                        {{"price", pricingAgent.calculateOptimalPrice(productId, 0, 0, 0)},
-                         {"promotion", 0}},
-                        addDaysToDate(simDate, 7)
-                    );
-                    
-                    // Calculate order quantity
-                    int orderQty = max(forecast * 1.2 - inventoryAgent.inventory[productId], 3); // Simplified min order
-                    
-                    // Place order
-                    auto [success, orderStatus] = supplierAgent.placeOrder(productId, orderQty);
-                    
-                    // Update inventory (simulating delivery after lead time)
-                    if (success && day > 3) { // Simplified lead time
-                        inventoryAgent.updateInventory(productId, orderQty);
-                    }
-                } else if (status == "high") {
-                    // Adjust price to clear excess inventory
-                    int daysInStock = randomInt(15, 60);
-                    double newPrice = pricingAgent.calculateOptimalPrice(
-                        productId, 
-                        10, // Simplified forecast
-                        inventoryAgent.inventory[productId],
-                        daysInStock
-                    );
-                    
-                    // Update price strategy
-                    pricingAgent.setBasePrice(productId, newPrice);
-                }
-                
-                // Record results
-                dayResults[productId + "_inventory"] = to_string(inventoryAgent.inventory[productId]);
-                dayResults[productId + "_status"] = status;
-                dayResults[productId + "_price"] = to_string(pricingAgent.calculateOptimalPrice(productId, 0, 0, 0));
-            }
-            
-            results.push_back(dayResults);
+    {
+        // A worker runs outside submissions in order, and a job that throws
+        // still hands its memory back to the budget
+        ThreadPool pool(1);
+        vector<int> order;
+        vector<future<void>> pending;
+        for (int i = 0; i < 8; ++i) {
+            pending.push_back(pool.submit([&order, i] { order.push_back(i); }));
         }
-        
-        return results;
+        ThreadPool::waitAll(pending);
+        vector<int> expected(8);
+        iota(expected.begin(), expected.end(), 0);
+
+        MemoryBudget budget(100);
+        budget.acquire(100);
+        pending.push_back(pool.submit([&budget] {
+            MemoryBudget::Reservation reservation(budget, 100);
+            throw runtime_error("training failed");
+        }));
+        try {
+            ThreadPool::waitAll(pending);
+        } catch (const runtime_error&) {
+        }
+        auto reacquired = async(launch::async, [&budget] { budget.acquire(100); });
+        bool released = reacquired.wait_for(chrono::seconds(1)) == future_status::ready;
+        if (!released) {
+            budget.release(100);
+        }
+        check(order == expected && released, "pool: FIFO order and budget released on failure");
     }
 
-private:
-    DemandForecastingAgent demandAgent;
-    InventoryMonitoringAgent inventoryAgent;
-    PricingOptimizationAgent pricingAgent;
-    SupplierCoordinationAgent supplierAgent;
-};
+    {
+        // Training estimates follow the forest's own limits, and scheduling
+        // from a worker of the same pool is refused rather than deadlocking
+        RandomForestRegressor shallow(5, 3, 5), deep(20, 6, 5);
+        size_t rows = 1000, features = DemandForecastingAgent::featureCount();
+        bool scaled = shallow.trainingBytes(rows, features) + 2 * (20 * 127 - 5 * 15) * sizeof(TreeNode) ==
+                      deep.trainingBytes(rows, features) &&
+                      DemandForecastingAgent().trainingBytes(rows) == deep.trainingBytes(rows, features);
+
+        ThreadPool pool(1);
+        TrainingScheduler scheduler(pool, 1 << 20);
+        FeatureMatrix X(features);
+        vector<int> y;
+        auto nested = pool.submit([&] { scheduler.run(X, y, {}, nullptr); });
+        bool refused = false;
+        try {
+            nested.get();
+        } catch (const logic_error&) {
+            refused = true;
+        }
+        check(scaled && refused, "pool: training estimates follow the forest and nested runs are refused");
+    }
+
+    {
+        // Rows computed on demand for dates outside the table match built rows
+        CalendarFeatureTable built, unbuilt;
+        built.build("2030-01-01", 365);
+        bool same = true;
+        for (int i = 0; i < 365; ++i) {
+            const CalendarRow& a = built.lookup(built.dateAt(i));
+            const CalendarRow& b = unbuilt.lookup(built.dateAt(i));
+            same = same && a.dayOfWeek == b.dayOfWeek && a.month == b.month && a.isWeekend == b.isWeekend &&
+                   a.isHoliday == b.isHoliday && a.eventName == b.eventName;
+        }
+        const CalendarRow& christmas = unbuilt.lookup("2030-12-25");
+        check(same && christmas.isHoliday && &christmas == &unbuilt.lookup("2030-12-25") &&
+              unbuilt.lookup("2030-11-28").isHoliday && unbuilt.lookup("2030-11-29").eventName == "black_friday",
+              "calendar: on-demand rows match the built table");
+    }
+
+    return failures == 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--self-check") {
+        return runSelfChecks() ? 0 : 1;
+    }
+    bool backtest = false;
+    bool poissonModel = false;
+    bool markdowns = false;
+    size_t segmentBudget = 0;
+    size_t retrainCount = 0;
+    string recordPath, replayPath, catalogPath, saveModelPath, loadModelPath, whatIfSku;
+    WhatIfScenario whatIf;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        backtest = backtest || arg == "--backtest";
+        poissonModel = poissonModel || arg == "--poisson";
+        markdowns = markdowns || arg == "--markdowns";
+        if (arg == "--seed" && i + 1 < argc) {
+            seedRandom(static_cast<unsigned>(stoul(argv[++i])));
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (arg == "--catalog" && i + 1 < argc) {
+            catalogPath = argv[++i];
+        } else if (arg == "--save-model" && i + 1 < argc) {
+            saveModelPath = argv[++i];
+        } else if (arg == "--load-model" && i + 1 < argc) {
+            loadModelPath = argv[++i];
+        } else if (arg == "--what-if" && i + 1 < argc) {
+            whatIfSku = argv[++i];
+        } else if (arg == "--price-multiplier" && i + 1 < argc) {
+            whatIf.priceMultiplier = stod(argv[++i]);
+        } else if (arg == "--min-threshold" && i + 1 < argc) {
+            whatIf.minThreshold = stoi(argv[++i]);
+        } else if (arg == "--horizon" && i + 1 < argc) {
+            whatIf.horizonDays = stoi(argv[++i]);
+        } else if (arg == "--segment-models" && i + 1 < argc) {
+            segmentBudget = stoull(argv[++i]) << 20;
+        } else if (arg == "--retrain-drifting" && i + 1 < argc) {
+            retrainCount = stoull(argv[++i]);
+        }
+    }
 
-int main() {
     // Sample product data
     vector<map<string, string>> products = {
         {
@@ -354,10 +3970,74 @@ int main() {
     
     // Initialize the retail environment
     RetailEnvironment env;
-    env.initializeSystem(products);
+    if (poissonModel) {
+        env.setForecastModel(ForecastModelType::PoissonGlm);
+    }
+    if (catalogPath.empty()) {
+        env.initializeSystem(products);
+    } else {
+        ProductCatalog catalog;
+        if (!env.loadCatalog(catalogPath, catalog)) {
+            return 1;
+        }
+        env.initializeSystem(catalog);
+    }
+    if (!loadModelPath.empty() && !env.loadForecastModel(loadModelPath)) {
+        return 1;
+    }
+    if (!saveModelPath.empty() && !env.saveForecastModel(saveModelPath)) {
+        return 1;
+    }
+    if (segmentBudget > 0) {
+        // e.g. --segment-models 64 trains per store/category with 64 MB in flight
+        auto start = chrono::steady_clock::now();
+        size_t trained = env.trainSegmentModels(segmentBudget);
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Trained " << trained << " segment models in " << millis << " ms" << endl;
+    }
+    
+    if (!whatIfSku.empty()) {
+        // e.g. --what-if P001 --price-multiplier 0.9
+        vector<ProjectedDay> trajectory;
+        auto start = chrono::steady_clock::now();
+        try {
+            trajectory = env.projectStock(whatIfSku, whatIf);
+        } catch (const out_of_range& error) {
+            cerr << error.what() << endl;
+            return 1;
+        }
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+        cout << "\nProjected stock for " << whatIfSku << " at " << whatIf.priceMultiplier
+             << "x price (" << micros << " us):" << endl;
+        cout << setw(5) << "day" << setw(8) << "demand" << setw(8) << "sold" << setw(10) << "received"
+             << setw(9) << "ordered" << setw(8) << "stock" << endl;
+        for (size_t day = 0; day < trajectory.size(); ++day) {
+            const ProjectedDay& projected = trajectory[day];
+            cout << setw(5) << day << setw(8) << projected.demand << setw(8) << projected.sold << setw(10)
+                 << projected.received << setw(9) << projected.ordered << setw(8) << projected.stock << endl;
+        }
+        return 0;
+    }
+    
+    if (backtest) {
+        auto accuracy = env.backtestForecaster();
+        if (accuracy.empty()) {
+            return 1;
+        }
+        cout << "\nBacktest Results:" << endl;
+        for (size_t i = 0; i < accuracy.size(); ++i) {
+            cout << env.productId(static_cast<int>(i)) << ": MAPE " << accuracy[i].mape()
+                 << ", WAPE " << accuracy[i].wape() << ", bias " << accuracy[i].bias() << endl;
+        }
+        return 0;
+    }
     
-    // Run a 30-day simulation
-    auto simulationResults = env.runSimulation(30);
+    // Run a 30-day simulation, or replay a recorded one
+    if (!recordPath.empty() && !env.startEventLog(recordPath)) {
+        return 1;
+    }
+    auto simulationResults = replayPath.empty() ? env.runSimulation(30) : env.replaySimulation(replayPath);
+    env.stopEventLog();
     
     // Display results
     cout << "\nSimulation Results:" << endl;
@@ -370,5 +4050,43 @@ int main() {
         }
     }
     
+    SimulationKpis& kpis = env.getKpis();
+    cout << "\nKPI Summary:" << endl;
+    cout << "Days of cover p10/p50/p90: " << kpis.daysOfCover.quantile(0.1) << " / "
+         << kpis.daysOfCover.quantile(0.5) << " / " << kpis.daysOfCover.quantile(0.9) << endl;
+    cout << "Stockout runs: " << kpis.stockoutDuration.getCount()
+         << ", mean length " << kpis.stockoutDuration.mean() << " days" << endl;
+    cout << "Price p50/p90: " << kpis.price.quantile(0.5) << " / " << kpis.price.quantile(0.9) << endl;
+    
+    if (replayPath.empty()) {
+        const auto& accuracy = env.getForecastAccuracy();
+        cout << "\nLeast accurate forecasts:" << endl;
+        for (const auto& [slot, wape] : accuracy.worstSkus(3)) {
+            cout << env.productId(slot) << ": WAPE " << wape << ", bias " << accuracy.bias(slot) << endl;
+        }
+        if (retrainCount > 0) {
+            // e.g. --retrain-drifting 5 refreshes the models behind the 5 worst SKUs
+            auto retrained = env.retrainDriftingSkus(retrainCount, max<size_t>(segmentBudget, 64 << 20));
+            cout << "Retrained the segment models of " << retrained.size() << " drifting SKUs:";
+            for (const auto& [slot, wape] : retrained) {
+                cout << " " << env.productId(slot);
+            }
+            cout << endl;
+        }
+    }
+    
+    if (markdowns) {
+        // Clearance ladders for whatever the run left above its max threshold
+        auto plans = env.planMarkdowns();
+        cout << "\nMarkdown plans:" << (plans.empty() ? " no SKU above its max threshold" : "") << endl;
+        for (const auto& plan : plans) {
+            cout << plan.productId << ":";
+            for (double discount : plan.weeklyDiscount) {
+                cout << " " << lround(discount * 100) << "%";
+            }
+            cout << " -> revenue " << plan.expectedRevenue << ", leftover " << plan.expectedLeftover << endl;
+        }
+    }
+    
     return 0;
 }
@@ -12,6 +12,28 @@
 #include <numeric>
 #include <sstream>
 #include <iomanip>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -35,6 +57,11 @@ int callback(void* data, int argc, char** argv, char** colName) {
     return 0;
 }
 
+// Numeric column value; SQL NULL, which callback maps to "NULL", reads as 0
+double numericValue(const string& value) {
+    return value == "NULL" || value.empty() ? 0.0 : stod(value);
+}
+
 // Database class to handle SQLite operations
 class Database {
 public:
@@ -45,6 +72,9 @@ public:
     }
 
     ~Database() {
+        for (auto& [sql, stmt] : statements) {
+            sqlite3_finalize(stmt);
+        }
         sqlite3_close(db);
     }
 
@@ -58,16 +88,78 @@ public:
         return result;
     }
 
-    void execute(const string& sql) {
+    // executeQuery that SQLite interrupts once the deadline passes; complete
+    // is false when it did and the rows are partial
+    vector<map<string, string>> executeQuery(const string& sql, chrono::steady_clock::time_point deadline, bool& complete) {
+        vector<map<string, string>> result;
+        complete = false;
+        if (chrono::steady_clock::now() >= deadline) return result;
+        auto expired = [](void* data) {
+            return chrono::steady_clock::now() >= *static_cast<chrono::steady_clock::time_point*>(data) ? 1 : 0;
+        };
+        sqlite3_progress_handler(db, kProgressInstructions, expired, &deadline);
+        char* errMsg = 0;
+        int rc = sqlite3_exec(db, sql.c_str(), callback, &result, &errMsg);
+        sqlite3_progress_handler(db, 0, nullptr, nullptr);
+        if (rc != SQLITE_OK && rc != SQLITE_INTERRUPT) {
+            cerr << "SQL error: " << errMsg << endl;
+        }
+        sqlite3_free(errMsg);
+        complete = rc == SQLITE_OK;
+        return result;
+    }
+
+    bool execute(const string& sql) {
         char* errMsg = 0;
         if (sqlite3_exec(db, sql.c_str(), 0, 0, &errMsg) != SQLITE_OK) {
             cerr << "SQL error: " << errMsg << endl;
             sqlite3_free(errMsg);
+            return false;
+        }
+        return true;
+    }
+
+    // Run a parameterized statement, binding params to ?1..?n as text and
+    // "NULL" as SQL NULL. Statements are prepared once per SQL text and
+    // cached for the life of the connection.
+    bool executePrepared(const string& sql, const vector<string>& params) {
+        sqlite3_stmt* stmt = prepare(sql);
+        if (!stmt) return false;
+        for (size_t i = 0; i < params.size(); i++) {
+            int index = static_cast<int>(i + 1);
+            if (params[i] == "NULL") {
+                sqlite3_bind_null(stmt, index);
+            } else {
+                sqlite3_bind_text(stmt, index, params[i].c_str(), static_cast<int>(params[i].size()), SQLITE_TRANSIENT);
+            }
+        }
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+            cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+            return false;
         }
+        return true;
     }
 
 private:
+    static constexpr int kProgressInstructions = 1000; // VM steps between deadline checks
+
     sqlite3* db;
+    unordered_map<string, sqlite3_stmt*> statements;
+
+    sqlite3_stmt* prepare(const string& sql) {
+        auto it = statements.find(sql);
+        if (it != statements.end()) return it->second;
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "SQL error: " << sqlite3_errmsg(db) << endl;
+            return nullptr;
+        }
+        statements[sql] = stmt;
+        return stmt;
+    }
 };
 
 // Initialize database tables
@@ -110,6 +202,9 @@ void initializeDatabase(Database& db) {
         )
     )");
 
+    // Recent-activity and staleness lookups are per customer, newest first
+    db.execute("CREATE INDEX IF NOT EXISTS idx_interactions_customer ON interactions (customer_id, timestamp)");
+
     db.execute(R"(
         CREATE TABLE IF NOT EXISTS purchases (
             purchase_id INTEGER PRIMARY KEY AUTOINCREMENT,
@@ -140,6 +235,427 @@ string interactionTypeToString(InteractionType type) {
     }
 }
 
+// Receives every interaction a CustomerAgent records, after it is stored
+class InteractionSink {
+public:
+    virtual ~InteractionSink() = default;
+    virtual void onInteraction(const string& customerId, const string& productId, InteractionType type, time_t when) = 0;
+};
+
+// Fixed-width interaction record; customers and products are dictionary codes
+struct InteractionRecord {
+    int64_t timestamp;
+    uint32_t customer;
+    uint32_t product;
+    int32_t duration;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+static_assert(sizeof(InteractionRecord) == 24, "InteractionRecord must stay fixed-width");
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t sealed;
+    uint64_t count;
+    uint64_t capacity;
+    char reserved[32];
+};
+static_assert(sizeof(SegmentHeader) == 64, "SegmentHeader must stay 64 bytes");
+
+const char kSegmentMagic[8] = "IXSEG";
+const uint32_t kSegmentVersion = 1;
+
+struct InteractionEvent {
+    string productId;
+    InteractionType type;
+    time_t timestamp;
+    int duration;
+};
+
+// Append-only interaction store. Records go into a preallocated, mmap'd
+// segment file until it holds kSegmentRecords, when it is sealed and a new
+// one started, so ingest is sequential writes into the page cache. Ids are
+// dictionary-encoded through an append-only dictionary file, and an
+// in-memory index of record positions per customer serves history lookups.
+// compact() drops expired records from sealed segments and repacks them;
+// the swap is redo-logged so a crash leaves either the old or the new set.
+class InteractionLog {
+public:
+    static constexpr uint64_t kSegmentRecords = 1 << 16; // 1.5 MB per segment
+
+    ~InteractionLog() {
+        close();
+    }
+
+    bool open(const string& dir) {
+        close();
+        directory = dir;
+        mkdir(directory.c_str(), 0755);
+        if (!finishCompaction()) return false;
+        if (!loadDictionary()) return false;
+
+        vector<string> names;
+        if (DIR* handle = opendir(directory.c_str())) {
+            while (dirent* entry = readdir(handle)) {
+                string name = entry->d_name;
+                if (name.rfind("segment-", 0) == 0) names.push_back(name);
+            }
+            closedir(handle);
+        }
+        sort(names.begin(), names.end());
+        for (const auto& name : names) {
+            Segment segment;
+            if (!mapSegment(directory + "/" + name, segment, false)) return false;
+            segments.push_back(segment);
+            nextSegmentNumber = max(nextSegmentNumber, segmentNumber(name) + 1);
+        }
+        for (size_t i = 0; i + 1 < segments.size(); i++) {
+            if (!segments[i].header->sealed) {
+                cerr << "Unsealed segment before the end of the log: " << segments[i].path << endl;
+                return false;
+            }
+        }
+        if (segments.empty() || segments.back().header->sealed) {
+            if (!startSegment()) return false;
+        }
+        rebuildIndex();
+        return true;
+    }
+
+    void close() {
+        flush();
+        for (auto& segment : segments) unmapSegment(segment);
+        segments.clear();
+        dictionaryFile.close();
+        customers.clear();
+        products.clear();
+        customerCodes.clear();
+        productCodes.clear();
+        customerIndex.clear();
+    }
+
+    bool append(const string& customerId, const string& productId, InteractionType type, time_t when, int duration) {
+        if (segments.empty()) return false;
+        if (segments.back().header->count == kSegmentRecords) {
+            seal(segments.back());
+            if (!startSegment()) return false;
+        }
+        Segment& active = segments.back();
+        InteractionRecord record = {};
+        record.timestamp = when;
+        record.customer = encode(customerId, customers, customerCodes, 'c');
+        record.product = encode(productId, products, productCodes, 'p');
+        record.duration = duration;
+        record.type = static_cast<uint8_t>(type);
+        uint64_t slot = active.header->count;
+        active.records[slot] = record;
+        active.header->count = slot + 1;
+        customerIndex[record.customer].push_back(position(segments.size() - 1, slot));
+        return true;
+    }
+
+    // Newest first
+    vector<InteractionEvent> recentForCustomer(const string& customerId, size_t limit) const {
+        vector<InteractionEvent> events;
+        auto code = customerCodes.find(customerId);
+        if (code == customerCodes.end()) return events;
+        const auto& positions = customerIndex.at(code->second);
+        for (auto it = positions.rbegin(); it != positions.rend() && events.size() < limit; ++it) {
+            const InteractionRecord& record = segments[*it >> 32].records[*it & 0xffffffff];
+            events.push_back({products[record.product], static_cast<InteractionType>(record.type),
+                              static_cast<time_t>(record.timestamp), record.duration});
+        }
+        return events;
+    }
+
+    size_t interactionCount(const string& customerId) const {
+        auto code = customerCodes.find(customerId);
+        return code == customerCodes.end() ? 0 : customerIndex.at(code->second).size();
+    }
+
+    // Sequential pass over every record, oldest segment first
+    template <typename Visit>
+    void scan(Visit&& visit) const {
+        for (const auto& segment : segments) {
+            madvise(segment.mapping, segment.length, MADV_SEQUENTIAL);
+            for (uint64_t i = 0; i < segment.header->count; i++) visit(segment.records[i]);
+        }
+    }
+
+    const string& customerId(uint32_t code) const {
+        return customers[code];
+    }
+
+    const string& productId(uint32_t code) const {
+        return products[code];
+    }
+
+    uint64_t size() const {
+        uint64_t total = 0;
+        for (const auto& segment : segments) total += segment.header->count;
+        return total;
+    }
+
+    // Persist the active segment's tail; sealed segments are already synced
+    void flush() {
+        if (!segments.empty()) msync(segments.back().mapping, segments.back().length, MS_SYNC);
+    }
+
+    // Rewrite sealed segments without records older than cutoff. Survivors
+    // keep their order and are packed into as few segments as possible,
+    // reusing the oldest segment names so the log stays ordered by name.
+    // Packed segments are written under a prefix open() ignores; once they
+    // are synced a manifest of renames and removals is written, and open()
+    // replays it if a crash interrupts the swap.
+    bool compact(time_t cutoff) {
+        if (segments.size() < 2) return true;
+        size_t sealedCount = segments.size() - 1;
+        vector<string> names;
+        vector<Segment> packed;
+        auto discard = [&packed] {
+            for (auto& segment : packed) {
+                unmapSegment(segment);
+                unlink(segment.path.c_str());
+            }
+            return false;
+        };
+        for (size_t i = 0; i < sealedCount; i++) {
+            names.push_back(segments[i].path);
+            for (uint64_t r = 0; r < segments[i].header->count; r++) {
+                const InteractionRecord& record = segments[i].records[r];
+                if (record.timestamp < cutoff) continue;
+                if (packed.empty() || packed.back().header->count == kSegmentRecords) {
+                    if (!packed.empty()) seal(packed.back());
+                    Segment segment;
+                    if (!createSegment(temporaryPath(names[packed.size()]), segment)) return discard();
+                    packed.push_back(segment);
+                }
+                Segment& out = packed.back();
+                out.records[out.header->count++] = record;
+            }
+        }
+        if (!packed.empty()) seal(packed.back());
+
+        string manifest = directory + "/" + kManifestName;
+        {
+            ofstream out(manifest + ".tmp", ios::trunc);
+            for (size_t i = 0; i < sealedCount; i++) {
+                out << (i < packed.size() ? "rename\t" + packed[i].path + "\t" : "remove\t") << names[i] << '\n';
+            }
+            out.flush();
+            if (!out || !syncFile(manifest + ".tmp") || rename((manifest + ".tmp").c_str(), manifest.c_str()) != 0) {
+                cerr << "Can't write compaction manifest: " << manifest << endl;
+                unlink((manifest + ".tmp").c_str());
+                return discard();
+            }
+            syncFile(directory);
+        }
+
+        for (size_t i = 0; i < sealedCount; i++) unmapSegment(segments[i]);
+        bool applied = replayManifest(manifest);
+        for (size_t i = 0; i < packed.size(); i++) packed[i].path = names[i];
+        segments.erase(segments.begin(), segments.begin() + sealedCount);
+        segments.insert(segments.begin(), packed.begin(), packed.end());
+        rebuildIndex();
+        return applied;
+    }
+
+private:
+    struct Segment {
+        string path;
+        void* mapping = nullptr;
+        size_t length = 0;
+        SegmentHeader* header = nullptr;
+        InteractionRecord* records = nullptr;
+    };
+
+    string directory;
+    vector<Segment> segments; // oldest first; the last one takes appends
+    uint64_t nextSegmentNumber = 0;
+    vector<string> customers;
+    vector<string> products;
+    unordered_map<string, uint32_t> customerCodes;
+    unordered_map<string, uint32_t> productCodes;
+    ofstream dictionaryFile;
+    unordered_map<uint32_t, vector<uint64_t>> customerIndex; // segment << 32 | slot
+
+    static uint64_t position(size_t segment, uint64_t slot) {
+        return static_cast<uint64_t>(segment) << 32 | slot;
+    }
+
+    static uint64_t segmentNumber(const string& name) {
+        return stoull(name.substr(strlen("segment-")));
+    }
+
+    inline static const string kManifestName = "compaction.manifest";
+    inline static const string kTemporaryPrefix = "compacting-";
+
+    static string temporaryPath(const string& segmentPath) {
+        size_t slash = segmentPath.rfind('/');
+        return segmentPath.substr(0, slash + 1) + kTemporaryPrefix + segmentPath.substr(slash + 1);
+    }
+
+    static bool syncFile(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        bool synced = fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+
+    // Apply a compaction manifest; every step is idempotent, so a replay
+    // after a crash part way through finishes the same swap
+    bool replayManifest(const string& manifest) {
+        ifstream in(manifest);
+        string line;
+        bool ok = true;
+        while (getline(in, line)) {
+            size_t tab = line.find('\t');
+            if (tab == string::npos) continue;
+            string action = line.substr(0, tab), rest = line.substr(tab + 1);
+            if (action == "rename") {
+                size_t split = rest.find('\t');
+                string from = rest.substr(0, split), to = rest.substr(split + 1);
+                if (access(from.c_str(), F_OK) == 0 && rename(from.c_str(), to.c_str()) != 0) ok = false;
+            } else if (action == "remove") {
+                if (access(rest.c_str(), F_OK) == 0 && unlink(rest.c_str()) != 0) ok = false;
+            }
+        }
+        in.close();
+        syncFile(directory);
+        if (!ok) {
+            cerr << "Can't apply compaction manifest: " << manifest << endl;
+            return false;
+        }
+        unlink(manifest.c_str());
+        return true;
+    }
+
+    // Roll an interrupted compaction forward if its manifest was written,
+    // and drop packed segments left behind by one that never got that far
+    bool finishCompaction() {
+        string manifest = directory + "/" + kManifestName;
+        if (access(manifest.c_str(), F_OK) == 0 && !replayManifest(manifest)) return false;
+        unlink((manifest + ".tmp").c_str());
+        if (DIR* handle = opendir(directory.c_str())) {
+            while (dirent* entry = readdir(handle)) {
+                string name = entry->d_name;
+                if (name.rfind(kTemporaryPrefix, 0) == 0) unlink((directory + "/" + name).c_str());
+            }
+            closedir(handle);
+        }
+        return true;
+    }
+
+    uint32_t encode(const string& id, vector<string>& values, unordered_map<string, uint32_t>& codes, char kind) {
+        auto it = codes.find(id);
+        if (it != codes.end()) return it->second;
+        uint32_t code = static_cast<uint32_t>(values.size());
+        values.push_back(id);
+        codes[id] = code;
+        dictionaryFile << kind << '\t' << id << '\n';
+        dictionaryFile.flush();
+        return code;
+    }
+
+    bool loadDictionary() {
+        string path = directory + "/dictionary.tsv";
+        ifstream in(path);
+        string line;
+        while (getline(in, line)) {
+            if (line.size() < 2 || line[1] != '\t') continue;
+            string id = line.substr(2);
+            if (line[0] == 'c') {
+                customerCodes[id] = static_cast<uint32_t>(customers.size());
+                customers.push_back(id);
+            } else if (line[0] == 'p') {
+                productCodes[id] = static_cast<uint32_t>(products.size());
+                products.push_back(id);
+            }
+        }
+        dictionaryFile.open(path, ios::app);
+        if (!dictionaryFile) {
+            cerr << "Can't open interaction dictionary: " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    void rebuildIndex() {
+        customerIndex.clear();
+        for (size_t s = 0; s < segments.size(); s++) {
+            for (uint64_t r = 0; r < segments[s].header->count; r++) {
+                customerIndex[segments[s].records[r].customer].push_back(position(s, r));
+            }
+        }
+    }
+
+    bool startSegment() {
+        char name[32];
+        snprintf(name, sizeof(name), "segment-%08llu.log", static_cast<unsigned long long>(nextSegmentNumber++));
+        Segment segment;
+        if (!createSegment(directory + "/" + name, segment)) return false;
+        segments.push_back(segment);
+        return true;
+    }
+
+    static bool createSegment(const string& path, Segment& segment) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        size_t length = sizeof(SegmentHeader) + kSegmentRecords * sizeof(InteractionRecord);
+        if (fd < 0 || ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            cerr << "Can't create log segment: " << path << endl;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        ::close(fd);
+        if (!mapSegment(path, segment, true)) return false;
+        memcpy(segment.header->magic, kSegmentMagic, sizeof(kSegmentMagic));
+        segment.header->version = kSegmentVersion;
+        segment.header->capacity = kSegmentRecords;
+        return true;
+    }
+
+    static bool mapSegment(const string& path, Segment& segment, bool fresh) {
+        int fd = ::open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+            cerr << "Can't open log segment: " << path << endl;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        segment.path = path;
+        segment.length = static_cast<size_t>(st.st_size);
+        segment.mapping = mmap(nullptr, segment.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (segment.mapping == MAP_FAILED) {
+            cerr << "Can't map log segment: " << path << endl;
+            return false;
+        }
+        segment.header = static_cast<SegmentHeader*>(segment.mapping);
+        segment.records = reinterpret_cast<InteractionRecord*>(static_cast<char*>(segment.mapping) + sizeof(SegmentHeader));
+        if (!fresh && (memcmp(segment.header->magic, kSegmentMagic, sizeof(kSegmentMagic)) != 0 ||
+                       segment.header->version != kSegmentVersion ||
+                       sizeof(SegmentHeader) + segment.header->capacity * sizeof(InteractionRecord) > segment.length ||
+                       segment.header->count > segment.header->capacity)) {
+            cerr << "Unsupported log segment: " << path << endl;
+            unmapSegment(segment);
+            return false;
+        }
+        return true;
+    }
+
+    static void seal(Segment& segment) {
+        segment.header->sealed = 1;
+        msync(segment.mapping, segment.length, MS_SYNC);
+    }
+
+    static void unmapSegment(Segment& segment) {
+        if (segment.mapping && segment.mapping != MAP_FAILED) munmap(segment.mapping, segment.length);
+        segment.mapping = nullptr;
+    }
+};
+
 // Customer agent
 class CustomerAgent {
 public:
@@ -152,99 +668,1578 @@ public:
         return result.empty() ? map<string, string>() : result[0];
     }
 
-    void updateProfile(const map<string, string>& updates) {
-        auto profile = getProfile();
-        if (profile.empty()) {
-            // Create new profile
-            map<string, string> newProfile = {
-                {"name", ""},
-                {"age", "NULL"},
-                {"gender", "NULL"},
-                {"location", "NULL"},
-                {"segment", "new"},
-                {"preferences", "{}"},
-                {"last_activity", currentTimestamp()},
-                {"customer_id", customerId}
-            };
-            newProfile.insert(updates.begin(), updates.end());
-
-            string columns, placeholders, values;
-            for (const auto& [key, val] : newProfile) {
-                if (!columns.empty()) columns += ", ";
-                if (!placeholders.empty()) placeholders += ", ";
-                columns += key;
-                placeholders += "'" + val + "'";
-            }
-
-            string sql = "INSERT INTO customers (" + columns + ") VALUES (" + placeholders + ")";
-            db.execute(sql);
-        } else {
-            // Update existing profile
-            profile.insert(updates.begin(), updates.end());
-            profile["last_activity"] = currentTimestamp();
-
-            string setClause;
-            for (const auto& [key, val] : profile) {
-                if (key != "customer_id") {
-                    if (!setClause.empty()) setClause += ", ";
-                    setClause += key + " = '" + val + "'";
-                }
-            }
+    // One upsert: a new customer gets defaults for the columns not supplied,
+    // an existing one has only the supplied columns and last_activity set
+    bool updateProfile(const map<string, string>& updates) {
+        return upsertProfile(db, customerId, updates);
+    }
 
-            string sql = "UPDATE customers SET " + setClause + " WHERE customer_id = '" + customerId + "'";
-            db.execute(sql);
+    // Bulk profile sync in a single transaction
+    static bool updateProfiles(Database& db, const map<string, map<string, string>>& updatesByCustomer) {
+        if (!db.execute("BEGIN")) return false;
+        for (const auto& [customerId, updates] : updatesByCustomer) {
+            if (!upsertProfile(db, customerId, updates)) {
+                db.execute("ROLLBACK");
+                return false;
+            }
         }
+        return db.execute("COMMIT");
+    }
+
+    void addSink(InteractionSink* sink) {
+        sinks.push_back(sink);
+    }
+
+    // Store interactions in the segment log instead of the interactions table
+    void setInteractionLog(InteractionLog* log) {
+        interactionLog = log;
     }
 
     void recordInteraction(const string& productId, InteractionType type, int duration = 0) {
-        string sql = "INSERT INTO interactions (customer_id, product_id, interaction_type, timestamp, duration) VALUES ('" +
-                     customerId + "', '" + productId + "', '" + interactionTypeToString(type) + "', '" + 
-                     currentTimestamp() + "', " + to_string(duration) + ")";
-        db.execute(sql);
+        time_t now = time(0);
+        bool stored;
+        if (interactionLog) {
+            stored = interactionLog->append(customerId, productId, type, now, duration);
+        } else {
+            string sql = "INSERT INTO interactions (customer_id, product_id, interaction_type, timestamp, duration) VALUES ('" +
+                         customerId + "', '" + productId + "', '" + interactionTypeToString(type) + "', '" + 
+                         currentTimestamp() + "', " + to_string(duration) + ")";
+            stored = db.execute(sql);
+        }
+        if (stored) {
+            for (auto* sink : sinks) {
+                sink->onInteraction(customerId, productId, type, now);
+            }
+        }
     }
 
+    // Stores the purchase, then records it as a PURCHASE interaction so the
+    // log and every sink see it like any other interaction
     void recordPurchase(const string& productId, int quantity, double amount) {
         string sql = "INSERT INTO purchases (customer_id, product_id, quantity, amount, timestamp) VALUES ('" +
                      customerId + "', '" + productId + "', " + to_string(quantity) + ", " + 
                      to_string(amount) + ", '" + currentTimestamp() + "')";
-        db.execute(sql);
+        if (db.execute(sql)) {
+            recordInteraction(productId, InteractionType::PURCHASE);
+        }
     }
 
 private:
     Database& db;
     string customerId;
+    vector<InteractionSink*> sinks;
+    InteractionLog* interactionLog = nullptr;
+
+    static bool upsertProfile(Database& db, const string& customerId, const map<string, string>& updates) {
+        // Writable columns and the value a new profile starts with
+        static const map<string, string> defaults = {
+            {"name", ""},
+            {"age", "NULL"},
+            {"gender", "NULL"},
+            {"location", "NULL"},
+            {"segment", "new"},
+            {"preferences", "{}"}
+        };
+
+        string columns = "customer_id", placeholders = "?1", setClause;
+        vector<string> params = {customerId};
+        for (const auto& [column, fallback] : defaults) {
+            auto update = updates.find(column);
+            params.push_back(update == updates.end() ? fallback : update->second);
+            columns += ", " + column;
+            placeholders += ", ?" + to_string(params.size());
+            if (update != updates.end()) setClause += column + " = excluded." + column + ", ";
+        }
+        for (const auto& [column, value] : updates) {
+            if (!defaults.count(column)) cerr << "Ignoring unknown profile field: " << column << endl;
+        }
+        params.push_back(currentTimestamp());
+        columns += ", last_activity";
+        placeholders += ", ?" + to_string(params.size());
+        setClause += "last_activity = excluded.last_activity";
+
+        string sql = "INSERT INTO customers (" + columns + ") VALUES (" + placeholders + ") "
+                     "ON CONFLICT(customer_id) DO UPDATE SET " + setClause;
+        return db.executePrepared(sql, params);
+    }
 };
 
-// Product agent
-class ProductAgent {
+// Count-min sketch: estimates never undercount, and overcount by at most
+// 2/kWidth of the total with probability 1 - 2^-kDepth
+class CountMinSketch {
 public:
-    ProductAgent(Database& db) : db(db) {
-        prepareProductVectors();
+    static constexpr size_t kDepth = 4;
+    static constexpr size_t kWidth = 2048;
+
+    CountMinSketch() : counts(kDepth * kWidth, 0) {}
+
+    // Keys are passed pre-hashed so callers probing many sketches hash once
+    void add(size_t h, uint32_t weight) {
+        for (size_t row = 0; row < kDepth; row++) {
+            counts[row * kWidth + bucket(h, row)] += weight;
+        }
+    }
+
+    uint32_t estimate(size_t h) const {
+        uint32_t best = numeric_limits<uint32_t>::max();
+        for (size_t row = 0; row < kDepth; row++) {
+            best = min(best, counts[row * kWidth + bucket(h, row)]);
+        }
+        return best;
+    }
+
+    void clear() {
+        fill(counts.begin(), counts.end(), 0);
+    }
+
+private:
+    vector<uint32_t> counts;
+
+    // Independent-enough row hashes from one 64-bit hash
+    static size_t bucket(size_t h, size_t row) {
+        uint64_t mixed = (h ^ (row * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+        return (mixed >> 32) % kWidth;
+    }
+};
+
+// Space-Saving heavy hitters: keeps the kCapacity most frequent keys of a
+// stream, each count overestimated by at most the evicted minimum
+class SpaceSaving {
+public:
+    static constexpr size_t kCapacity = 64;
+
+    void add(const string& key, uint32_t weight) {
+        auto it = slots.find(key);
+        if (it != slots.end()) {
+            entries[it->second].count += weight;
+            return;
+        }
+        if (entries.size() < kCapacity) {
+            slots[key] = entries.size();
+            entries.push_back({key, weight});
+            return;
+        }
+        size_t victim = 0;
+        for (size_t i = 1; i < entries.size(); i++) {
+            if (entries[i].count < entries[victim].count) victim = i;
+        }
+        slots.erase(entries[victim].key);
+        slots[key] = victim;
+        entries[victim] = {key, entries[victim].count + weight};
+    }
+
+    template <typename Visit>
+    void forEach(Visit&& visit) const {
+        for (const auto& entry : entries) visit(entry.key);
+    }
+
+    void clear() {
+        entries.clear();
+        slots.clear();
+    }
+
+private:
+    struct Entry {
+        string key;
+        uint32_t count;
+    };
+
+    vector<Entry> entries;
+    unordered_map<string, size_t> slots;
+};
+
+// "Trending now" over a sliding window of kBuckets time buckets. Each bucket
+// holds a count-min sketch of weighted interactions plus Space-Saving
+// heavy hitters overall and per category. A query scores only the heavy
+// hitter candidates, with newer buckets weighted higher, so its cost and
+// memory are fixed no matter how many events arrive.
+class TrendingTracker : public InteractionSink {
+public:
+    static constexpr size_t kBuckets = 12;
+
+    explicit TrendingTracker(int bucketSeconds = 300, double halfLifeBuckets = 3.0)
+        : bucketSeconds(bucketSeconds), decay(pow(0.5, 1.0 / halfLifeBuckets)), buckets(kBuckets) {}
+
+    void setProductCategory(const string& productId, const string& category) {
+        lock_guard<mutex> lock(trendMutex);
+        categories[productId] = category;
+    }
+
+    void onInteraction(const string& customerId, const string& productId, InteractionType type, time_t when) override {
+        (void)customerId;
+        lock_guard<mutex> lock(trendMutex);
+        Bucket& bucket = bucketFor(when / bucketSeconds);
+        uint32_t weight = interactionWeight(type);
+        bucket.sketch.add(hash<string>()(productId), weight);
+        bucket.heavyHitters.add(productId, weight);
+        auto category = categories.find(productId);
+        if (category != categories.end()) {
+            bucket.categoryHitters[category->second].add(productId, weight);
+        }
+    }
+
+    // Top products by decayed interaction weight; an empty category ranks all
+    vector<pair<string, double>> topTrending(size_t topN, const string& category = "", time_t now = time(0)) {
+        lock_guard<mutex> lock(trendMutex);
+        long current = now / bucketSeconds;
+
+        vector<const Bucket*> live;
+        vector<double> weights;
+        for (const auto& bucket : buckets) {
+            long age = current - bucket.epoch;
+            if (bucket.epoch < 0 || age < 0 || age >= static_cast<long>(kBuckets)) continue;
+            live.push_back(&bucket);
+            weights.push_back(pow(decay, static_cast<double>(age)));
+        }
+
+        vector<string> candidates;
+        for (const Bucket* bucket : live) {
+            const SpaceSaving* hitters = &bucket->heavyHitters;
+            if (!category.empty()) {
+                auto it = bucket->categoryHitters.find(category);
+                if (it == bucket->categoryHitters.end()) continue;
+                hitters = &it->second;
+            }
+            hitters->forEach([&](const string& key) { candidates.push_back(key); });
+        }
+        sort(candidates.begin(), candidates.end());
+        candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+        vector<pair<string, double>> scored;
+        for (const auto& productId : candidates) {
+            size_t h = hash<string>()(productId);
+            double score = 0.0;
+            for (size_t i = 0; i < live.size(); i++) {
+                score += live[i]->sketch.estimate(h) * weights[i];
+            }
+            scored.push_back({productId, score});
+        }
+        size_t keep = min(topN, scored.size());
+        partial_sort(scored.begin(), scored.begin() + keep, scored.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+        scored.resize(keep);
+        return scored;
+    }
+
+private:
+    struct Bucket {
+        long epoch = -1; // bucket number since the Unix epoch
+        CountMinSketch sketch;
+        SpaceSaving heavyHitters;
+        map<string, SpaceSaving> categoryHitters;
+    };
+
+    int bucketSeconds;
+    double decay;
+    vector<Bucket> buckets;
+    unordered_map<string, string> categories;
+    mutex trendMutex;
+
+    Bucket& bucketFor(long epoch) {
+        Bucket& bucket = buckets[epoch % kBuckets];
+        if (bucket.epoch != epoch) {
+            bucket.epoch = epoch;
+            bucket.sketch.clear();
+            bucket.heavyHitters.clear();
+            bucket.categoryHitters.clear();
+        }
+        return bucket;
     }
 
-    vector<string> getSimilarProducts(const string& productId, int topN = 5) {
-        if (productVectors.empty() || productIds.empty()) return {};
+    static uint32_t interactionWeight(InteractionType type) {
+        switch (type) {
+            case InteractionType::PURCHASE: return 5;
+            case InteractionType::CART_ADD: return 3;
+            case InteractionType::WISHLIST: return 2;
+            default: return 1;
+        }
+    }
+};
+
+// HyperLogLog distinct counter with 2^precision one-byte registers; the
+// standard error is 1.04 / sqrt(2^precision). Sketches of equal precision
+// merge by taking register maxima, so per-day sketches roll up to ranges.
+// A sketch starts sparse, as sorted (index, rank) pairs of the nonzero
+// registers, and switches to the dense array once that would be smaller;
+// both forms give the same estimate.
+class HyperLogLog {
+public:
+    explicit HyperLogLog(int precision = 12) : precision(precision) {}
+
+    void add(const string& key) {
+        // Finalize std::hash with splitmix64 so every bit is well mixed
+        uint64_t h = hash<string>()(key) + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+        size_t index = h >> (64 - precision);
+        uint64_t rest = h << precision;
+        uint8_t rank = rest == 0 ? static_cast<uint8_t>(64 - precision + 1) : static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+        update(static_cast<uint32_t>(index), rank);
+    }
+
+    void merge(const HyperLogLog& other) {
+        if (other.precision != precision) return;
+        if (other.isDense()) {
+            densify();
+            for (size_t i = 0; i < registers.size(); i++) {
+                registers[i] = max(registers[i], other.registers[i]);
+            }
+            return;
+        }
+        for (uint32_t entry : other.sparse) {
+            update(entry >> 8, static_cast<uint8_t>(entry & 0xff));
+        }
+    }
+
+    double estimate() const {
+        double m = static_cast<double>(size_t(1) << precision);
+        static const auto inversePowers = [] {
+            array<double, 65> powers;
+            for (int r = 0; r < 65; r++) powers[r] = ldexp(1.0, -r);
+            return powers;
+        }();
+        double sum = 0.0;
+        size_t zeros = 0;
+        if (isDense()) {
+            for (uint8_t r : registers) {
+                sum += inversePowers[r];
+                zeros += r == 0;
+            }
+        } else {
+            zeros = (size_t(1) << precision) - sparse.size();
+            sum = static_cast<double>(zeros);
+            for (uint32_t entry : sparse) sum += inversePowers[entry & 0xff];
+        }
+        double alpha = 0.7213 / (1.0 + 1.079 / m);
+        double raw = alpha * m * m / sum;
+        // Linear counting is more accurate while many registers are empty
+        if (raw <= 2.5 * m && zeros > 0) return m * log(m / zeros);
+        return raw;
+    }
+
+    double relativeError() const {
+        return 1.04 / sqrt(static_cast<double>(size_t(1) << precision));
+    }
+
+    size_t bytes() const {
+        return isDense() ? registers.size() : sparse.size() * sizeof(uint32_t);
+    }
+
+private:
+    int precision;
+    vector<uint32_t> sparse;  // index << 8 | rank, sorted, while small
+    vector<uint8_t> registers; // all 2^precision registers once dense
+
+    bool isDense() const {
+        return !registers.empty();
+    }
+
+    void update(uint32_t index, uint8_t rank) {
+        if (isDense()) {
+            registers[index] = max(registers[index], rank);
+            return;
+        }
+        auto it = lower_bound(sparse.begin(), sparse.end(), index << 8);
+        if (it != sparse.end() && (*it >> 8) == index) {
+            *it = max(*it, index << 8 | rank);
+            return;
+        }
+        sparse.insert(it, index << 8 | rank);
+        if (sparse.size() * sizeof(uint32_t) >= (size_t(1) << precision)) densify();
+    }
+
+    void densify() {
+        if (isDense()) return;
+        registers.assign(size_t(1) << precision, 0);
+        for (uint32_t entry : sparse) registers[entry >> 8] = static_cast<uint8_t>(entry & 0xff);
+        sparse.clear();
+        sparse.shrink_to_fit();
+    }
+};
+
+// Distinct-count metrics fed from interactions: unique viewers per product,
+// unique active customers per segment and overall, each kept as one
+// sketch per day and merged over the requested range of days.
+class ActivityCounters : public InteractionSink {
+public:
+    static constexpr int kProductPrecision = 10; // at most 1 KB, ~3.3% error
+    static constexpr int kCustomerPrecision = 14; // at most 16 KB, ~0.8% error
+
+    void setCustomerSegment(const string& customerId, const string& segment) {
+        lock_guard<mutex> lock(countersMutex);
+        segments[customerId] = segment;
+    }
+
+    void onInteraction(const string& customerId, const string& productId, InteractionType type, time_t when) override {
+        long day = dayNumber(when);
+        lock_guard<mutex> lock(countersMutex);
+        if (type == InteractionType::VIEW) {
+            sketchFor(productViewers[productId], day, kProductPrecision).add(customerId);
+        }
+        sketchFor(dailyActive, day, kCustomerPrecision).add(customerId);
+        auto segment = segments.find(customerId);
+        const string& name = segment == segments.end() ? kDefaultSegment : segment->second;
+        sketchFor(segmentCustomers[name], day, kCustomerPrecision).add(customerId);
+    }
+
+    // Ranges are inclusive days as returned by dayNumber
+    double uniqueViewers(const string& productId, long fromDay, long toDay) {
+        lock_guard<mutex> lock(countersMutex);
+        auto it = productViewers.find(productId);
+        return it == productViewers.end() ? 0.0 : mergeRange(it->second, fromDay, toDay, kProductPrecision);
+    }
+
+    double activeCustomers(long fromDay, long toDay) {
+        lock_guard<mutex> lock(countersMutex);
+        return mergeRange(dailyActive, fromDay, toDay, kCustomerPrecision);
+    }
+
+    double activeCustomersInSegment(const string& segment, long fromDay, long toDay) {
+        lock_guard<mutex> lock(countersMutex);
+        auto it = segmentCustomers.find(segment);
+        return it == segmentCustomers.end() ? 0.0 : mergeRange(it->second, fromDay, toDay, kCustomerPrecision);
+    }
+
+    static long dayNumber(time_t when) {
+        return static_cast<long>(when / 86400);
+    }
+
+private:
+    using DailySketches = map<long, HyperLogLog>;
 
-        auto it = find(productIds.begin(), productIds.end(), productId);
-        if (it == productIds.end()) return {};
+    inline static const string kDefaultSegment = "new";
+
+    unordered_map<string, DailySketches> productViewers;
+    DailySketches dailyActive;
+    map<string, DailySketches> segmentCustomers;
+    unordered_map<string, string> segments;
+    mutex countersMutex;
+
+    static HyperLogLog& sketchFor(DailySketches& days, long day, int precision) {
+        auto it = days.find(day);
+        if (it == days.end()) it = days.emplace(day, HyperLogLog(precision)).first;
+        return it->second;
+    }
+
+    static double mergeRange(const DailySketches& days, long fromDay, long toDay, int precision) {
+        HyperLogLog merged(precision);
+        for (auto it = days.lower_bound(fromDay); it != days.end() && it->first <= toDay; ++it) {
+            merged.merge(it->second);
+        }
+        return merged.estimate();
+    }
+};
+
+// Sparse first- and second-order Markov model over each customer's product
+// sequence. Every state keeps its top kTopK successors sorted, so "what's
+// next" is a hash lookup plus a copy of at most kTopK items; ingest updates
+// the counts and the affected top lists in place.
+class NextItemModel : public InteractionSink {
+public:
+    static constexpr size_t kTopK = 10;
+
+    // Replace the model with counts from every stored stream, ordered by
+    // timestamp. Customers are split across partitions that count privately
+    // before their tables are merged.
+    void build(Database& db, const InteractionLog* log = nullptr, unsigned partitions = thread::hardware_concurrency()) {
+        vector<string> names;
+        unordered_map<string, uint32_t> codes;
+        auto encode = [&](const string& productId) {
+            auto [it, inserted] = codes.try_emplace(productId, static_cast<uint32_t>(names.size()));
+            if (inserted) names.push_back(productId);
+            return it->second;
+        };
+
+        vector<string> customers;
+        vector<vector<uint32_t>> streams;
+        auto append = [&](const string& customerId, const string& productId) {
+            if (customers.empty() || customers.back() != customerId) {
+                customers.push_back(customerId);
+                streams.emplace_back();
+            }
+            uint32_t product = encode(productId);
+            if (streams.back().empty() || streams.back().back() != product) streams.back().push_back(product);
+        };
+        if (log) {
+            vector<InteractionRecord> records;
+            log->scan([&](const InteractionRecord& record) { records.push_back(record); });
+            stable_sort(records.begin(), records.end(), [](const InteractionRecord& a, const InteractionRecord& b) {
+                return tie(a.customer, a.timestamp) < tie(b.customer, b.timestamp);
+            });
+            for (const auto& record : records) append(log->customerId(record.customer), log->productId(record.product));
+        } else {
+            auto rows = db.executeQuery(
+                "SELECT customer_id, product_id FROM interactions ORDER BY customer_id, timestamp, interaction_id");
+            for (const auto& row : rows) append(row.at("customer_id"), row.at("product_id"));
+        }
 
-        int idx = distance(productIds.begin(), it);
-        vector<double> similarities = calculateSimilarities(productVectors[idx]);
+        partitions = max(1u, min<unsigned>(partitions, static_cast<unsigned>(streams.size())));
+        vector<future<Counts>> workers;
+        for (unsigned part = 0; part < partitions; part++) {
+            workers.push_back(async(launch::async, [&streams, part, partitions] {
+                Counts counts;
+                for (size_t i = part; i < streams.size(); i += partitions) {
+                    const vector<uint32_t>& stream = streams[i];
+                    for (size_t j = 1; j < stream.size(); j++) {
+                        counts[firstOrder(stream[j - 1])][stream[j]]++;
+                        if (j >= 2) counts[secondOrder(stream[j - 2], stream[j - 1])][stream[j]]++;
+                    }
+                }
+                return counts;
+            }));
+        }
+        unordered_map<uint64_t, Row> table;
+        for (auto& worker : workers) {
+            for (auto& [state, successors] : worker.get()) {
+                Row& row = table[state];
+                for (const auto& [product, count] : successors) row.counts[product] += count;
+            }
+        }
+        for (auto& [state, row] : table) {
+            row.top.assign(row.counts.begin(), row.counts.end());
+            auto middle = row.top.begin() + min(kTopK, row.top.size());
+            partial_sort(row.top.begin(), middle, row.top.end(),
+                         [&](const auto& a, const auto& b) { return ranksBefore(a, b, names); });
+            row.top.erase(middle, row.top.end());
+        }
+
+        unordered_map<string, pair<uint32_t, uint32_t>> last;
+        for (size_t i = 0; i < streams.size(); i++) {
+            const vector<uint32_t>& stream = streams[i];
+            last[customers[i]] = {stream.size() >= 2 ? stream[stream.size() - 2] : kNone, stream.back()};
+        }
+
+        lock_guard<mutex> lock(modelMutex);
+        products = move(names);
+        productCodes = move(codes);
+        rows = move(table);
+        lastProducts = move(last);
+    }
+
+    void onInteraction(const string& customerId, const string& productId, InteractionType type, time_t when) override {
+        (void)type;
+        (void)when;
+        lock_guard<mutex> lock(modelMutex);
+        auto [code, inserted] = productCodes.try_emplace(productId, static_cast<uint32_t>(products.size()));
+        if (inserted) products.push_back(productId);
+        uint32_t product = code->second;
+
+        auto [state, first] = lastProducts.try_emplace(customerId, kNone, product);
+        if (first) return;
+        auto& [older, newer] = state->second;
+        if (newer == product) return;
+        bump(rows[firstOrder(newer)], product);
+        if (older != kNone) bump(rows[secondOrder(older, newer)], product);
+        older = newer;
+        newer = product;
+    }
+
+    // Likely next products after history (oldest first). The second-order
+    // state is used when it has been observed, the last product otherwise.
+    vector<string> next(const vector<string>& history, size_t topN = 5) const {
+        lock_guard<mutex> lock(modelMutex);
+        vector<uint32_t> recent;
+        for (auto it = history.rbegin(); it != history.rend() && recent.size() < 2; ++it) {
+            auto code = productCodes.find(*it);
+            if (code == productCodes.end()) break;
+            if (recent.empty() || recent.back() != code->second) recent.push_back(code->second);
+        }
+        if (recent.empty()) return {};
+        return successors(recent.size() == 2 ? recent[1] : kNone, recent[0], topN);
+    }
+
+    // Likely next products for a customer given everything ingested so far
+    vector<string> nextForCustomer(const string& customerId, size_t topN = 5) const {
+        lock_guard<mutex> lock(modelMutex);
+        auto state = lastProducts.find(customerId);
+        if (state == lastProducts.end()) return {};
+        return successors(state->second.first, state->second.second, topN);
+    }
+
+private:
+    static constexpr uint32_t kNone = numeric_limits<uint32_t>::max();
+
+    struct Row {
+        unordered_map<uint32_t, uint32_t> counts;
+        vector<pair<uint32_t, uint32_t>> top; // (product, count), most frequent first
+    };
+    using Counts = unordered_map<uint64_t, unordered_map<uint32_t, uint32_t>>;
+
+    mutable mutex modelMutex;
+    vector<string> products;
+    unordered_map<string, uint32_t> productCodes;
+    unordered_map<uint64_t, Row> rows;
+    unordered_map<string, pair<uint32_t, uint32_t>> lastProducts; // (previous, latest) per customer
+
+    static uint64_t firstOrder(uint32_t product) {
+        return (static_cast<uint64_t>(kNone) << 32) | product;
+    }
+
+    static uint64_t secondOrder(uint32_t previous, uint32_t product) {
+        return (static_cast<uint64_t>(previous) << 32) | product;
+    }
+
+    // Higher count first; ties go by product id so every build ranks alike
+    static bool ranksBefore(const pair<uint32_t, uint32_t>& a, const pair<uint32_t, uint32_t>& b,
+                            const vector<string>& names) {
+        return a.second != b.second ? a.second > b.second : names[a.first] < names[b.first];
+    }
+
+    // Counts only grow, so a product outside the top list can only enter it
+    // by overtaking the last entry; the list stays exact with O(kTopK) work
+    void bump(Row& row, uint32_t product) {
+        uint32_t count = ++row.counts[product];
+        auto it = find_if(row.top.begin(), row.top.end(), [&](const auto& entry) { return entry.first == product; });
+        if (it != row.top.end()) {
+            it->second = count;
+        } else if (row.top.size() < kTopK) {
+            row.top.push_back({product, count});
+            it = row.top.end() - 1;
+        } else if (ranksBefore({product, count}, row.top.back(), products)) {
+            row.top.back() = {product, count};
+            it = row.top.end() - 1;
+        } else {
+            return;
+        }
+        for (; it != row.top.begin() && ranksBefore(*it, *(it - 1), products); --it) iter_swap(it, it - 1);
+    }
+
+    vector<string> successors(uint32_t previous, uint32_t latest, size_t topN) const {
+        const Row* row = nullptr;
+        if (previous != kNone) {
+            auto it = rows.find(secondOrder(previous, latest));
+            if (it != rows.end()) row = &it->second;
+        }
+        if (!row) {
+            auto it = rows.find(firstOrder(latest));
+            if (it == rows.end()) return {};
+            row = &it->second;
+        }
+        vector<string> result;
+        for (size_t i = 0; i < row->top.size() && i < topN; i++) result.push_back(products[row->top[i].first]);
+        return result;
+    }
+};
+
+// In-memory BM25 index over product text. Each term's postings are delta +
+// varint coded in blocks of kBlockSize with per-block score bounds, so
+// top-k queries can skip whole blocks (Block-Max WAND). The newest postings
+// of a term stay unpacked until their block fills, which lets products be
+// appended one at a time.
+class SearchIndex {
+public:
+    static constexpr size_t kBlockSize = 128;
+
+    // Returns false if the product is already indexed
+    bool addDocument(const string& productId, const string& text) {
+        if (docIndex.count(productId)) return false;
+
+        uint32_t doc = static_cast<uint32_t>(docIds.size());
+        docIds.push_back(productId);
+        docIndex[productId] = doc;
+
+        vector<string> tokens = tokenize(text);
+        uint32_t length = static_cast<uint32_t>(tokens.size());
+        docLengths.push_back(length);
+        totalLength += length;
+
+        double avgLength = static_cast<double>(totalLength) / docIds.size();
+        unordered_map<string, uint32_t> termFreqs;
+        for (const auto& token : tokens) {
+            termFreqs[token]++;
+        }
+        for (const auto& [term, tf] : termFreqs) {
+            auto [it, inserted] = termIndex.try_emplace(term, postings.size());
+            if (inserted) postings.emplace_back();
+            postings[it->second].append(doc, tf, length, avgLength);
+        }
+        return true;
+    }
+
+    // Top-k products by BM25 score for a free-text query
+    vector<pair<string, double>> search(const string& query, size_t k) const {
+        if (k == 0 || docIds.empty()) return {};
+
+        vector<string> terms = tokenize(query);
+        sort(terms.begin(), terms.end());
+        terms.erase(unique(terms.begin(), terms.end()), terms.end());
+
+        double avgLength = static_cast<double>(totalLength) / docIds.size();
+        vector<Cursor> cursors;
+        for (const auto& term : terms) {
+            auto it = termIndex.find(term);
+            if (it == termIndex.end()) continue;
+            const PostingList& list = postings[it->second];
+            double df = list.docFreq();
+            double idf = log(1.0 + (docIds.size() - df + 0.5) / (df + 0.5));
+            cursors.emplace_back(list, idf, avgLength, docLengths);
+        }
+
+        // Min-heap of the best k (score, doc) pairs seen so far
+        priority_queue<pair<double, uint32_t>, vector<pair<double, uint32_t>>, greater<>> heap;
+        auto threshold = [&]() { return heap.size() < k ? 0.0 : heap.top().first; };
+
+        vector<Cursor*> order;
+        for (auto& cursor : cursors) order.push_back(&cursor);
+
+        while (true) {
+            sort(order.begin(), order.end(), [](const Cursor* a, const Cursor* b) { return a->doc < b->doc; });
+
+            // Pivot: first cursor at which the summed term bounds beat the threshold
+            double bound = 0.0;
+            size_t pivot = order.size();
+            for (size_t i = 0; i < order.size() && order[i]->doc != kEndDoc; i++) {
+                bound += order[i]->maxScore;
+                if (bound > threshold()) {
+                    pivot = i;
+                    break;
+                }
+            }
+            if (pivot == order.size()) break;
+
+            uint32_t pivotDoc = order[pivot]->doc;
+            while (pivot + 1 < order.size() && order[pivot + 1]->doc == pivotDoc) pivot++;
+
+            // Tighten with the bounds of the blocks that would hold pivotDoc
+            double blockBound = 0.0;
+            for (size_t i = 0; i <= pivot; i++) {
+                blockBound += order[i]->blockMaxScore(pivotDoc);
+            }
+
+            if (blockBound > threshold()) {
+                if (order[0]->doc == pivotDoc) {
+                    double score = 0.0;
+                    for (size_t i = 0; i <= pivot; i++) {
+                        score += order[i]->score();
+                        order[i]->nextGEQ(pivotDoc + 1);
+                    }
+                    if (heap.size() < k) {
+                        heap.push({score, pivotDoc});
+                    } else if (score > heap.top().first) {
+                        heap.pop();
+                        heap.push({score, pivotDoc});
+                    }
+                } else {
+                    for (size_t i = 0; i < pivot && order[i]->doc < pivotDoc; i++) {
+                        order[i]->nextGEQ(pivotDoc);
+                    }
+                }
+            } else {
+                // No document before the end of these blocks can make the top k
+                uint32_t next = kEndDoc;
+                for (size_t i = 0; i <= pivot; i++) {
+                    next = min(next, order[i]->blockLastDoc(pivotDoc) + 1);
+                }
+                if (pivot + 1 < order.size()) next = min(next, order[pivot + 1]->doc);
+                for (size_t i = 0; i <= pivot; i++) {
+                    if (order[i]->doc < next) order[i]->nextGEQ(next);
+                }
+            }
+        }
+
+        vector<pair<string, double>> results;
+        while (!heap.empty()) {
+            results.push_back({docIds[heap.top().second], heap.top().first});
+            heap.pop();
+        }
+        reverse(results.begin(), results.end());
+        return results;
+    }
+
+    size_t size() const {
+        return docIds.size();
+    }
+
+    // Lower-cased alphanumeric runs
+    static vector<string> tokenize(const string& text) {
+        vector<string> tokens;
+        string token;
+        for (char c : text) {
+            if (isalnum(static_cast<unsigned char>(c))) {
+                token += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            } else if (!token.empty()) {
+                tokens.push_back(token);
+                token.clear();
+            }
+        }
+        if (!token.empty()) tokens.push_back(token);
+        return tokens;
+    }
+
+private:
+    static constexpr uint32_t kEndDoc = numeric_limits<uint32_t>::max();
+    static constexpr double kK1 = 1.2;
+    static constexpr double kB = 0.75;
+
+    // BM25 term weight without idf
+    static double bm25(uint32_t tf, uint32_t length, double avgLength) {
+        return tf * (kK1 + 1) / (tf + kK1 * (1 - kB + kB * length / avgLength));
+    }
+
+    // A sealed block keeps its best term weight under the average length at
+    // sealing time; scaling by max(1, avgLength / sealAvgLength) keeps it an
+    // upper bound as the average drifts. The open tail block is bounded by
+    // its largest tf and shortest document instead.
+    struct BlockMeta {
+        uint32_t lastDoc = 0;
+        uint32_t offset = 0;
+        uint32_t count = 0;
+        uint32_t maxTf = 0;
+        uint32_t minLength = numeric_limits<uint32_t>::max();
+        double maxWeight = 0.0;
+        double sealAvgLength = 0.0;
+    };
+
+    class PostingList {
+    public:
+        void append(uint32_t doc, uint32_t tf, uint32_t length, double avgLength) {
+            tailDocs.push_back(doc);
+            tailTfs.push_back(tf);
+            tailLengths.push_back(length);
+            tail.lastDoc = doc;
+            tail.count++;
+            tail.maxTf = max(tail.maxTf, tf);
+            tail.minLength = min(tail.minLength, length);
+            if (tailDocs.size() == kBlockSize) seal(avgLength);
+        }
+
+        double maxWeight(size_t block, double avgLength) const {
+            if (block == blocks.size()) return bm25(tail.maxTf, tail.minLength, avgLength);
+            const BlockMeta& meta = blocks[block];
+            return meta.maxWeight * max(1.0, avgLength / meta.sealAvgLength);
+        }
+
+        size_t blockCount() const {
+            return blocks.size() + (tailDocs.empty() ? 0 : 1);
+        }
+
+        const BlockMeta& meta(size_t block) const {
+            return block < blocks.size() ? blocks[block] : tail;
+        }
+
+        // First block whose last document is at or after target, from block on
+        size_t findBlock(size_t block, uint32_t target) const {
+            if (block < blocks.size()) {
+                auto it = lower_bound(blocks.begin() + block, blocks.end(), target,
+                    [](const BlockMeta& meta, uint32_t doc) { return meta.lastDoc < doc; });
+                block = it - blocks.begin();
+                if (block < blocks.size()) return block;
+            }
+            return !tailDocs.empty() && tail.lastDoc >= target ? blocks.size() : blockCount();
+        }
+
+        void decode(size_t block, vector<uint32_t>& docs, vector<uint32_t>& tfs) const {
+            if (block == blocks.size()) {
+                docs = tailDocs;
+                tfs = tailTfs;
+                return;
+            }
+            const BlockMeta& meta = blocks[block];
+            docs.resize(meta.count);
+            tfs.resize(meta.count);
+            const uint8_t* in = bytes.data() + meta.offset;
+            uint32_t doc = block == 0 ? 0 : blocks[block - 1].lastDoc;
+            for (uint32_t i = 0; i < meta.count; i++) {
+                doc += readVarint(in);
+                docs[i] = doc;
+                tfs[i] = readVarint(in);
+            }
+        }
+
+        uint32_t docFreq() const {
+            return docCount + static_cast<uint32_t>(tailDocs.size());
+        }
+
+    private:
+        vector<BlockMeta> blocks;
+        vector<uint8_t> bytes;
+        BlockMeta tail;
+        vector<uint32_t> tailDocs;
+        vector<uint32_t> tailTfs;
+        vector<uint32_t> tailLengths;
+        uint32_t docCount = 0;
+
+        void seal(double avgLength) {
+            tail.offset = static_cast<uint32_t>(bytes.size());
+            tail.sealAvgLength = avgLength;
+            uint32_t previous = blocks.empty() ? 0 : blocks.back().lastDoc;
+            for (size_t i = 0; i < tailDocs.size(); i++) {
+                writeVarint(tailDocs[i] - previous);
+                writeVarint(tailTfs[i]);
+                previous = tailDocs[i];
+                tail.maxWeight = max(tail.maxWeight, bm25(tailTfs[i], tailLengths[i], avgLength));
+            }
+            docCount += tail.count;
+            blocks.push_back(tail);
+            tail = BlockMeta();
+            tailDocs.clear();
+            tailTfs.clear();
+            tailLengths.clear();
+        }
+
+        void writeVarint(uint32_t value) {
+            while (value >= 0x80) {
+                bytes.push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            bytes.push_back(static_cast<uint8_t>(value));
+        }
+
+        static uint32_t readVarint(const uint8_t*& in) {
+            uint32_t value = 0;
+            for (int shift = 0;; shift += 7) {
+                uint8_t byte = *in++;
+                value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+                if (byte < 0x80) return value;
+            }
+        }
+    };
+
+    // Iterates one term's postings for a query, decoding a block at a time
+    class Cursor {
+    public:
+        uint32_t doc = kEndDoc;
+        double maxScore = 0.0;
+
+        Cursor(const PostingList& list, double idf, double avgLength, const vector<uint32_t>& docLengths)
+            : list(&list), idf(idf), avgLength(avgLength), docLengths(&docLengths) {
+            for (size_t b = 0; b < list.blockCount(); b++) {
+                maxScore = max(maxScore, bound(b));
+            }
+            load(0);
+        }
+
+        double score() const {
+            return idf * bm25(tfs[pos], (*docLengths)[doc], avgLength);
+        }
+
+        void nextGEQ(uint32_t target) {
+            if (doc == kEndDoc || target <= doc) return;
+            if (target > list->meta(block).lastDoc) {
+                load(list->findBlock(block + 1, target));
+                if (doc == kEndDoc) return;
+            }
+            pos = lower_bound(docs.begin() + pos, docs.end(), target) - docs.begin();
+            doc = docs[pos];
+        }
+
+        // Score bound and last document of the block that would hold target,
+        // found without decoding it
+        double blockMaxScore(uint32_t target) const {
+            size_t shallow = list->findBlock(block, target);
+            return shallow < list->blockCount() ? bound(shallow) : 0.0;
+        }
+
+        uint32_t blockLastDoc(uint32_t target) const {
+            size_t shallow = list->findBlock(block, target);
+            return shallow < list->blockCount() ? list->meta(shallow).lastDoc : kEndDoc - 1;
+        }
+
+    private:
+        const PostingList* list;
+        double idf;
+        double avgLength;
+        const vector<uint32_t>* docLengths;
+        size_t block = 0;
+        size_t pos = 0;
+        vector<uint32_t> docs;
+        vector<uint32_t> tfs;
+
+        void load(size_t next) {
+            block = next;
+            pos = 0;
+            if (block >= list->blockCount()) {
+                doc = kEndDoc;
+                return;
+            }
+            list->decode(block, docs, tfs);
+            doc = docs[0];
+        }
+
+        double bound(size_t block) const {
+            return idf * list->maxWeight(block, avgLength);
+        }
+    };
+
+    vector<string> docIds;
+    unordered_map<string, uint32_t> docIndex;
+    vector<uint32_t> docLengths;
+    uint64_t totalLength = 0;
+    unordered_map<string, size_t> termIndex;
+    vector<PostingList> postings;
+};
+
+struct AutocompleteEntry {
+    string productId;
+    string name;
+    double popularity;
+};
+
+// Immutable prefix index over product names. Every word start of every
+// lower-cased name is a key in one sorted suffix array, so "head" finds
+// "Wireless Headphones". A prefix maps to a contiguous range, and the most
+// popular products in it come out of a range-max structure (sparse table
+// over 64-entry blocks) without visiting the whole range.
+class AutocompleteIndex {
+public:
+    explicit AutocompleteIndex(const vector<AutocompleteEntry>& entries) {
+        for (uint32_t product = 0; product < entries.size(); product++) {
+            const string& name = entries[product].name;
+            uint32_t start = static_cast<uint32_t>(text.size());
+            for (size_t i = 0; i < name.size(); i++) {
+                unsigned char c = static_cast<unsigned char>(name[i]);
+                bool wordStart = isalnum(c) && (i == 0 || !isalnum(static_cast<unsigned char>(name[i - 1])));
+                if (wordStart) keys.push_back({start + static_cast<uint32_t>(i), product});
+                text += static_cast<char>(tolower(c));
+            }
+            text += '\0';
+            names.push_back(entries[product].name);
+        }
+        sort(keys.begin(), keys.end(), [this](const Key& a, const Key& b) {
+            return strcmp(text.data() + a.offset, text.data() + b.offset) < 0;
+        });
+
+        scores.reserve(keys.size());
+        for (const auto& key : keys) {
+            scores.push_back(entries[key.product].popularity);
+        }
+        buildRangeMax();
+    }
+
+    // Names of the topN most popular products with a word starting with prefix
+    vector<string> complete(const string& prefix, size_t topN) const {
+        string needle;
+        for (char c : prefix) needle += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+        if (needle.empty() || topN == 0) return {};
+
+        auto first = lower_bound(keys.begin(), keys.end(), needle, [this](const Key& key, const string& value) {
+            return strcmp(text.data() + key.offset, value.c_str()) < 0;
+        });
+        auto last = partition_point(first, keys.end(), [this, &needle](const Key& key) {
+            return strncmp(text.data() + key.offset, needle.c_str(), needle.size()) == 0;
+        });
+
+        // Best-first over sub-ranges: pop the range max, then split around it
+        using Range = tuple<double, size_t, size_t, size_t>; // score, argmax, begin, end
+        priority_queue<Range> ranges;
+        auto pushRange = [&](size_t begin, size_t end) {
+            if (begin < end) {
+                size_t best = rangeMax(begin, end);
+                ranges.push({scores[best], best, begin, end});
+            }
+        };
+        pushRange(first - keys.begin(), last - keys.begin());
+
+        vector<string> result;
+        vector<uint32_t> seen;
+        while (!ranges.empty() && result.size() < topN) {
+            auto [score, best, begin, end] = ranges.top();
+            ranges.pop();
+            uint32_t product = keys[best].product;
+            if (find(seen.begin(), seen.end(), product) == seen.end()) {
+                seen.push_back(product);
+                result.push_back(names[product]);
+            }
+            pushRange(begin, best);
+            pushRange(best + 1, end);
+        }
+        return result;
+    }
+
+    size_t size() const {
+        return names.size();
+    }
+
+private:
+    static constexpr size_t kBlock = 64;
+
+    struct Key {
+        uint32_t offset;  // start of the suffix in text
+        uint32_t product;
+    };
+
+    string text; // lower-cased names, each terminated by '\0'
+    vector<Key> keys;
+    vector<double> scores; // popularity per key
+    vector<string> names;
+    vector<vector<uint32_t>> blockMax; // blockMax[level][b]: argmax over 2^level blocks from b
+
+    void buildRangeMax() {
+        size_t blocks = (scores.size() + kBlock - 1) / kBlock;
+        blockMax.emplace_back(blocks);
+        for (size_t b = 0; b < blocks; b++) {
+            blockMax[0][b] = scanMax(b * kBlock, min(scores.size(), (b + 1) * kBlock));
+        }
+        for (size_t level = 1; (size_t(1) << level) <= blocks; level++) {
+            const auto& previous = blockMax[level - 1];
+            vector<uint32_t> current(blocks - (size_t(1) << level) + 1);
+            for (size_t b = 0; b < current.size(); b++) {
+                current[b] = better(previous[b], previous[b + (size_t(1) << (level - 1))]);
+            }
+            blockMax.push_back(move(current));
+        }
+    }
+
+    uint32_t better(uint32_t a, uint32_t b) const {
+        return scores[b] > scores[a] ? b : a;
+    }
+
+    uint32_t scanMax(size_t begin, size_t end) const {
+        uint32_t best = static_cast<uint32_t>(begin);
+        for (size_t i = begin + 1; i < end; i++) {
+            best = better(best, static_cast<uint32_t>(i));
+        }
+        return best;
+    }
+
+    // Index of the highest score in [begin, end)
+    size_t rangeMax(size_t begin, size_t end) const {
+        size_t firstBlock = (begin + kBlock - 1) / kBlock;
+        size_t lastBlock = end / kBlock;
+        if (firstBlock >= lastBlock) return scanMax(begin, end);
+
+        uint32_t best = scanMax(firstBlock * kBlock, (firstBlock + 1) * kBlock);
+        if (begin < firstBlock * kBlock) best = better(scanMax(begin, firstBlock * kBlock), best);
+        if (end > lastBlock * kBlock) best = better(best, scanMax(lastBlock * kBlock, end));
+        size_t level = 0;
+        while ((size_t(2) << level) <= lastBlock - firstBlock) level++;
+        best = better(best, blockMax[level][firstBlock]);
+        best = better(best, blockMax[level][lastBlock - (size_t(1) << level)]);
+        return best;
+    }
+};
+
+// Serves completions from the current immutable index while replacements
+// are built on a background thread. Catalog changes arriving during a
+// build are folded into one follow-up build. The builder keeps its own copy
+// of the entries, so each build only moves over what was added since.
+// reset() starts a new generation; a batch taken before it is dropped.
+class AutocompleteService {
+public:
+    ~AutocompleteService() {
+        {
+            lock_guard<mutex> lock(entriesMutex);
+            stopping = true;
+        }
+        changed.notify_one();
+        if (builder.joinable()) builder.join();
+    }
+
+    // Build synchronously from a full catalog, replacing every entry
+    void reset(vector<AutocompleteEntry> newEntries) {
+        lock_guard<mutex> build(buildMutex);
+        {
+            lock_guard<mutex> lock(entriesMutex);
+            added.clear();
+            generation++;
+        }
+        entries = move(newEntries);
+        atomic_store(&current, make_shared<const AutocompleteIndex>(entries));
+    }
+
+    void add(AutocompleteEntry entry) {
+        call_once(builderStarted, [this] { builder = thread([this] { buildLoop(); }); });
+        {
+            lock_guard<mutex> lock(entriesMutex);
+            added.push_back(move(entry));
+        }
+        changed.notify_one();
+    }
+
+    vector<string> complete(const string& prefix, size_t topN) const {
+        auto index = atomic_load(&current);
+        return index ? index->complete(prefix, topN) : vector<string>();
+    }
+
+    // Block until every added entry is in the served index
+    void waitForBuild() {
+        unique_lock<mutex> lock(entriesMutex);
+        idle.wait(lock, [this] { return added.empty() && !building; });
+    }
+
+private:
+    shared_ptr<const AutocompleteIndex> current;
+    mutex entriesMutex; // guards added, generation, building and stopping
+    vector<AutocompleteEntry> added;
+    uint64_t generation = 0; // bumped by reset()
+    bool building = false;
+    bool stopping = false;
+    condition_variable changed;
+    condition_variable idle;
+    mutex buildMutex; // held while entries is extended and indexed
+    vector<AutocompleteEntry> entries;
+    once_flag builderStarted;
+    thread builder;
+
+    void buildLoop() {
+        unique_lock<mutex> lock(entriesMutex);
+        while (true) {
+            changed.wait(lock, [this] { return stopping || !added.empty(); });
+            if (added.empty()) return;
+            vector<AutocompleteEntry> batch = move(added);
+            added.clear();
+            uint64_t batchGeneration = generation;
+            building = true;
+            lock.unlock();
+            {
+                lock_guard<mutex> build(buildMutex);
+                bool stale;
+                {
+                    lock_guard<mutex> check(entriesMutex);
+                    stale = batchGeneration != generation;
+                }
+                if (!stale) {
+                    move(batch.begin(), batch.end(), back_inserter(entries));
+                    atomic_store(&current, make_shared<const AutocompleteIndex>(entries));
+                }
+            }
+            lock.lock();
+            building = false;
+            idle.notify_all();
+        }
+    }
+};
+
+// Compressed bitmap over dense product indices in the style of Roaring:
+// values are split by their high 16 bits, and each chunk is a sorted
+// uint16 array while sparse and a 1024-word bitset past 4096 entries.
+class RoaringBitmap {
+public:
+    void add(uint32_t value) {
+        Container& container = containerFor(static_cast<uint16_t>(value >> 16));
+        uint16_t low = static_cast<uint16_t>(value & 0xffff);
+        if (container.isBitset()) {
+            uint64_t mask = uint64_t(1) << (low & 63);
+            if (!(container.bits[low >> 6] & mask)) {
+                container.bits[low >> 6] |= mask;
+                container.count++;
+            }
+            return;
+        }
+        auto& values = container.values;
+        if (values.empty() || values.back() < low) {
+            values.push_back(low);
+        } else {
+            auto it = lower_bound(values.begin(), values.end(), low);
+            if (*it == low) return;
+            values.insert(it, low);
+        }
+        container.count++;
+        if (container.count > kArrayLimit) container.toBitset();
+    }
+
+    bool contains(uint32_t value) const {
+        const Container* container = find(static_cast<uint16_t>(value >> 16));
+        if (!container) return false;
+        uint16_t low = static_cast<uint16_t>(value & 0xffff);
+        if (container->isBitset()) return container->bits[low >> 6] >> (low & 63) & 1;
+        return binary_search(container->values.begin(), container->values.end(), low);
+    }
+
+    size_t cardinality() const {
+        size_t total = 0;
+        for (const auto& container : containers) total += container.count;
+        return total;
+    }
+
+    RoaringBitmap operator&(const RoaringBitmap& other) const {
+        RoaringBitmap result;
+        size_t i = 0, j = 0;
+        while (i < containers.size() && j < other.containers.size()) {
+            if (containers[i].key < other.containers[j].key) {
+                i++;
+            } else if (containers[i].key > other.containers[j].key) {
+                j++;
+            } else {
+                Container merged = intersect(containers[i++], other.containers[j++]);
+                if (merged.count > 0) result.containers.push_back(move(merged));
+            }
+        }
+        return result;
+    }
+
+    RoaringBitmap& operator|=(const RoaringBitmap& other) {
+        vector<Container> merged;
+        size_t i = 0, j = 0;
+        while (i < containers.size() || j < other.containers.size()) {
+            if (j == other.containers.size() || (i < containers.size() && containers[i].key < other.containers[j].key)) {
+                merged.push_back(move(containers[i++]));
+            } else if (i == containers.size() || other.containers[j].key < containers[i].key) {
+                merged.push_back(other.containers[j++]);
+            } else {
+                merged.push_back(unite(containers[i++], other.containers[j++]));
+            }
+        }
+        containers = move(merged);
+        return *this;
+    }
+
+    // Visit set values in increasing order
+    template <typename Visit>
+    void forEach(Visit&& visit) const {
+        for (const auto& container : containers) {
+            uint32_t high = static_cast<uint32_t>(container.key) << 16;
+            if (container.isBitset()) {
+                for (size_t word = 0; word < container.bits.size(); word++) {
+                    for (uint64_t bits = container.bits[word]; bits; bits &= bits - 1) {
+                        visit(high | static_cast<uint32_t>(word * 64 + __builtin_ctzll(bits)));
+                    }
+                }
+            } else {
+                for (uint16_t low : container.values) visit(high | low);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t kArrayLimit = 4096;
+    static constexpr size_t kBitsetWords = 1024;
+
+    struct Container {
+        uint16_t key = 0;
+        uint32_t count = 0;
+        vector<uint16_t> values; // sorted, while count <= kArrayLimit
+        vector<uint64_t> bits;   // kBitsetWords words, once dense
+
+        bool isBitset() const {
+            return !bits.empty();
+        }
+
+        void toBitset() {
+            bits.assign(kBitsetWords, 0);
+            for (uint16_t low : values) bits[low >> 6] |= uint64_t(1) << (low & 63);
+            values.clear();
+            values.shrink_to_fit();
+        }
+
+        // Back to an array once a bitset result is sparse
+        void normalize() {
+            count = 0;
+            for (uint64_t word : bits) count += __builtin_popcountll(word);
+            if (count > kArrayLimit) return;
+            values.clear();
+            for (size_t word = 0; word < bits.size(); word++) {
+                for (uint64_t w = bits[word]; w; w &= w - 1) {
+                    values.push_back(static_cast<uint16_t>(word * 64 + __builtin_ctzll(w)));
+                }
+            }
+            bits.clear();
+        }
+    };
+
+    vector<Container> containers; // sorted by key
+
+    Container& containerFor(uint16_t key) {
+        if (containers.empty() || containers.back().key < key) {
+            containers.emplace_back();
+            containers.back().key = key;
+            return containers.back();
+        }
+        auto it = lower_bound(containers.begin(), containers.end(), key,
+            [](const Container& container, uint16_t k) { return container.key < k; });
+        if (it == containers.end() || it->key != key) {
+            it = containers.insert(it, Container());
+            it->key = key;
+        }
+        return *it;
+    }
+
+    const Container* find(uint16_t key) const {
+        auto it = lower_bound(containers.begin(), containers.end(), key,
+            [](const Container& container, uint16_t k) { return container.key < k; });
+        return it != containers.end() && it->key == key ? &*it : nullptr;
+    }
+
+    static Container intersect(const Container& a, const Container& b) {
+        Container result;
+        result.key = a.key;
+        if (a.isBitset() && b.isBitset()) {
+            result.bits.resize(kBitsetWords);
+            for (size_t word = 0; word < kBitsetWords; word++) result.bits[word] = a.bits[word] & b.bits[word];
+            result.normalize();
+            return result;
+        }
+        if (a.isBitset() || b.isBitset()) {
+            const Container& array = a.isBitset() ? b : a;
+            const Container& bitset = a.isBitset() ? a : b;
+            for (uint16_t low : array.values) {
+                if (bitset.bits[low >> 6] >> (low & 63) & 1) result.values.push_back(low);
+            }
+        } else {
+            set_intersection(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+                             back_inserter(result.values));
+        }
+        result.count = static_cast<uint32_t>(result.values.size());
+        return result;
+    }
+
+    static Container unite(const Container& a, const Container& b) {
+        Container result;
+        result.key = a.key;
+        if (!a.isBitset() && !b.isBitset() && a.count + b.count <= kArrayLimit) {
+            set_union(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+                      back_inserter(result.values));
+            result.count = static_cast<uint32_t>(result.values.size());
+            return result;
+        }
+        result.bits.assign(kBitsetWords, 0);
+        for (const Container* side : {&a, &b}) {
+            if (side->isBitset()) {
+                for (size_t word = 0; word < kBitsetWords; word++) result.bits[word] |= side->bits[word];
+            } else {
+                for (uint16_t low : side->values) result.bits[low >> 6] |= uint64_t(1) << (low & 63);
+            }
+        }
+        result.normalize();
+        return result;
+    }
+};
+
+// Optional predicates for similarity retrieval; an empty category matches all
+struct ProductFilter {
+    string category;
+    double minPrice = 0.0;
+    double maxPrice = numeric_limits<double>::max();
+};
+
+// Product agent
+class ProductAgent {
+public:
+    static constexpr size_t kScanChunk = 1024; // products scored between deadline checks
+
+    ProductAgent(Database& db) : db(db) {
+        prepareProductVectors();
+    }
+
+    // The topN most similar products passing the filter. The category and
+    // price predicates are resolved to bitmaps first, so only matching
+    // products are scored.
+    vector<string> getSimilarProducts(const string& productId, int topN = 5, const ProductFilter& filter = {}) const {
+        bool complete;
+        return getSimilarProducts(productId, topN, filter, chrono::steady_clock::time_point::max(), complete);
+    }
+
+    // Same scan, checking the deadline every kScanChunk products; once it
+    // passes, the best products seen so far are returned and complete is false
+    vector<string> getSimilarProducts(const string& productId, int topN, const ProductFilter& filter,
+                                      chrono::steady_clock::time_point deadline, bool& complete) const {
+        complete = true;
+        if (productVectors.empty() || productIds.empty() || topN <= 0) return {};
+
+        auto it = productIndex.find(productId);
+        if (it == productIndex.end()) return {};
+        uint32_t idx = it->second;
+        const vector<double>& vec = productVectors[idx];
+        double norm = productNorms[idx];
+
+        // Min-heap of the best topN (similarity, index) pairs
+        priority_queue<pair<double, uint32_t>, vector<pair<double, uint32_t>>, greater<>> best;
+        size_t visited = 0;
+        auto consider = [&](uint32_t other) {
+            if (!complete) return;
+            if (++visited % kScanChunk == 0 && chrono::steady_clock::now() >= deadline) {
+                complete = false;
+                return;
+            }
+            if (other == idx || prices[other] < filter.minPrice || prices[other] > filter.maxPrice) return;
+            double dot = inner_product(vec.begin(), vec.end(), productVectors[other].begin(), 0.0);
+            double similarity = dot / (norm * productNorms[other]);
+            if (best.size() < static_cast<size_t>(topN)) {
+                best.push({similarity, other});
+            } else if (similarity > best.top().first) {
+                best.pop();
+                best.push({similarity, other});
+            }
+        };
+
+        bool priceFiltered = filter.minPrice > 0.0 || filter.maxPrice < numeric_limits<double>::max();
+        if (filter.category.empty() && !priceFiltered) {
+            for (uint32_t other = 0; other < productIds.size() && complete; other++) consider(other);
+        } else {
+            RoaringBitmap candidates;
+            if (priceFiltered) {
+                // Whole buckets overlapping the range; exact bounds are checked per product
+                int low = priceBucket(filter.minPrice);
+                for (auto bucket = priceBuckets.lower_bound(low); bucket != priceBuckets.end(); ++bucket) {
+                    if (filter.maxPrice < numeric_limits<double>::max() && bucket->first > priceBucket(filter.maxPrice)) break;
+                    candidates |= bucket->second;
+                }
+            }
+            if (!filter.category.empty()) {
+                auto category = categoryBitmaps.find(filter.category);
+                if (category == categoryBitmaps.end()) return {};
+                candidates = priceFiltered ? candidates & category->second : category->second;
+            }
+            candidates.forEach(consider);
+        }
+
+        vector<string> result(best.size());
+        for (size_t i = best.size(); i-- > 0; best.pop()) {
+            result[i] = productIds[best.top().second];
+        }
+        return result;
+    }
 
-        vector<size_t> indices(similarities.size());
-        iota(indices.begin(), indices.end(), 0);
-        partial_sort(indices.begin(), indices.begin() + topN + 1, indices.end(),
-            [&similarities](size_t a, size_t b) { return similarities[a] > similarities[b]; });
+    // Unfiltered topN lists for many seed products. Seeds are scored in
+    // blocks so each candidate vector is loaded once per block rather than
+    // once per seed; results are in seed order, empty for unknown ids.
+    vector<vector<string>> getSimilarProductsBatch(const vector<string>& seedIds, int topN = 5) const {
+        static constexpr size_t kSeedBlock = 32;
+        vector<vector<string>> results(seedIds.size());
+        if (productVectors.empty() || topN <= 0) return results;
+
+        using Heap = priority_queue<pair<double, uint32_t>, vector<pair<double, uint32_t>>, greater<>>;
+        for (size_t start = 0; start < seedIds.size(); start += kSeedBlock) {
+            vector<size_t> slots;
+            vector<uint32_t> seeds;
+            for (size_t i = start; i < min(seedIds.size(), start + kSeedBlock); i++) {
+                auto it = productIndex.find(seedIds[i]);
+                if (it == productIndex.end()) continue;
+                slots.push_back(i);
+                seeds.push_back(it->second);
+            }
+            vector<Heap> best(seeds.size());
+            for (uint32_t other = 0; other < productIds.size(); other++) {
+                const vector<double>& candidate = productVectors[other];
+                for (size_t s = 0; s < seeds.size(); s++) {
+                    if (other == seeds[s]) continue;
+                    const vector<double>& vec = productVectors[seeds[s]];
+                    double dot = inner_product(vec.begin(), vec.end(), candidate.begin(), 0.0);
+                    double similarity = dot / (productNorms[seeds[s]] * productNorms[other]);
+                    if (best[s].size() < static_cast<size_t>(topN)) {
+                        best[s].push({similarity, other});
+                    } else if (similarity > best[s].top().first) {
+                        best[s].pop();
+                        best[s].push({similarity, other});
+                    }
+                }
+            }
+            for (size_t s = 0; s < seeds.size(); s++) {
+                vector<string>& result = results[slots[s]];
+                result.resize(best[s].size());
+                for (size_t i = best[s].size(); i-- > 0; best[s].pop()) {
+                    result[i] = productIds[best[s].top().second];
+                }
+            }
+        }
+        return results;
+    }
 
+    // Full-text search over name, category, description and tags
+    vector<string> searchProducts(const string& query, int topN = 10) {
         vector<string> result;
-        for (int i = 0; i < topN && i < indices.size(); i++) {
-            if (indices[i] != idx) { // Exclude the product itself
-                result.push_back(productIds[indices[i]]);
-            }
+        for (const auto& [productId, score] : searchIndex.search(query, topN)) {
+            result.push_back(productId);
         }
         return result;
     }
 
+    // Type-ahead: the most popular product names with a word starting with prefix
+    vector<string> autocomplete(const string& prefix, int topN = 5) const {
+        return completions.complete(prefix, topN);
+    }
+
     map<string, string> getProductDetails(const string& productId) {
         string sql = "SELECT * FROM products WHERE product_id = '" + productId + "'";
         auto result = db.executeQuery(sql);
@@ -257,25 +2252,60 @@ public:
                      productData.at("category") + "', " + productData.at("price") + ", '" + 
                      productData.at("description") + "', '" + productData.at("tags") + "', " + 
                      productData.at("popularity_score") + ")";
-        db.execute(sql);
-        prepareProductVectors();
+        if (db.execute(sql)) {
+            indexProduct(productData);
+            completions.add({productData.at("product_id"), productData.at("name"),
+                             numericValue(productData.at("popularity_score"))});
+        }
     }
 
 private:
     Database& db;
     vector<string> productIds;
     vector<vector<double>> productVectors;
+    unordered_map<string, uint32_t> productIndex; // product id -> dense index
+    vector<double> productNorms;
+    vector<double> prices;
+    map<string, RoaringBitmap> categoryBitmaps;
+    map<int, RoaringBitmap> priceBuckets; // quarter-octave price bands
+    SearchIndex searchIndex;
+    AutocompleteService completions;
 
     void prepareProductVectors() {
-        auto products = db.executeQuery("SELECT product_id, name, description, tags FROM products");
+        auto products = db.executeQuery(
+            "SELECT product_id, name, category, COALESCE(price, 0) AS price, description, tags, "
+            "COALESCE(popularity_score, 0) AS popularity_score FROM products");
         productIds.clear();
         productVectors.clear();
+        productIndex.clear();
+        productNorms.clear();
+        prices.clear();
+        categoryBitmaps.clear();
+        priceBuckets.clear();
 
+        vector<AutocompleteEntry> names;
         for (const auto& product : products) {
-            productIds.push_back(product.at("product_id"));
-            string text = product.at("name") + " " + product.at("description") + " " + product.at("tags");
-            productVectors.push_back(createTextVector(text));
+            indexProduct(product);
+            names.push_back({product.at("product_id"), product.at("name"), numericValue(product.at("popularity_score"))});
         }
+        completions.reset(move(names));
+    }
+
+    // Append one product to the similarity vectors, filter bitmaps and the
+    // search index
+    void indexProduct(const map<string, string>& product) {
+        uint32_t idx = static_cast<uint32_t>(productIds.size());
+        productIds.push_back(product.at("product_id"));
+        productIndex[product.at("product_id")] = idx;
+        string text = product.at("name") + " " + product.at("description") + " " + product.at("tags");
+        productVectors.push_back(createTextVector(text));
+        const vector<double>& vec = productVectors.back();
+        productNorms.push_back(sqrt(inner_product(vec.begin(), vec.end(), vec.begin(), 0.0)));
+        double price = numericValue(product.at("price"));
+        prices.push_back(price);
+        categoryBitmaps[product.at("category")].add(idx);
+        priceBuckets[priceBucket(price)].add(idx);
+        searchIndex.addDocument(product.at("product_id"), product.at("category") + " " + text);
     }
 
     vector<double> createTextVector(const string& text) {
@@ -289,30 +2319,27 @@ private:
         return vector;
     }
 
-    vector<double> calculateSimilarities(const vector<double>& vec) {
-        vector<double> similarities;
-        for (const auto& otherVec : productVectors) {
-            double dot = inner_product(vec.begin(), vec.end(), otherVec.begin(), 0.0);
-            double norm1 = sqrt(inner_product(vec.begin(), vec.end(), vec.begin(), 0.0));
-            double norm2 = sqrt(inner_product(otherVec.begin(), otherVec.end(), otherVec.begin(), 0.0));
-            similarities.push_back(dot / (norm1 * norm2));
-        }
-        return similarities;
+    static int priceBucket(double price) {
+        return static_cast<int>(floor(log2(max(price, 0.0) + 1.0) * 4));
     }
 };
 
 // Segmentation agent
 class SegmentationAgent {
 public:
-    SegmentationAgent(Database& db) : db(db) {}
+    SegmentationAgent(Database& db, const InteractionLog* interactionLog = nullptr)
+        : db(db), interactionLog(interactionLog) {}
 
-    void updateCustomerSegments(int nClusters = 4) {
+    // Returns the new segment of every customer. Labels are ranked by
+    // engagement, segment_0 being the least engaged, so a label means the
+    // same tier from one run to the next and per-day counts can be merged.
+    map<string, string> updateCustomerSegments(int nClusters = 4) {
         auto data = db.executeQuery(R"(
             SELECT 
                 c.customer_id,
                 COUNT(DISTINCT i.interaction_id) as interaction_count,
                 COUNT(DISTINCT p.purchase_id) as purchase_count,
-                SUM(p.amount) as total_spent,
+                COALESCE(SUM(p.amount), 0) as total_spent,
                 COUNT(DISTINCT strftime('%Y-%m', p.timestamp)) as active_months
             FROM customers c
             LEFT JOIN interactions i ON c.customer_id = i.customer_id
@@ -320,15 +2347,16 @@ public:
             GROUP BY c.customer_id
         )");
 
-        if (data.empty()) return;
+        if (data.empty()) return {};
 
         // Prepare features for clustering
         vector<string> customerIds;
         vector<vector<double>> features;
         for (const auto& row : data) {
             customerIds.push_back(row.at("customer_id"));
+            double logged = interactionLog ? interactionLog->interactionCount(row.at("customer_id")) : 0;
             features.push_back({
-                stod(row.at("interaction_count")),
+                stod(row.at("interaction_count")) + logged,
                 stod(row.at("purchase_count")),
                 stod(row.at("total_spent")),
                 stod(row.at("active_months"))
@@ -342,15 +2370,19 @@ public:
         vector<int> segments = simpleKMeans(features, nClusters);
 
         // Update segments in database
+        map<string, string> assignments;
         for (size_t i = 0; i < customerIds.size(); i++) {
-            string sql = "UPDATE customers SET segment = 'segment_" + to_string(segments[i]) + 
+            assignments[customerIds[i]] = "segment_" + to_string(segments[i]);
+            string sql = "UPDATE customers SET segment = '" + assignments[customerIds[i]] + 
                          "' WHERE customer_id = '" + customerIds[i] + "'";
             db.execute(sql);
         }
+        return assignments;
     }
 
 private:
     Database& db;
+    const InteractionLog* interactionLog;
 
     void normalizeFeatures(vector<vector<double>>& features) {
         if (features.empty()) return;
@@ -390,9 +2422,14 @@ private:
         vector<int> clusters(features.size(), 0);
         vector<vector<double>> centroids(k, vector<double>(features[0].size(), 0.0));
 
-        // Random initialization
+        // Deterministic initialization at evenly spaced engagement quantiles
+        auto engagement = [](const vector<double>& point) { return accumulate(point.begin(), point.end(), 0.0); };
+        vector<size_t> byEngagement(features.size());
+        iota(byEngagement.begin(), byEngagement.end(), 0);
+        stable_sort(byEngagement.begin(), byEngagement.end(),
+                    [&](size_t a, size_t b) { return engagement(features[a]) < engagement(features[b]); });
         for (int i = 0; i < k; i++) {
-            centroids[i] = features[rand() % features.size()];
+            centroids[i] = features[byEngagement[(2 * i + 1) * features.size() / (2 * k)]];
         }
 
         // Assign clusters
@@ -434,19 +2471,269 @@ private:
                     }
                 }
             }
-            centroids = newCentroids;
+            for (int j = 0; j < k; j++) {
+                if (counts[j] > 0) centroids[j] = newCentroids[j];
+            }
         } while (changed);
 
+        // Relabel clusters by centroid engagement, lowest first
+        vector<int> order(k);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(),
+                    [&](int a, int b) { return engagement(centroids[a]) < engagement(centroids[b]); });
+        vector<int> rank(k);
+        for (int i = 0; i < k; i++) rank[order[i]] = i;
+        for (int& cluster : clusters) cluster = rank[cluster];
         return clusters;
     }
 };
 
-// Recommendation agent
-class RecommendationAgent {
+// On-disk layout of precomputed recommendations (little-endian):
+//   RecommendationFileHeader | RecommendationEntry[customerCount] sorted by
+//   the FNV-1a hash of the customer id |
+//   StringRef products[productCount] | uint32 listItems[] | string bytes
+struct RecommendationFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t customerCount;
+    uint32_t productCount;
+    uint32_t listItemCount;
+    int64_t generatedAt;
+    uint64_t stringBytes;
+    char reserved[24];
+};
+static_assert(sizeof(RecommendationFileHeader) == 64, "RecommendationFileHeader must stay 64 bytes");
+
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct RecommendationEntry {
+    uint64_t hash;
+    StringRef customer;
+    uint32_t listOffset; // into listItems
+    uint32_t listLength;
+};
+
+const char kRecommendationMagic[8] = "RECKV";
+const uint32_t kRecommendationVersion = 2;
+
+// Read-only, mmap'd table of per-customer recommendation lists written by
+// the batch job; a lookup is a binary search over customer hashes
+class RecommendationStore {
+public:
+    ~RecommendationStore() {
+        if (mapping && mapping != MAP_FAILED) munmap(mapping, length);
+    }
+
+    // 64-bit FNV-1a; fixed so files sort the same whichever build wrote them
+    static uint64_t customerHash(const string& customerId) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : customerId) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    static bool write(const string& path, const map<string, vector<string>>& lists, time_t generatedAt) {
+        vector<string> productNames;
+        unordered_map<string, uint32_t> productCodes;
+        string strings;
+        auto addString = [&](const string& value) {
+            StringRef ref = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size())};
+            strings += value;
+            return ref;
+        };
+
+        vector<RecommendationEntry> entries;
+        vector<StringRef> products;
+        vector<uint32_t> listItems;
+        for (const auto& [customerId, list] : lists) {
+            RecommendationEntry entry = {customerHash(customerId), addString(customerId),
+                                         static_cast<uint32_t>(listItems.size()), static_cast<uint32_t>(list.size())};
+            for (const auto& productId : list) {
+                auto [it, inserted] = productCodes.try_emplace(productId, static_cast<uint32_t>(products.size()));
+                if (inserted) products.push_back(addString(productId));
+                listItems.push_back(it->second);
+            }
+            entries.push_back(entry);
+        }
+        sort(entries.begin(), entries.end(),
+             [](const RecommendationEntry& a, const RecommendationEntry& b) { return a.hash < b.hash; });
+
+        RecommendationFileHeader header = {};
+        memcpy(header.magic, kRecommendationMagic, sizeof(kRecommendationMagic));
+        header.version = kRecommendationVersion;
+        header.customerCount = static_cast<uint32_t>(entries.size());
+        header.productCount = static_cast<uint32_t>(products.size());
+        header.listItemCount = static_cast<uint32_t>(listItems.size());
+        header.generatedAt = generatedAt;
+        header.stringBytes = strings.size();
+
+        // Write to a temporary file and rename so readers never see a partial table
+        string temporary = path + ".tmp";
+        ofstream out(temporary, ios::binary | ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(RecommendationEntry));
+        out.write(reinterpret_cast<const char*>(products.data()), products.size() * sizeof(StringRef));
+        out.write(reinterpret_cast<const char*>(listItems.data()), listItems.size() * sizeof(uint32_t));
+        out.write(strings.data(), strings.size());
+        out.close();
+        if (!out || rename(temporary.c_str(), path.c_str()) != 0) {
+            cerr << "Can't write recommendation file: " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(RecommendationFileHeader)) {
+            cerr << "Can't open recommendation file: " << path << endl;
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            cerr << "Can't map recommendation file: " << path << endl;
+            return false;
+        }
+        const char* base = static_cast<const char*>(mapping);
+        header = reinterpret_cast<const RecommendationFileHeader*>(base);
+        uint64_t expected = sizeof(RecommendationFileHeader) +
+                            uint64_t(header->customerCount) * sizeof(RecommendationEntry) +
+                            uint64_t(header->productCount) * sizeof(StringRef) +
+                            uint64_t(header->listItemCount) * sizeof(uint32_t);
+        if (memcmp(header->magic, kRecommendationMagic, sizeof(kRecommendationMagic)) != 0 ||
+            header->version != kRecommendationVersion || expected > length ||
+            header->stringBytes != length - expected) {
+            cerr << "Unsupported recommendation file: " << path << endl;
+            return false;
+        }
+        auto tableEntries = reinterpret_cast<const RecommendationEntry*>(base + sizeof(RecommendationFileHeader));
+        products = reinterpret_cast<const StringRef*>(tableEntries + header->customerCount);
+        listItems = reinterpret_cast<const uint32_t*>(products + header->productCount);
+        strings = reinterpret_cast<const char*>(listItems + header->listItemCount);
+        if (!validate(tableEntries)) {
+            cerr << "Corrupt recommendation file: " << path << endl;
+            return false;
+        }
+        entries = tableEntries;
+        return true;
+    }
+
+    bool lookup(const string& customerId, vector<string>& list) const {
+        if (!entries) return false;
+        uint64_t h = customerHash(customerId);
+        const RecommendationEntry* end = entries + header->customerCount;
+        for (auto it = lower_bound(entries, end, h, [](const RecommendationEntry& entry, uint64_t value) {
+                 return entry.hash < value;
+             });
+             it != end && it->hash == h; ++it) {
+            if (customerId.compare(0, string::npos, strings + it->customer.offset, it->customer.length) != 0) continue;
+            list.clear();
+            for (uint32_t i = 0; i < it->listLength; i++) {
+                const StringRef& product = products[listItems[it->listOffset + i]];
+                list.emplace_back(strings + product.offset, product.length);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    time_t generatedAt() const {
+        return entries ? static_cast<time_t>(header->generatedAt) : 0;
+    }
+
+private:
+    void* mapping = nullptr;
+    size_t length = 0;
+    const RecommendationFileHeader* header = nullptr;
+
+    // Every offset a lookup follows stays inside its section and entries
+    // are in hash order, so lookups never read outside the mapping
+    bool validate(const RecommendationEntry* table) const {
+        auto inStrings = [this](const StringRef& ref) {
+            return uint64_t(ref.offset) + ref.length <= header->stringBytes;
+        };
+        for (uint32_t i = 0; i < header->customerCount; i++) {
+            const RecommendationEntry& entry = table[i];
+            if (!inStrings(entry.customer) ||
+                uint64_t(entry.listOffset) + entry.listLength > header->listItemCount ||
+                (i > 0 && table[i - 1].hash > entry.hash)) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < header->productCount; i++) {
+            if (!inStrings(products[i])) return false;
+        }
+        for (uint32_t i = 0; i < header->listItemCount; i++) {
+            if (listItems[i] >= header->productCount) return false;
+        }
+        return true;
+    }
+
+    const RecommendationEntry* entries = nullptr;
+    const StringRef* products = nullptr;
+    const uint32_t* listItems = nullptr;
+    const char* strings = nullptr;
+};
+
+// Answer to a recommendation request with a latency budget
+struct TimedRecommendations {
+    vector<string> products;
+    vector<string> completedStages; // in pipeline order
+    bool timedOut = false;          // some stage was cut short or skipped
+};
+
+// Recommendation agent. Without an interaction log it also tracks, as a
+// sink, which customers were active since the precomputed batch ran.
+class RecommendationAgent : public InteractionSink {
 public:
-    RecommendationAgent(Database& db) : db(db), productAgent(db) {}
+    RecommendationAgent(Database& db, const InteractionLog* interactionLog = nullptr)
+        : db(db), productAgent(db), interactionLog(interactionLog) {}
+
+    // Serve lists from a batch file; customers with activity after the batch
+    // ran, or every customer once the file is older than maxAge, are scored live.
+    // Activity is read once here; later interactions arrive via onInteraction,
+    // so a cached hit costs a lookup rather than a query.
+    void setPrecomputed(const RecommendationStore* store, time_t maxAge = 24 * 3600) {
+        precomputed = store;
+        precomputedMaxAge = maxAge;
+        lock_guard<mutex> lock(activeMutex);
+        activeSinceBatch.clear();
+        if (!store || interactionLog) return;
+        for (const auto& row : db.executeQuery(
+                 "SELECT DISTINCT customer_id FROM interactions WHERE timestamp > datetime(" +
+                 to_string(store->generatedAt()) + ", 'unixepoch', 'localtime')")) {
+            activeSinceBatch.insert(row.at("customer_id"));
+        }
+    }
+
+    void onInteraction(const string& customerId, const string& productId, InteractionType type, time_t when) override {
+        (void)productId;
+        (void)type;
+        lock_guard<mutex> lock(activeMutex);
+        if (precomputed && when >= precomputed->generatedAt()) activeSinceBatch.insert(customerId);
+    }
+
+    // Order-aware predictions lead the personalized lists when a model is set
+    void setNextItemModel(const NextItemModel* model) {
+        nextItems = model;
+    }
 
     vector<string> getRecommendations(const string& customerId, int topN = 5) {
+        vector<string> cached;
+        if (precomputed && precomputed->lookup(customerId, cached) && !isStale(customerId)) {
+            if (cached.size() > static_cast<size_t>(topN)) cached.resize(topN);
+            return cached;
+        }
+
         // Get customer profile
         auto profile = db.executeQuery(
             "SELECT segment, preferences FROM customers WHERE customer_id = '" + customerId + "'");
@@ -458,20 +2745,14 @@ public:
         // Strategy 1: Personalized based on recent interactions
         auto recentProducts = getRecentInteractions(customerId);
         if (!recentProducts.empty()) {
-            vector<string> similarProducts;
+            vector<vector<string>> similar;
+            vector<const vector<string>*> similarLists;
             for (const auto& productId : recentProducts) {
-                auto similar = productAgent.getSimilarProducts(productId, topN);
-                similarProducts.insert(similarProducts.end(), similar.begin(), similar.end());
-            }
-            if (!similarProducts.empty()) {
-                // Remove duplicates and limit to topN
-                sort(similarProducts.begin(), similarProducts.end());
-                similarProducts.erase(unique(similarProducts.begin(), similarProducts.end()), similarProducts.end());
-                if (similarProducts.size() > topN) {
-                    similarProducts.resize(topN);
-                }
-                return similarProducts;
+                similar.push_back(productAgent.getSimilarProducts(productId, topN));
             }
+            for (const auto& list : similar) similarLists.push_back(&list);
+            auto personalized = personalize(recentProducts, similarLists, topN);
+            if (!personalized.empty()) return personalized;
         }
 
         // Strategy 2: Segment-based recommendations
@@ -482,39 +2763,245 @@ public:
         return getFallbackRecommendations(topN);
     }
 
+    // Anytime variant bounded by budget. Stages run in order until the list
+    // is full: precomputed, session (profile and recent activity), neighbors
+    // (next-item transitions), similarity, segment and popular. Each adds
+    // candidates to the list; a scan or query cut off by the deadline still
+    // contributes what it found so far.
+    TimedRecommendations getRecommendations(const string& customerId, int topN, chrono::microseconds budget) {
+        Deadline deadline = chrono::steady_clock::now() + budget;
+        TimedRecommendations response;
+        auto add = [&](const vector<string>& candidates) {
+            for (const auto& productId : candidates) {
+                if (response.products.size() >= static_cast<size_t>(topN)) return;
+                if (find(response.products.begin(), response.products.end(), productId) == response.products.end()) {
+                    response.products.push_back(productId);
+                }
+            }
+        };
+        auto startStage = [&] {
+            if (response.products.size() >= static_cast<size_t>(topN)) return false;
+            if (chrono::steady_clock::now() >= deadline) {
+                response.timedOut = true;
+                return false;
+            }
+            return true;
+        };
+        auto finishStage = [&](const char* stage, bool complete) {
+            if (complete) {
+                response.completedStages.push_back(stage);
+            } else {
+                response.timedOut = true;
+            }
+        };
+
+        // The precomputed stage is gated like the others, so a spent budget
+        // skips its lookup and staleness check too
+        vector<string> cached;
+        if (precomputed && startStage() && precomputed->lookup(customerId, cached) && !isStale(customerId)) {
+            add(cached);
+            finishStage("precomputed", true);
+            return response;
+        }
+
+        string segment;
+        vector<string> recentProducts;
+        if (startStage()) {
+            bool complete = false;
+            auto profile = db.executeQuery(
+                "SELECT segment FROM customers WHERE customer_id = '" + customerId + "'", deadline, complete);
+            if (!profile.empty()) segment = profile[0].at("segment");
+            if (complete) recentProducts = getRecentInteractions(customerId, 3, deadline, &complete);
+            finishStage("session", complete);
+        }
+
+        if (nextItems && !recentProducts.empty() && startStage()) {
+            add(nextItems->next(vector<string>(recentProducts.rbegin(), recentProducts.rend()), topN));
+            finishStage("neighbors", true);
+        }
+
+        if (!recentProducts.empty() && startStage()) {
+            bool complete = true;
+            vector<vector<string>> similar;
+            for (const auto& productId : recentProducts) {
+                bool scanned = false;
+                similar.push_back(productAgent.getSimilarProducts(productId, topN, {}, deadline, scanned));
+                if (!scanned) {
+                    complete = false;
+                    break;
+                }
+            }
+            vector<const vector<string>*> similarLists;
+            for (const auto& list : similar) similarLists.push_back(&list);
+            add(mergeSimilar(similarLists, topN));
+            finishStage("similarity", complete);
+        }
+
+        if (!segment.empty() && startStage()) {
+            bool complete = false;
+            add(getSegmentRecommendations(segment, topN, deadline, &complete));
+            finishStage("segment", complete);
+        }
+
+        if (startStage()) {
+            bool complete = false;
+            add(getFallbackRecommendations(topN, deadline, &complete));
+            finishStage("popular", complete);
+        }
+        return response;
+    }
+
+    // Offline job: the same strategies as getRecommendations for every
+    // customer, loaded with a handful of queries. Similar lists are computed
+    // once per distinct seed product, in parallel partitions that share this
+    // agent's product vectors.
+    map<string, vector<string>> precomputeAll(int topN = 5, unsigned partitions = thread::hardware_concurrency()) {
+        map<string, vector<string>> lists;
+        auto customers = db.executeQuery("SELECT customer_id, segment FROM customers");
+        if (customers.empty()) return lists;
+
+        unordered_map<string, vector<string>> recent;
+        if (interactionLog) {
+            for (const auto& row : customers) {
+                recent[row.at("customer_id")] = getRecentInteractions(row.at("customer_id"));
+            }
+        } else {
+            auto rows = db.executeQuery(
+                "SELECT customer_id, product_id FROM (SELECT customer_id, product_id, ROW_NUMBER() OVER "
+                "(PARTITION BY customer_id ORDER BY timestamp DESC) AS position FROM interactions) "
+                "WHERE position <= 3 ORDER BY customer_id, position");
+            for (const auto& row : rows) recent[row.at("customer_id")].push_back(row.at("product_id"));
+        }
+
+        vector<string> seeds;
+        for (const auto& [customerId, products] : recent) seeds.insert(seeds.end(), products.begin(), products.end());
+        sort(seeds.begin(), seeds.end());
+        seeds.erase(unique(seeds.begin(), seeds.end()), seeds.end());
+
+        partitions = max(1u, min<unsigned>(partitions, static_cast<unsigned>(seeds.size())));
+        size_t chunk = (seeds.size() + partitions - 1) / partitions;
+        vector<future<vector<vector<string>>>> workers;
+        for (size_t start = 0; start < seeds.size(); start += chunk) {
+            vector<string> part(seeds.begin() + start, seeds.begin() + min(seeds.size(), start + chunk));
+            workers.push_back(async(launch::async, [this, part = move(part), topN] {
+                return productAgent.getSimilarProductsBatch(part, topN);
+            }));
+        }
+        unordered_map<string, vector<string>> similar;
+        size_t next = 0;
+        for (auto& worker : workers) {
+            for (auto& list : worker.get()) similar[seeds[next++]] = move(list);
+        }
+
+        map<string, vector<string>> segmentLists;
+        vector<string> fallback;
+        for (const auto& row : customers) {
+            const string& customerId = row.at("customer_id");
+            vector<const vector<string>*> similarLists;
+            for (const auto& productId : recent[customerId]) similarLists.push_back(&similar[productId]);
+            vector<string> list = personalize(recent[customerId], similarLists, topN);
+            if (list.empty()) {
+                const string& segment = row.at("segment");
+                auto known = segmentLists.find(segment);
+                if (known == segmentLists.end()) {
+                    known = segmentLists.emplace(segment, getSegmentRecommendations(segment, topN)).first;
+                }
+                list = known->second;
+            }
+            if (list.empty()) {
+                if (fallback.empty()) fallback = getFallbackRecommendations(topN);
+                list = fallback;
+            }
+            lists[customerId] = move(list);
+        }
+        return lists;
+    }
+
 private:
+    using Deadline = chrono::steady_clock::time_point;
+
     Database& db;
     ProductAgent productAgent;
+    const InteractionLog* interactionLog;
+    const RecommendationStore* precomputed = nullptr;
+    time_t precomputedMaxAge = 0;
+    mutex activeMutex;
+    unordered_set<string> activeSinceBatch; // used when there is no interaction log
+    const NextItemModel* nextItems = nullptr;
+
+    // Next-item predictions for the recent sequence (newest first) come first,
+    // then similar products fill the list
+    vector<string> personalize(const vector<string>& recentProducts,
+                               const vector<const vector<string>*>& similarLists, int topN) const {
+        vector<string> result;
+        if (nextItems) result = nextItems->next(vector<string>(recentProducts.rbegin(), recentProducts.rend()), topN);
+        for (auto& productId : mergeSimilar(similarLists, topN)) {
+            if (result.size() >= static_cast<size_t>(topN)) break;
+            if (find(result.begin(), result.end(), productId) == result.end()) result.push_back(move(productId));
+        }
+        return result;
+    }
 
-    vector<string> getRecentInteractions(const string& customerId, int limit = 3) {
-        auto result = db.executeQuery(
-            "SELECT product_id FROM interactions WHERE customer_id = '" + customerId + 
-            "' ORDER BY timestamp DESC LIMIT " + to_string(limit));
-        vector<string> products;
-        for (const auto& row : result) {
-            products.push_back(row.at("product_id"));
+    // Union of the per-seed lists, deduplicated and limited to topN
+    static vector<string> mergeSimilar(const vector<const vector<string>*>& similarLists, int topN) {
+        vector<string> similarProducts;
+        for (const auto* list : similarLists) similarProducts.insert(similarProducts.end(), list->begin(), list->end());
+        sort(similarProducts.begin(), similarProducts.end());
+        similarProducts.erase(unique(similarProducts.begin(), similarProducts.end()), similarProducts.end());
+        if (similarProducts.size() > static_cast<size_t>(topN)) {
+            similarProducts.resize(topN);
         }
-        return products;
+        return similarProducts;
+    }
+
+    bool isStale(const string& customerId) {
+        time_t generatedAt = precomputed->generatedAt();
+        if (time(nullptr) - generatedAt > precomputedMaxAge) return true;
+        if (interactionLog) {
+            auto latest = interactionLog->recentForCustomer(customerId, 1);
+            return !latest.empty() && latest[0].timestamp > generatedAt;
+        }
+        lock_guard<mutex> lock(activeMutex);
+        return activeSinceBatch.count(customerId) > 0;
+    }
+
+    vector<string> getRecentInteractions(const string& customerId, int limit = 3,
+                                         Deadline deadline = Deadline::max(), bool* complete = nullptr) {
+        if (complete) *complete = true;
+        if (interactionLog) {
+            vector<string> products;
+            for (const auto& event : interactionLog->recentForCustomer(customerId, limit)) {
+                products.push_back(event.productId);
+            }
+            return products;
+        }
+        return productColumn(
+            "SELECT product_id FROM interactions WHERE customer_id = '" + customerId + 
+            "' ORDER BY timestamp DESC LIMIT " + to_string(limit), deadline, complete);
     }
 
-    vector<string> getSegmentRecommendations(const string& segment, int topN) {
-        auto result = db.executeQuery(
+    vector<string> getSegmentRecommendations(const string& segment, int topN,
+                                             Deadline deadline = Deadline::max(), bool* complete = nullptr) {
+        return productColumn(
             "SELECT p.product_id FROM products p "
             "JOIN purchases pu ON p.product_id = pu.product_id "
             "JOIN customers c ON pu.customer_id = c.customer_id "
             "WHERE c.segment = '" + segment + "' "
             "GROUP BY p.product_id ORDER BY COUNT(pu.purchase_id) DESC "
-            "LIMIT " + to_string(topN));
-        vector<string> products;
-        for (const auto& row : result) {
-            products.push_back(row.at("product_id"));
-        }
-        return products;
+            "LIMIT " + to_string(topN), deadline, complete);
+    }
+
+    vector<string> getFallbackRecommendations(int topN, Deadline deadline = Deadline::max(), bool* complete = nullptr) {
+        return productColumn(
+            "SELECT product_id FROM products ORDER BY popularity_score DESC LIMIT " + to_string(topN),
+            deadline, complete);
     }
 
-    vector<string> getFallbackRecommendations(int topN) {
-        auto result = db.executeQuery(
-            "SELECT product_id FROM products ORDER BY popularity_score DESC LIMIT " + to_string(topN));
+    // product_id of each row; without a deadline the query runs to completion
+    vector<string> productColumn(const string& sql, Deadline deadline, bool* complete) {
+        bool finished = true;
+        auto result = deadline == Deadline::max() ? db.executeQuery(sql) : db.executeQuery(sql, deadline, finished);
+        if (complete) *complete = finished;
         vector<string> products;
         for (const auto& row : result) {
             products.push_back(row.at("product_id"));
@@ -528,6 +3015,16 @@ class ECommerceEnvironment {
 public:
     ECommerceEnvironment() : db("ecommerce_recommendations.db") {
         initializeDatabase(db);
+        if (interactions.open("ecommerce_interactions")) {
+            interactionLog = &interactions;
+            // Each run is a compaction point for records past retention
+            interactions.compact(time(0) - kInteractionRetentionDays * 86400);
+        }
+        nextItems.build(db, interactionLog);
+        // Attribute new activity to the segments assigned on earlier runs
+        for (const auto& row : db.executeQuery("SELECT customer_id, segment FROM customers")) {
+            activity.setCustomerSegment(row.at("customer_id"), row.at("segment"));
+        }
     }
 
     void addSampleData() {
@@ -565,38 +3062,64 @@ public:
 
         for (const auto& product : products) {
             productAgent.addProduct(product);
+            trending.setProductCategory(product.at("product_id"), product.at("category"));
         }
 
-        // Add sample customers and interactions
+        // Add sample customers, segment them, then record their interactions
+        // so activity is counted under the segment each customer is in
         CustomerAgent customer1(db, "CUST001");
+        customer1.addSink(&trending);
+        customer1.addSink(&activity);
+        customer1.addSink(&nextItems);
+        customer1.setInteractionLog(interactionLog);
         customer1.updateProfile({
             {"name", "John Doe"},
             {"age", "32"},
             {"gender", "male"},
             {"location", "New York"}
         });
-        customer1.recordInteraction("P1001", InteractionType::VIEW, 120);
-        customer1.recordInteraction("P1001", InteractionType::CART_ADD);
-        customer1.recordPurchase("P1001", 1, 99.99);
 
         CustomerAgent customer2(db, "CUST002");
+        customer2.addSink(&trending);
+        customer2.addSink(&activity);
+        customer2.addSink(&nextItems);
+        customer2.setInteractionLog(interactionLog);
         customer2.updateProfile({
             {"name", "Jane Smith"},
             {"age", "28"},
             {"gender", "female"},
             {"location", "Los Angeles"}
         });
+        refreshSegments();
+
+        customer1.recordInteraction("P1001", InteractionType::VIEW, 120);
+        customer1.recordInteraction("P1001", InteractionType::CART_ADD);
+        customer1.recordPurchase("P1001", 1, 99.99);
         customer2.recordInteraction("P1002", InteractionType::VIEW, 180);
         customer2.recordInteraction("P1003", InteractionType::WISHLIST);
     }
 
     void runDemo() {
-        // Update customer segments
-        SegmentationAgent segmentationAgent(db);
-        segmentationAgent.updateCustomerSegments();
+        // Today's activity stays under the segments it was recorded with;
+        // the new assignment applies from here on
+        map<string, double> activeBySegment;
+        long today = ActivityCounters::dayNumber(time(0));
+        for (const auto& row : db.executeQuery("SELECT DISTINCT segment FROM customers")) {
+            activeBySegment[row.at("segment")] = activity.activeCustomersInSegment(row.at("segment"), today, today);
+        }
+        refreshSegments();
 
         // Get recommendations for customers
-        RecommendationAgent recommendationAgent(db);
+        RecommendationAgent recommendationAgent(db, interactionLog);
+        recommendationAgent.setNextItemModel(&nextItems);
+        auto quickRecs = recommendationAgent.getRecommendations("CUST002", 3, chrono::milliseconds(20));
+        time_t batchStart = time(0);
+        auto batch = recommendationAgent.precomputeAll();
+        RecommendationStore precomputed;
+        if (RecommendationStore::write("ecommerce_recommendations.kv", batch, batchStart) &&
+            precomputed.open("ecommerce_recommendations.kv")) {
+            recommendationAgent.setPrecomputed(&precomputed);
+        }
         auto customer1Recs = recommendationAgent.getRecommendations("CUST001");
         auto customer2Recs = recommendationAgent.getRecommendations("CUST002");
 
@@ -604,6 +3127,47 @@ public:
         ProductAgent productAgent(db);
         cout << "\nRecommendation System Demo:" << endl;
         
+        cout << "\nPrecomputed recommendation lists: " << batch.size() << endl;
+        
+        cout << "\nCompletions for \"s\":";
+        for (const auto& name : productAgent.autocomplete("s")) {
+            cout << " [" << name << "]";
+        }
+        cout << endl;
+        
+        cout << "\nActive customers today: ~" << llround(activity.activeCustomers(today, today));
+        for (const auto& [segment, active] : activeBySegment) {
+            cout << (segment == activeBySegment.begin()->first ? " (" : ", ") << segment << " ~" << llround(active);
+        }
+        cout << (activeBySegment.empty() ? "" : ")") << endl;
+        cout << "Unique viewers of Wireless Headphones this week: ~"
+             << llround(activity.uniqueViewers("P1001", today - 6, today)) << endl;
+        
+        cout << "\nTrending now:" << endl;
+        for (const auto& [productId, score] : trending.topTrending(3)) {
+            cout << "- " << productAgent.getProductDetails(productId)["name"] << " (score " << score << ")" << endl;
+        }
+        
+        cout << "\nShoppers who viewed Smartphone next looked at:" << endl;
+        for (const auto& productId : nextItems.next({"P1002"}, 3)) {
+            cout << "- " << productAgent.getProductDetails(productId)["name"] << endl;
+        }
+        
+        cout << "\nElectronics under $800 similar to Wireless Headphones:" << endl;
+        ProductFilter electronics;
+        electronics.category = "Electronics";
+        electronics.maxPrice = 800;
+        for (const auto& productId : productAgent.getSimilarProducts("P1001", 3, electronics)) {
+            auto product = productAgent.getProductDetails(productId);
+            cout << "- " << product["name"] << " ($" << product["price"] << ")" << endl;
+        }
+        
+        cout << "\nSearch results for \"wireless headphones\":" << endl;
+        for (const auto& productId : productAgent.searchProducts("wireless headphones", 3)) {
+            auto product = productAgent.getProductDetails(productId);
+            cout << "- " << product["name"] << " ($" << product["price"] << ")" << endl;
+        }
+        
         cout << "\nRecommendations for John Doe (CUST001):" << endl;
         for (const auto& productId : customer1Recs) {
             auto product = productAgent.getProductDetails(productId);
@@ -615,13 +3179,551 @@ public:
             auto product = productAgent.getProductDetails(productId);
             cout << "- " << product["name"] << " ($" << product["price"] << ")" << endl;
         }
+        
+        cout << "\nWithin 20 ms for Jane Smith (stages:";
+        for (const auto& stage : quickRecs.completedStages) {
+            cout << " " << stage;
+        }
+        cout << (quickRecs.timedOut ? "; timed out" : "") << "):" << endl;
+        for (const auto& productId : quickRecs.products) {
+            cout << "- " << productAgent.getProductDetails(productId)["name"] << endl;
+        }
     }
 
 private:
+    static constexpr time_t kInteractionRetentionDays = 365;
+
     Database db;
+    TrendingTracker trending;
+    ActivityCounters activity;
+    NextItemModel nextItems;
+    InteractionLog interactions;
+    InteractionLog* interactionLog = nullptr; // null when the log can't be opened
+
+    void refreshSegments() {
+        SegmentationAgent segmentationAgent(db, interactionLog);
+        for (const auto& [customerId, segment] : segmentationAgent.updateCustomerSegments()) {
+            activity.setCustomerSegment(customerId, segment);
+        }
+    }
 };
 
-int main() {
+// Behavioral checks of the retrieval structures against brute-force
+// reference computations. Run with --self-check; any failure makes the exit
+// code 1.
+bool runSelfChecks() {
+    int failures = 0;
+    auto check = [&failures](bool ok, const string& name) {
+        cout << (ok ? "ok    " : "FAIL  ") << name << endl;
+        if (!ok) failures++;
+    };
+
+    {
+        // Block-max WAND returns the exhaustive BM25 top k, including lists
+        // long enough to span sealed blocks
+        mt19937 gen(17);
+        vector<string> vocabulary;
+        for (int i = 0; i < 60; i++) vocabulary.push_back("w" + to_string(i));
+        vector<vector<string>> documents;
+        SearchIndex index;
+        for (int d = 0; d < 2000; d++) {
+            vector<string> tokens;
+            string text;
+            size_t length = 3 + gen() % 30;
+            for (size_t i = 0; i < length; i++) {
+                // Skewed term choice so some lists are long and some short
+                string token = vocabulary[min(gen() % 60, gen() % 60)];
+                tokens.push_back(token);
+                text += token + " ";
+            }
+            documents.push_back(tokens);
+            index.addDocument("D" + to_string(d), text);
+        }
+
+        double avgLength = 0;
+        unordered_map<string, double> docFreq;
+        for (const auto& tokens : documents) {
+            avgLength += tokens.size();
+            for (const auto& term : set<string>(tokens.begin(), tokens.end())) docFreq[term]++;
+        }
+        avgLength /= documents.size();
+
+        bool matches = true;
+        for (int q = 0; q < 200 && matches; q++) {
+            set<string> terms;
+            size_t numTerms = 1 + gen() % 4;
+            string query;
+            for (size_t i = 0; i < numTerms; i++) {
+                terms.insert(vocabulary[gen() % 60]);
+            }
+            for (const auto& term : terms) query += term + " ";
+            vector<double> exhaustive;
+            for (const auto& tokens : documents) {
+                double score = 0;
+                for (const auto& term : terms) {
+                    double tf = count(tokens.begin(), tokens.end(), term);
+                    if (tf == 0) continue;
+                    double df = docFreq[term];
+                    double idf = log(1.0 + (documents.size() - df + 0.5) / (df + 0.5));
+                    score += idf * tf * 2.2 / (tf + 1.2 * (0.25 + 0.75 * tokens.size() / avgLength));
+                }
+                if (score > 0) exhaustive.push_back(score);
+            }
+            sort(exhaustive.rbegin(), exhaustive.rend());
+            size_t k = 1 + gen() % 20;
+            exhaustive.resize(min(k, exhaustive.size()));
+            auto results = index.search(query, k);
+            matches = results.size() == exhaustive.size();
+            for (size_t i = 0; matches && i < results.size(); i++) {
+                matches = fabs(results[i].second - exhaustive[i]) < 1e-9;
+            }
+        }
+        check(matches, "search: block-max WAND matches exhaustive BM25");
+    }
+
+    {
+        // Bitmap-filtered similarity equals scoring everything and filtering
+        // afterwards; one category is large enough for bitset containers and
+        // a NULL price reads as 0
+        Database db(":memory:");
+        initializeDatabase(db);
+        mt19937 gen(23);
+        const vector<string> categories = {"Electronics", "Sports", "Home"};
+        map<string, pair<string, double>> catalog; // id -> (category, price)
+        {
+            ProductAgent loader(db);
+            for (int i = 0; i < 6000; i++) {
+                string id = "Q" + to_string(i);
+                string category = categories[i % 5 == 0 ? 1 + gen() % 2 : 0];
+                double price = 1 + gen() % 2000 / 4.0;
+                bool nullPrice = i == 7;
+                loader.addProduct({{"product_id", id}, {"name", "Item " + to_string(i)}, {"category", category},
+                                   {"price", nullPrice ? "NULL" : to_string(price)},
+                                   {"description", "synthetic product " + to_string(i * 7919)},
+                                   {"tags", "[]"}, {"popularity_score", "NULL"}});
+                catalog[id] = {category, nullPrice ? 0.0 : price};
+            }
+        }
+        ProductAgent agent(db);
+        bool same = true;
+        for (int q = 0; q < 20 && same; q++) {
+            string seed = "Q" + to_string(gen() % 6000);
+            ProductFilter filter;
+            if (q % 3 != 1) filter.category = categories[gen() % 3];
+            if (q % 3 != 0) {
+                filter.minPrice = q % 2 ? 0.0 : 50 + gen() % 100;
+                filter.maxPrice = filter.minPrice + 20 + gen() % 200;
+            }
+            vector<string> expected;
+            for (const auto& id : agent.getSimilarProducts(seed, 6000)) {
+                const auto& [category, price] = catalog[id];
+                if ((filter.category.empty() || category == filter.category) && price >= filter.minPrice &&
+                    price <= filter.maxPrice && expected.size() < 10) {
+                    expected.push_back(id);
+                }
+            }
+            same = agent.getSimilarProducts(seed, 10, filter) == expected;
+        }
+        ProductFilter free;
+        free.maxPrice = 0.5;
+        vector<string> nullPriced = agent.getSimilarProducts("Q0", 5, free);
+        check(same && nullPriced == vector<string>{"Q7"}, "filter: bitmap filtering matches post-filtering");
+    }
+
+    {
+        // HyperLogLog stays within four standard errors whether sparse or
+        // dense, sparse sketches stay small, and merged days count the union
+        bool bounded = true;
+        for (size_t n : {10, 100, 200, 1000, 50000}) {
+            HyperLogLog sketch(10);
+            for (size_t i = 0; i < n; i++) sketch.add("C" + to_string(i));
+            bounded = bounded && fabs(sketch.estimate() - n) <= 4 * sketch.relativeError() * n + 1;
+        }
+        HyperLogLog small(10), first(14), second(14);
+        for (int i = 0; i < 20; i++) small.add("C" + to_string(i));
+        for (int i = 0; i < 30000; i++) first.add("C" + to_string(i));
+        for (int i = 20000; i < 40000; i++) second.add("C" + to_string(i));
+        first.merge(second);
+        bounded = bounded && small.bytes() <= 20 * sizeof(uint32_t) &&
+                  fabs(first.estimate() - 40000) <= 4 * first.relativeError() * 40000;
+        check(bounded, "sketch: HyperLogLog estimates within error bounds");
+
+        // Count-min never undercounts and overcounts by at most 2/kWidth of
+        // the total for nearly every key
+        CountMinSketch counts;
+        mt19937 gen(29);
+        vector<uint32_t> truth(5000, 0);
+        uint64_t total = 0;
+        for (int i = 0; i < 200000; i++) {
+            size_t key = min(gen() % truth.size(), gen() % truth.size()); // skewed
+            uint32_t weight = 1 + gen() % 3;
+            truth[key] += weight;
+            total += weight;
+            counts.add(hash<string>()("K" + to_string(key)), weight);
+        }
+        size_t over = 0;
+        bool neverUnder = true;
+        for (size_t key = 0; key < truth.size(); key++) {
+            uint32_t estimate = counts.estimate(hash<string>()("K" + to_string(key)));
+            neverUnder = neverUnder && estimate >= truth[key];
+            over += estimate - truth[key] > 2.0 * total / CountMinSketch::kWidth;
+        }
+        check(neverUnder && over <= truth.size() / 100, "sketch: count-min error within bounds");
+    }
+
+    {
+        // The interaction log reads back the same after a reopen and after
+        // compaction, and open() clears packed segments an interrupted
+        // compaction left behind
+        const string dir = "self-check-log";
+        auto removeDirectory = [&dir] {
+            if (DIR* handle = opendir(dir.c_str())) {
+                while (dirent* entry = readdir(handle)) {
+                    string name = entry->d_name;
+                    if (name != "." && name != "..") unlink((dir + "/" + name).c_str());
+                }
+                closedir(handle);
+            }
+            rmdir(dir.c_str());
+        };
+        auto history = [](const InteractionLog& log) {
+            vector<pair<time_t, string>> events;
+            for (int c = 0; c < 7; c++) {
+                for (const auto& event : log.recentForCustomer("C" + to_string(c), SIZE_MAX)) {
+                    events.push_back({event.timestamp, event.productId});
+                }
+            }
+            return events;
+        };
+        removeDirectory();
+        const uint64_t total = InteractionLog::kSegmentRecords * 3 + 100;
+        const time_t cutoff = 1000 + InteractionLog::kSegmentRecords + 500;
+        bool roundTrip = true;
+        vector<pair<time_t, string>> expected;
+        {
+            InteractionLog log;
+            roundTrip = log.open(dir);
+            for (uint64_t i = 0; roundTrip && i < total; i++) {
+                roundTrip = log.append("C" + to_string(i % 7), "P" + to_string(i % 11), InteractionType::VIEW, 1000 + i, 0);
+            }
+            expected = history(log);
+        }
+        {
+            InteractionLog log;
+            roundTrip = roundTrip && log.open(dir) && log.size() == total && history(log) == expected;
+        }
+        ofstream(dir + "/compacting-segment-00000000.log") << "partial";
+        bool compacted = true;
+        {
+            InteractionLog log;
+            compacted = log.open(dir) && log.compact(cutoff) && log.size() == total - (cutoff - 1000);
+        }
+        expected.erase(remove_if(expected.begin(), expected.end(),
+                                 [cutoff](const auto& event) { return event.first < cutoff; }),
+                       expected.end());
+        {
+            InteractionLog log;
+            compacted = compacted && log.open(dir) && log.size() == total - (cutoff - 1000) &&
+                        history(log) == expected;
+        }
+        bool leftovers = false;
+        if (DIR* handle = opendir(dir.c_str())) {
+            while (dirent* entry = readdir(handle)) {
+                string name = entry->d_name;
+                leftovers = leftovers || name.rfind("compact", 0) == 0;
+            }
+            closedir(handle);
+        }
+        removeDirectory();
+        check(roundTrip, "log: records survive close and reopen");
+        check(compacted && !leftovers, "log: compaction keeps recent records in order");
+    }
+
+    {
+        // Precomputed lists read back by customer, the hash is the fixed
+        // FNV-1a, and a file whose offsets point outside their sections is
+        // rejected rather than mapped
+        const string path = "self-check.kv";
+        map<string, vector<string>> lists;
+        for (int c = 0; c < 300; c++) {
+            for (int i = 0; i < c % 6; i++) lists["C" + to_string(c)].push_back("P" + to_string((c * 7 + i) % 50));
+        }
+        RecommendationStore store;
+        bool readBack = RecommendationStore::write(path, lists, 1000) && store.open(path) &&
+                        RecommendationStore::customerHash("a") == 0xaf63dc4c8601ec8cull;
+        for (const auto& [customerId, list] : lists) {
+            vector<string> found;
+            readBack = readBack && store.lookup(customerId, found) && found == list;
+        }
+        vector<string> missing;
+        readBack = readBack && !store.lookup("C300", missing);
+        check(readBack, "store: precomputed lists round trip");
+
+        string bytes;
+        {
+            ifstream in(path, ios::binary);
+            bytes.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        }
+        RecommendationFileHeader header;
+        memcpy(&header, bytes.data(), sizeof(header));
+        size_t firstListItem = sizeof(header) + header.customerCount * sizeof(RecommendationEntry) +
+                               header.productCount * sizeof(StringRef);
+        auto rejects = [&](size_t offset, uint32_t value) {
+            string corrupt = bytes;
+            memcpy(&corrupt[offset], &value, sizeof(value));
+            ofstream(path, ios::binary | ios::trunc) << corrupt;
+            RecommendationStore damaged;
+            vector<string> list;
+            return !damaged.open(path) && !damaged.lookup("C1", list);
+        };
+        bool rejected = rejects(firstListItem, header.productCount) &&
+                        rejects(sizeof(header) + offsetof(RecommendationEntry, listOffset), header.listItemCount) &&
+                        rejects(firstListItem - sizeof(StringRef), static_cast<uint32_t>(header.stringBytes));
+        unlink(path.c_str());
+        check(rejected, "store: out-of-range offsets are rejected");
+    }
+
+    {
+        // A budgeted request serves a fresh precomputed list, and one whose
+        // budget is already spent runs no stage at all
+        const string path = "self-check.kv";
+        Database db(":memory:");
+        initializeDatabase(db);
+        RecommendationStore store;
+        bool served = RecommendationStore::write(path, {{"C1", {"P1", "P2"}}}, time(0)) && store.open(path);
+        RecommendationAgent agent(db);
+        agent.setPrecomputed(&store);
+        auto fresh = agent.getRecommendations("C1", 2, chrono::milliseconds(50));
+        auto spent = agent.getRecommendations("C1", 2, chrono::microseconds(0));
+        unlink(path.c_str());
+        served = served && fresh.products == vector<string>{"P1", "P2"} && !fresh.timedOut &&
+                 fresh.completedStages == vector<string>{"precomputed"};
+        check(served && spent.products.empty() && spent.timedOut && spent.completedStages.empty(),
+              "budget: precomputed stage respects the deadline");
+    }
+
+    {
+        // Completions equal a linear scan for names with a word starting
+        // with the prefix, ranked by popularity, after a reset plus
+        // incremental adds; entries added before a reset never reappear
+        mt19937 gen(31);
+        const vector<string> words = {"wireless", "Headphones", "smart", "Watch", "running", "shoes",
+                                      "coffee", "maker", "smartphone", "case", "wool", "socks"};
+        vector<AutocompleteEntry> all;
+        for (int i = 0; i < 3000; i++) {
+            string name = words[gen() % words.size()];
+            for (size_t w = gen() % 3; w > 0; w--) name += (gen() % 2 ? " " : "-") + words[gen() % words.size()];
+            all.push_back({"A" + to_string(i), name + " " + to_string(i), i * 0.37 + (i % 7) * 1000});
+        }
+        AutocompleteService service;
+        service.reset(vector<AutocompleteEntry>(all.begin(), all.begin() + 2000));
+        for (size_t i = 2000; i < all.size(); i++) service.add(all[i]);
+        service.waitForBuild();
+
+        auto lower = [](string value) {
+            for (char& c : value) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+            return value;
+        };
+        bool same = true;
+        for (const char* prefix : {"s", "Sm", "smartp", "wa", "HEAD", "c", "wool s", "1", "42", "zz"}) {
+            string needle = lower(prefix);
+            vector<const AutocompleteEntry*> matches;
+            for (const auto& entry : all) {
+                string name = lower(entry.name);
+                for (size_t i = 0; i < name.size(); i++) {
+                    bool wordStart = isalnum(static_cast<unsigned char>(name[i])) &&
+                                     (i == 0 || !isalnum(static_cast<unsigned char>(name[i - 1])));
+                    if (wordStart && name.compare(i, needle.size(), needle) == 0) {
+                        matches.push_back(&entry);
+                        break;
+                    }
+                }
+            }
+            sort(matches.begin(), matches.end(),
+                 [](const AutocompleteEntry* a, const AutocompleteEntry* b) { return a->popularity > b->popularity; });
+            vector<string> expected;
+            for (size_t i = 0; i < matches.size() && i < 8; i++) expected.push_back(matches[i]->name);
+            same = same && service.complete(prefix, 8) == expected;
+        }
+
+        bool dropped = true;
+        for (int round = 0; round < 50 && dropped; round++) {
+            for (int i = 0; i < 20; i++) service.add({"S" + to_string(i), "stale item", 1e9});
+            service.reset({{"F", "fresh item", 1.0}});
+            service.waitForBuild();
+            dropped = service.complete("stale", 5).empty() && service.complete("item", 5) == vector<string>{"fresh item"};
+        }
+        check(same && dropped, "autocomplete: completions match a linear prefix scan");
+    }
+
+    {
+        // Next-item rankings after a build plus incremental interactions
+        // equal counts recomputed from the same streams, including products
+        // that overtake the last kept top-K entry
+        Database db(":memory:");
+        initializeDatabase(db);
+        mt19937 gen(37);
+        auto product = [&gen] {
+            char id[8];
+            snprintf(id, sizeof(id), "P%02u", static_cast<unsigned>(min(gen() % 30, gen() % 30)));
+            return string(id);
+        };
+        map<string, vector<string>> streams; // deduplicated like the model's
+        auto observe = [&streams](const string& customerId, const string& productId) {
+            auto& stream = streams[customerId];
+            if (stream.empty() || stream.back() != productId) stream.push_back(productId);
+        };
+        db.execute("BEGIN");
+        for (int event = 0; event < 1200; event++) {
+            string customerId = "C" + to_string(gen() % 40);
+            string productId = product();
+            char timestamp[32];
+            snprintf(timestamp, sizeof(timestamp), "2026-01-01 %02d:%02d:%02d", event / 3600, event / 60 % 60, event % 60);
+            db.execute("INSERT INTO interactions (customer_id, product_id, interaction_type, timestamp, duration) VALUES ('" +
+                       customerId + "', '" + productId + "', 'view', '" + timestamp + "', 0)");
+            observe(customerId, productId);
+        }
+        db.execute("COMMIT");
+        NextItemModel model;
+        model.build(db, nullptr, 3);
+        for (int event = 0; event < 4000; event++) {
+            string customerId = "C" + to_string(gen() % 50);
+            string productId = product();
+            model.onInteraction(customerId, productId, InteractionType::VIEW, 0);
+            observe(customerId, productId);
+        }
+
+        map<pair<string, string>, map<string, int>> counts; // (previous or "", latest) -> next -> count
+        for (const auto& [customerId, stream] : streams) {
+            for (size_t j = 1; j < stream.size(); j++) {
+                counts[{"", stream[j - 1]}][stream[j]]++;
+                if (j >= 2) counts[{stream[j - 2], stream[j - 1]}][stream[j]]++;
+            }
+        }
+        auto ranked = [&counts](const string& previous, const string& latest) {
+            auto row = counts.find({previous, latest});
+            if (row == counts.end() && !previous.empty()) row = counts.find({"", latest});
+            vector<pair<int, string>> order;
+            if (row != counts.end()) {
+                for (const auto& [next, count] : row->second) order.push_back({-count, next});
+            }
+            sort(order.begin(), order.end());
+            vector<string> result;
+            for (size_t i = 0; i < order.size() && i < NextItemModel::kTopK; i++) result.push_back(order[i].second);
+            return result;
+        };
+        bool exact = true;
+        for (const auto& [customerId, stream] : streams) {
+            string previous = stream.size() >= 2 ? stream[stream.size() - 2] : "";
+            vector<string> expected = ranked(previous, stream.back());
+            exact = exact && model.nextForCustomer(customerId, NextItemModel::kTopK) == expected &&
+                    model.next(stream, NextItemModel::kTopK) == expected;
+        }
+        check(exact, "next-item: top-K matches recomputed transition counts");
+    }
+
+    {
+        // Trending ranks a few dominant products above a long tail of
+        // one-off products in the exact decayed order. Scores never fall
+        // below the exact value and stay inside the sketches' error bound.
+        // Buckets older than the window drop out.
+        const int bucketSeconds = 60;
+        const double halfLife = 3.0;
+        TrendingTracker trending(bucketSeconds, halfLife);
+        const long current = 30000000;
+        const time_t now = static_cast<time_t>(current) * bucketSeconds + 30;
+        const InteractionType types[] = {InteractionType::VIEW, InteractionType::CART_ADD, InteractionType::WISHLIST,
+                                         InteractionType::PURCHASE};
+        const int typeWeights[] = {1, 3, 2, 5};
+        mt19937 gen(41);
+        for (int i = 0; i < 5; i++) trending.setProductCategory("H" + to_string(i), i % 2 ? "b" : "a");
+
+        map<string, double> exact;
+        double errorBound = 0.0;
+        int tail = 0;
+        for (long age = TrendingTracker::kBuckets + 1; age >= 0; age--) {
+            vector<string> events;
+            for (int i = 0; i < 5; i++) events.insert(events.end(), (5 - i) * 40, "H" + to_string(i));
+            if (age >= static_cast<long>(TrendingTracker::kBuckets)) events.insert(events.end(), 5000, "OLD");
+            for (int i = 0; i < 350; i++, tail++) {
+                string productId = "T" + to_string(tail);
+                trending.setProductCategory(productId, tail % 2 ? "b" : "a");
+                events.push_back(productId);
+            }
+            shuffle(events.begin(), events.end(), gen);
+            double weight = pow(0.5, age / halfLife);
+            double total = 0.0;
+            for (const auto& productId : events) {
+                size_t type = gen() % 4;
+                time_t when = static_cast<time_t>(current - age) * bucketSeconds + gen() % bucketSeconds;
+                trending.onInteraction("C1", productId, types[type], when);
+                total += typeWeights[type];
+                if (age < static_cast<long>(TrendingTracker::kBuckets)) exact[productId] += typeWeights[type] * weight;
+            }
+            if (age < static_cast<long>(TrendingTracker::kBuckets)) {
+                errorBound += 2.0 * total / CountMinSketch::kWidth * weight;
+            }
+        }
+
+        auto matches = [&](const vector<pair<string, double>>& top, const vector<string>& expected) {
+            if (top.size() != expected.size()) return false;
+            for (size_t i = 0; i < top.size(); i++) {
+                double truth = exact[expected[i]];
+                if (top[i].first != expected[i] || top[i].second < truth - 1e-6 ||
+                    top[i].second > truth + errorBound) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        bool ok = matches(trending.topTrending(5, "", now), {"H0", "H1", "H2", "H3", "H4"}) &&
+                  matches(trending.topTrending(3, "a", now), {"H0", "H2", "H4"}) &&
+                  matches(trending.topTrending(2, "b", now), {"H1", "H3"}) &&
+                  trending.topTrending(5, "none", now).empty();
+        check(ok, "trending: heavy hitters rank in exact decayed order");
+    }
+
+    {
+        // A new profile takes defaults for the columns not supplied; later
+        // upserts, single or bulk, change only the supplied columns plus
+        // last_activity
+        Database db(":memory:");
+        initializeDatabase(db);
+        CustomerAgent agent(db, "C1");
+        auto row = [&db](const string& customerId) {
+            auto result = db.executeQuery("SELECT name, age, gender, location, segment, preferences, last_activity "
+                                          "FROM customers WHERE customer_id = '" + customerId + "'");
+            return result.empty() ? map<string, string>() : result[0];
+        };
+        bool ok = agent.updateProfile({{"name", "Ada"}, {"age", "36"}, {"location", "Oslo"}});
+        auto created = row("C1");
+        ok = ok && created["name"] == "Ada" && created["age"] == "36" && created["gender"] == "NULL" &&
+             created["location"] == "Oslo" && created["segment"] == "new" && created["preferences"] == "{}";
+
+        ok = ok && agent.updateProfile({{"gender", "F"}, {"preferences", "{\"tags\":1}"}});
+        db.execute("UPDATE customers SET last_activity = '2000-01-01 00:00:00' WHERE customer_id = 'C1'");
+        ok = ok && agent.updateProfile({{"segment", "vip"}});
+        auto updated = row("C1");
+        ok = ok && updated["name"] == "Ada" && updated["age"] == "36" && updated["gender"] == "F" &&
+             updated["location"] == "Oslo" && updated["segment"] == "vip" && updated["preferences"] == "{\"tags\":1}" &&
+             updated["last_activity"] != "2000-01-01 00:00:00";
+
+        ok = ok && CustomerAgent::updateProfiles(db, {{"C1", {{"location", "Bergen"}}}, {"C2", {{"name", "Bo"}}}});
+        auto moved = row("C1"), added = row("C2");
+        updated["location"] = "Bergen";
+        moved["last_activity"] = updated["last_activity"];
+        ok = ok && moved == updated && added["name"] == "Bo" && added["age"] == "NULL" && added["segment"] == "new" &&
+             added["preferences"] == "{}";
+        check(ok, "profiles: upserts touch only the supplied columns");
+    }
+
+    return failures == 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--self-check") {
+        return runSelfChecks() ? 0 : 1;
+    }
     ECommerceEnvironment env;
     env.addSampleData();
     env.runDemo();